@@ -0,0 +1,1071 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Count every heap call the VM makes, executor workers included
+static long bench_allocs;
+#define BENCH_ALLOC() __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED)
+static void * bench_malloc(size_t n) { BENCH_ALLOC(); return malloc(n); }
+static void * bench_calloc(size_t n, size_t m) { BENCH_ALLOC(); return calloc(n, m); }
+static void * bench_realloc(void * p, size_t n) { BENCH_ALLOC(); return realloc(p, n); }
+#define VM_MALLOC bench_malloc
+#define VM_CALLOC bench_calloc
+#define VM_REALLOC bench_realloc
+
+#include "include/cvm_jit.h"
+#include "include/cvm_crypt.h"
+#include "include/cvm_snapshot.h"
+#include "include/cvm_tier.h"
+#include "include/cvm_executor.h"
+
+/*
+ Benchmarks for the execution engines
+
+ Every workload is a bytecode loop with a C equivalent. Each engine runs it
+ `runs` times and the best run, in CPU time, is reported as ns per VM
+ instruction, instructions per second, heap calls per run and slowdown versus
+ the C code.
+
+   cc -O2 -pthread bench.c -o bench && ./bench [--json] [--quick]
+
+ --json prints one JSON document, so results of two builds can be diffed.
+*/
+
+#define BENCH_ITER 100000
+#define BENCH_TRACE_SLICE 4096 // instructions between drains of the trace ring
+
+struct bench_code {
+    char buf[8192];
+    int n;
+};
+
+static void bench_ri(struct bench_code * c, int op, int reg, qword imm) {
+    char * p = c->buf + c->n;
+    p[0] = JOINBITS(11, VM_VAL2REG);
+    p[1] = op;
+    p[2] = JOINBITS(reg, 0);
+    memcpy(p + 3, &imm, 8);
+    c->n += 11;
+}
+
+static void bench_rr(struct bench_code * c, int op, int reg1, int reg2) {
+    char * p = c->buf + c->n;
+    p[0] = JOINBITS(3, VM_REG2REG);
+    p[1] = op;
+    p[2] = JOINBITS(reg1, reg2);
+    c->n += 3;
+}
+
+static void bench_vmem(struct bench_code * c, int variant, int reg, qword offset) {
+    bench_ri(c, VM_MOV, reg, offset);
+    c->buf[c->n - 11] = JOINBITS(11, variant);
+}
+
+// Jumps are relative to their own start, returns where to patch the target
+static int bench_jump(struct bench_code * c, int op) {
+    char * p = c->buf + c->n;
+    int at = c->n;
+    p[0] = JOINBITS(10, VM_VAL2REG);
+    p[1] = op;
+    memset(p + 2, 0, 8);
+    c->n += 10;
+    return at;
+}
+
+static void bench_patch(struct bench_code * c, int at, int target) {
+    qword offset = target - at;
+    memcpy(c->buf + at + 2, &offset, 8);
+}
+
+static void bench_jumpto(struct bench_code * c, int op, int target) {
+    bench_patch(c, bench_jump(c, op), target);
+}
+
+static void bench_push(struct bench_code * c, int reg) {
+    bench_rr(c, VM_PUSH, reg, 0);
+}
+
+static void bench_pushi(struct bench_code * c, qword value) {
+    bench_jump(c, VM_PUSH);
+    memcpy(c->buf + c->n - 8, &value, 8);
+}
+
+static void bench_call(struct bench_code * c, void * fn, int nargs) {
+    bench_ri(c, VM_CALL, nargs, (qword) fn);
+}
+
+static void bench_import(struct bench_code * c, int index) {
+    bench_ri(c, VM_CALL, 0, index);
+    c->buf[c->n - 11] = JOINBITS(11, VM_IMPORT);
+}
+
+// VM_LOAD / VM_STORE of 1 << width bytes at base + index * scale + disp
+static void bench_heap(struct bench_code * c, int op, int width, int reg, int base, int index, int scale, dword disp) {
+    char * p = c->buf + c->n;
+    p[0] = JOINBITS(8, width);
+    p[1] = op;
+    p[2] = JOINBITS(reg, base);
+    p[3] = JOINBITS(index, scale);
+    memcpy(p + 4, &disp, 4);
+    c->n += 8;
+}
+
+static void bench_block(struct bench_code * c, int op, int reg1, int reg2, int count) {
+    char * p = c->buf + c->n;
+    p[0] = JOINBITS(4, 0);
+    p[1] = op;
+    p[2] = JOINBITS(reg1, reg2);
+    p[3] = JOINBITS(count, 0);
+    c->n += 4;
+}
+
+// A vector opcode on registers, `extra` is byte 3 if it has one: vb, a shift
+// count or a lane
+static void bench_vector(struct bench_code * c, int op, int shape, int reg1, int reg2, int extra) {
+    char * p = c->buf + c->n;
+    int len = VM_VECTOR_SIZE(op);
+    p[0] = JOINBITS(len, shape);
+    p[1] = op;
+    p[2] = JOINBITS(reg1, reg2);
+    if (len > 3)
+        p[3] = extra;
+    c->n += len;
+}
+
+enum { RAX, RBX, RCX, RDX, R8, R9, R10, R11 };
+
+// rdx counts from 0 to rbx, the body goes between the two calls
+static int bench_loop_head(struct bench_code * c, int * exit) {
+    int head;
+    bench_ri(c, VM_MOV, RBX, BENCH_ITER);
+    bench_ri(c, VM_MOV, RDX, 0);
+    head = c->n;
+    bench_rr(c, VM_CMP, RDX, RBX);
+    *exit = bench_jump(c, VM_JGE);
+    return head;
+}
+
+static void bench_loop_tail(struct bench_code * c, int head, int exit) {
+    bench_ri(c, VM_ADD, RDX, 1);
+    bench_jumpto(c, VM_JMP, head);
+    bench_patch(c, exit, c->n);
+}
+
+static volatile qword bench_sink, bench_result;
+
+static void build_pow(struct bench_code * c) {
+    int exit, head;
+    bench_ri(c, VM_MOV, RAX, 3);
+    bench_ri(c, VM_MOV, RCX, 3);
+    head = bench_loop_head(c, &exit);
+    bench_rr(c, VM_MUL, RCX, RAX);
+    bench_loop_tail(c, head, exit);
+    bench_rr(c, VM_MOV, RAX, RCX);
+}
+
+static qword native_pow(void) {
+    qword n = bench_sink, r = n;
+    for (qword i = 0; i < BENCH_ITER; i++) {
+        r *= n;
+        __asm__ volatile("" : "+r"(r));
+    }
+    return r;
+}
+
+static qword bench_add(qword a, qword b) {
+    return a + b;
+}
+
+static void build_ffi(struct bench_code * c) {
+    int exit, head = bench_loop_head(c, &exit);
+    bench_push(c, RDX);
+    bench_pushi(c, 7);
+    bench_call(c, (void*) &bench_add, 2);
+    bench_loop_tail(c, head, exit);
+}
+
+static qword native_ffi(void) {
+    qword (* volatile fn)(qword, qword) = bench_add, r = 0;
+    for (qword i = 0; i < BENCH_ITER; i++)
+        r = fn(7, i);
+    return r;
+}
+
+// The counter lives in a qword after the code, addressed with VMEM offsets. A
+// second qword counts runs, so the buffer differs on every call, like code that
+// keeps state in embedded data.
+static void build_vmem(struct bench_code * c) {
+    int exit, head, data, calls;
+    bench_ri(c, VM_MOV, RCX, 0);
+    bench_vmem(c, VM_REG2VMEM, RCX, 0); // patched below
+    head = bench_loop_head(c, &exit);
+    bench_vmem(c, VM_VMEM2REG, RCX, 0);
+    bench_rr(c, VM_ADD, RCX, RDX);
+    bench_vmem(c, VM_REG2VMEM, RCX, 0);
+    bench_loop_tail(c, head, exit);
+    calls = c->n;
+    bench_vmem(c, VM_VMEM2REG, RBX, 0);
+    bench_ri(c, VM_ADD, RBX, 1);
+    bench_vmem(c, VM_REG2VMEM, RBX, 0);
+    bench_rr(c, VM_RET, 0, 0); // empty stack, stops before the data
+    data = c->n;
+    memset(c->buf + data, 0, 16);
+    c->n += 16;
+    for (int at = 0; at < data; at += GETFIRST(c->buf[at]))
+        if (c->buf[at + 1] == VM_MOV && (GETSECOND(c->buf[at]) == VM_REG2VMEM || GETSECOND(c->buf[at]) == VM_VMEM2REG))
+            memcpy(c->buf + at + 3, &(qword){at < calls ? data : data + 8}, 8);
+}
+
+static qword native_vmem(void) {
+    static volatile qword counter;
+    counter = 0;
+    for (qword i = 0; i < BENCH_ITER; i++)
+        counter = counter + i;
+    return counter;
+}
+
+// r9 cycles through 0..7 and picks one of eight cases via a compare chain
+static void build_branch(struct bench_code * c) {
+    int exit, head, skip, cases[8], joins[8];
+    bench_ri(c, VM_MOV, R9, 0);
+    bench_ri(c, VM_MOV, R10, 0);
+    head = bench_loop_head(c, &exit);
+    bench_ri(c, VM_ADD, R9, 1);
+    bench_ri(c, VM_CMP, R9, 8);
+    skip = bench_jump(c, VM_JNE);
+    bench_ri(c, VM_MOV, R9, 0);
+    bench_patch(c, skip, c->n);
+    for (int k = 0; k < 8; k++) {
+        bench_ri(c, VM_CMP, R9, k);
+        cases[k] = bench_jump(c, VM_JE);
+    }
+    for (int k = 0; k < 8; k++) {
+        bench_patch(c, cases[k], c->n);
+        bench_ri(c, VM_ADD, R10, k + 1);
+        joins[k] = bench_jump(c, VM_JMP);
+    }
+    for (int k = 0; k < 8; k++)
+        bench_patch(c, joins[k], c->n);
+    bench_loop_tail(c, head, exit);
+    bench_rr(c, VM_MOV, RAX, R10);
+}
+
+static qword native_branch(void) {
+    volatile qword k = 0;
+    qword r = 0;
+    for (qword i = 0; i < BENCH_ITER; i++) {
+        k = k + 1 == 8 ? 0 : k + 1;
+        switch (k) {
+        case 0: r += 1; break; case 1: r += 2; break; case 2: r += 3; break;
+        case 3: r += 4; break; case 4: r += 5; break; case 5: r += 6; break;
+        case 6: r += 7; break; case 7: r += 8; break;
+        }
+    }
+    return r;
+}
+
+static void build_stack(struct bench_code * c) {
+    int exit, head = bench_loop_head(c, &exit);
+    bench_push(c, RDX);
+    bench_push(c, RBX);
+    bench_pushi(c, 5);
+    bench_push(c, RDX);
+    bench_rr(c, VM_POP, R8, 0);
+    bench_rr(c, VM_POP, R9, 0);
+    bench_rr(c, VM_POP, R10, 0);
+    bench_rr(c, VM_POP, R11, 0);
+    bench_loop_tail(c, head, exit);
+}
+
+static qword native_stack(void) {
+    volatile qword stack[4];
+    qword r = 0;
+    for (qword i = 0; i < BENCH_ITER; i++) {
+        stack[0] = i; stack[1] = BENCH_ITER; stack[2] = 5; stack[3] = i;
+        r += stack[3] + stack[2] + stack[1] + stack[0];
+    }
+    return r;
+}
+
+// Every context gets this heap: bytes to hash, and a block to copy and search
+#define BENCH_BLOCK 1024
+static char bench_heapmem[BENCH_ITER + 4 * BENCH_BLOCK];
+
+// FNV-1a over the heap, one VM_LOAD per byte
+static void build_bytes(struct bench_code * c) {
+    int exit, head;
+    bench_ri(c, VM_MOV, RAX, (qword) 0xcbf29ce484222325ull);
+    bench_ri(c, VM_MOV, R8, 0);
+    head = bench_loop_head(c, &exit);
+    bench_heap(c, VM_LOAD, VM_BYTE, RCX, R8, RDX, 1, 0);
+    bench_rr(c, VM_XOR, RAX, RCX);
+    bench_ri(c, VM_MUL, RAX, 0x100000001b3);
+    bench_loop_tail(c, head, exit);
+}
+
+static qword native_bytes(void) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (qword i = 0; i < BENCH_ITER; i++) {
+        h ^= (unsigned char) bench_heapmem[i];
+        h *= 0x100000001b3;
+    }
+    return (qword) h;
+}
+
+// Copies a block whose last byte is 0xff and searches the copy for it
+static void build_block(struct bench_code * c) {
+    int exit, head;
+    bench_ri(c, VM_MOV, RAX, 0);
+    bench_ri(c, VM_MOV, R8, 0);
+    bench_ri(c, VM_MOV, R10, BENCH_BLOCK);
+    bench_ri(c, VM_MOV, R11, 0xff);
+    head = bench_loop_head(c, &exit);
+    bench_ri(c, VM_MOV, R9, 2 * BENCH_BLOCK);
+    bench_block(c, VM_MEMCPY, R9, R8, R10);
+    bench_block(c, VM_FINDBYTE, R9, R11, R10);
+    bench_rr(c, VM_ADD, RAX, R9);
+    bench_loop_tail(c, head, exit);
+}
+
+static qword native_block(void) {
+    qword r = 0;
+    for (qword i = 0; i < BENCH_ITER; i++) {
+        char * to = bench_heapmem + 2 * BENCH_BLOCK;
+        memcpy(to, bench_heapmem, BENCH_BLOCK);
+        r += (char*) memchr(to, 0xff, BENCH_BLOCK) - bench_heapmem;
+    }
+    return r;
+}
+
+// Slides a 32-byte window over the heap and sums the masks of bytes equal to
+// 0x41, one compare for all 32 bytes
+static void build_simd(struct bench_code * c) {
+    int exit, head;
+    bench_ri(c, VM_MOV, RAX, 0);
+    bench_ri(c, VM_MOV, RCX, 0x41);
+    bench_vector(c, VM_VBCAST, VM_V256 | VM_BYTE, 1, RCX, 0);
+    head = bench_loop_head(c, &exit);
+    bench_heap(c, VM_VLOAD, VM_V256 | VM_BYTE, 0, RDX, 0, 0, 0);
+    bench_vector(c, VM_VCMPEQ, VM_V256 | VM_BYTE, 2, 0, 1);
+    bench_vector(c, VM_VMOVMSK, VM_V256 | VM_BYTE, R8, 2, 0);
+    bench_rr(c, VM_ADD, RAX, R8);
+    bench_loop_tail(c, head, exit);
+}
+
+static qword native_simd(void) {
+    uint64_t r = 0;
+    for (qword i = 0; i < BENCH_ITER; i++) {
+        uint32_t mask = 0;
+        for (int k = 0; k < 32; k++)
+            mask |= (uint32_t)(bench_heapmem[i + k] == 0x41) << k;
+        r += mask;
+    }
+    return (qword) r;
+}
+
+struct bench_workload {
+    const char * name;
+    void (* build)(struct bench_code * c);
+    qword (* native)(void);
+};
+
+static const struct bench_workload bench_workloads[] = {
+    {"pow", build_pow, native_pow},
+    {"ffi", build_ffi, native_ffi},
+    {"vmem", build_vmem, native_vmem},
+    {"branch", build_branch, native_branch},
+    {"stack", build_stack, native_stack},
+    {"bytes", build_bytes, native_bytes},
+    {"block", build_block, native_block},
+    {"simd", build_simd, native_simd},
+};
+
+// Native calls per second by arity, through an absolute VM_CALL and through a
+// typed import. Each call includes pushing its arguments and the loop.
+static qword bench_f0(void) { return 1; }
+static qword bench_f1(qword a) { return a; }
+static qword bench_f2(qword a, qword b) { return a + b; }
+static qword bench_f4(qword a, qword b, qword c, qword d) { return a + b + c + d; }
+static qword bench_f8(qword a, qword b, qword c, qword d, qword e, qword f, qword g, qword h) {
+    return a + b + c + d + e + f + g + h;
+}
+static qword bench_f16(qword a, qword b, qword c, qword d, qword e, qword f, qword g, qword h,
+                       qword i, qword j, qword k, qword l, qword m, qword n, qword o, qword p) {
+    return a + b + c + d + e + f + g + h + i + j + k + l + m + n + o + p;
+}
+static double bench_fd(double a, double b) { return a * b; }
+
+static const struct bench_callee {
+    const char * name;
+    void * fn;
+    const char * signature;
+    int nargs;
+} bench_callees[] = {
+    {"q()", (void*) &bench_f0, "q()", 0},
+    {"q(q)", (void*) &bench_f1, "q(q)", 1},
+    {"q(qq)", (void*) &bench_f2, "q(qq)", 2},
+    {"q(q*4)", (void*) &bench_f4, "q(qqqq)", 4},
+    {"q(q*8)", (void*) &bench_f8, "q(qqqqqqqq)", 8},
+    {"q(q*16)", (void*) &bench_f16, "q(qqqqqqqqqqqqqqqq)", 16},
+    {"d(dd)", (void*) &bench_fd, "d(dd)", 2},
+};
+
+static void build_calls(struct bench_code * c, const struct bench_callee * callee, int typed) {
+    int exit, head = bench_loop_head(c, &exit);
+    for (int i = 0; i < callee->nargs; i++)
+        bench_pushi(c, i + 1);
+    if (typed)
+        bench_import(c, 0);
+    else
+        bench_call(c, callee->fn, callee->nargs);
+    bench_loop_tail(c, head, exit);
+}
+
+// Engines, all run a context from the pool over the same code
+static struct vm_decoded * bench_plain, * bench_fused;
+static struct vm_program bench_program; // VMEM addresses the code, like vm_exec
+static struct vm_verified * bench_verified;
+static struct vm_tiered * bench_tiered; // loops stay tiered up between runs
+static struct vm_trace * bench_trace;
+
+static int run_switch(struct vm_context * ctx, struct bench_code * c) {
+    ctx->code_base = ctx->data_base = ctx->rip = (qword) c->buf;
+    ctx->code_size = c->n;
+    ctx->error = VM_OK;
+    while (ctx->rip < (qword) c->buf + c->n && !ctx->error)
+        vm_eval(ctx, (char*) ctx->rip);
+    return (int) ctx->error;
+}
+
+static int run_exec(struct vm_context * ctx, struct bench_code * c) {
+    return vm_exec(ctx, c->buf, c->n);
+}
+
+// vm_exec's path with VM_PREDECODE: a lookup in the per-thread decode cache
+// on every run, which has to hit even though vmem stores into the code buffer
+static int run_cached(struct vm_context * ctx, struct bench_code * c) {
+    struct vm_decoded * dec = vm_getdecoded(c->buf, c->n);
+    return dec ? vm_execdecoded(ctx, dec) : vm_exec(ctx, c->buf, c->n);
+}
+
+static int run_decoded(struct vm_context * ctx, struct bench_code * c) {
+    (void) c;
+    return vm_execdecoded(ctx, bench_plain);
+}
+
+static int run_fused(struct vm_context * ctx, struct bench_code * c) {
+    (void) c;
+    return vm_execdecoded(ctx, bench_fused);
+}
+
+static int run_verified(struct vm_context * ctx, struct bench_code * c) {
+    (void) c;
+    return vm_execverified(ctx, bench_verified);
+}
+
+static int run_tiered(struct vm_context * ctx, struct bench_code * c) {
+    return vm_exectiered(ctx, bench_tiered, c->buf);
+}
+
+// Records every instruction and drains the ring between slices, like a
+// reader that keeps up with the VM
+static int run_traced(struct vm_context * ctx, struct bench_code * c) {
+    static struct vm_tracerecord drained[BENCH_TRACE_SLICE];
+    int status;
+    vm_settrace(ctx, bench_trace);
+    vm_load(ctx, c->buf, c->n, c->buf);
+    do {
+        status = vm_run(ctx, BENCH_TRACE_SLICE);
+        while (vm_traceread(bench_trace, drained, BENCH_TRACE_SLICE))
+            ;
+    } while (status == VM_OUT_OF_FUEL || status == VM_WAITING);
+    return (int) ctx->error;
+}
+
+static int run_jit(struct vm_context * ctx, struct bench_code * c) {
+    return vm_jit_exec(ctx, c->buf, c->n);
+}
+
+struct bench_engine {
+    const char * name;
+    int (* run)(struct vm_context * ctx, struct bench_code * c);
+};
+
+static const struct bench_engine bench_engines[] = {
+    {"switch", run_switch},
+    {"exec", run_exec},
+    {"cached", run_cached},
+    {"decoded", run_decoded},
+    {"fused", run_fused},
+    {"verified", run_verified},
+    {"tiered", run_tiered},
+    {"traced", run_traced},
+    {"jit", run_jit},
+};
+
+// CPU time of this thread where there's a clock for it, so time the process
+// spends preempted on a busy machine doesn't count against whatever ran then
+static double bench_cputime(void) {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+#else
+    return vm_now();
+#endif
+}
+
+// Instructions one run executes, counted on the reference interpreter
+static qword bench_count(struct bench_code * c) {
+    struct vm_context * ctx = vm_acquirectx();
+    qword count = 0;
+    vm_setheap(ctx, bench_heapmem, sizeof(bench_heapmem));
+    ctx->code_base = ctx->data_base = ctx->rip = (qword) c->buf;
+    ctx->code_size = c->n;
+    while (ctx->rip < (qword) c->buf + c->n && !ctx->error) {
+        vm_eval(ctx, (char*) ctx->rip);
+        count++;
+    }
+    vm_recyclectx(ctx);
+    return count;
+}
+
+// A request that needs a warmed-up context. The prologue mixes constants in a
+// loop, fills a table in VMEM and pushes setup values; the request reads a few
+// entries, pops a setup value and writes its result back to the table.
+#define BENCH_TABLE 256
+#define BENCH_DATA (BENCH_TABLE * 64) // one entry per cache line, four pages
+#define BENCH_REQUESTS 100
+
+static void build_prologue(struct bench_code * c) {
+    int exit, head;
+    bench_ri(c, VM_MOV, RAX, 1);
+    bench_ri(c, VM_MOV, RBX, 10000);
+    bench_ri(c, VM_MOV, RDX, 0);
+    head = c->n;
+    bench_rr(c, VM_CMP, RDX, RBX);
+    exit = bench_jump(c, VM_JGE);
+    bench_ri(c, VM_MUL, RAX, 31);
+    bench_rr(c, VM_ADD, RAX, RDX);
+    bench_loop_tail(c, head, exit);
+    for (int i = 0; i < BENCH_TABLE; i++) {
+        bench_ri(c, VM_ADD, RAX, i);
+        bench_vmem(c, VM_REG2VMEM, RAX, i * 64);
+    }
+    for (int i = 0; i < 8; i++)
+        bench_pushi(c, i);
+}
+
+// rbx is the request's input
+static void build_request(struct bench_code * c) {
+    bench_vmem(c, VM_VMEM2REG, RCX, 0);
+    bench_rr(c, VM_ADD, RCX, RBX);
+    bench_vmem(c, VM_VMEM2REG, RDX, 100 * 64);
+    bench_rr(c, VM_ADD, RCX, RDX);
+    bench_rr(c, VM_POP, R8, 0);
+    bench_rr(c, VM_ADD, RCX, R8);
+    bench_vmem(c, VM_REG2VMEM, RCX, 200 * 64);
+    bench_rr(c, VM_MOV, RAX, RCX);
+}
+
+// Serves requests by running the prologue in a fresh context each time, by
+// forking a snapshot taken after it, and times forking alone
+static void bench_snapshots(int runs, int json) {
+    static const char * const modes[] = {"prologue", "fork", "fork only"};
+    static char data[BENCH_DATA];
+    struct bench_code prologue = {{0}, 0}, request = {{0}, 0};
+    struct vm_context * ctx = vm_acquirectx();
+    double baseline = 0;
+    build_prologue(&prologue);
+    build_request(&request);
+    vm_execdata(ctx, prologue.buf, prologue.n, data);
+    struct vm_snapshot * snap = vm_snapshot(ctx, BENCH_DATA);
+    vm_recyclectx(ctx);
+    if (!snap) {
+        fprintf(stderr, "snapshot: %s\n", strerror(errno));
+        return;
+    }
+    if (!json)
+        printf("\n%-10s %14s %10s\n", "snapshot", "ns/request", "vs prologue");
+    for (int m = 0; m < 3; m++) {
+        double best = 1e300;
+        for (int r = 0; r < runs; r++) {
+            double start = vm_now();
+            for (int i = 0; i < BENCH_REQUESTS; i++) {
+                if (m == 0) {
+                    ctx = vm_acquirectx();
+                    memset(data, 0, sizeof(data));
+                    vm_execdata(ctx, prologue.buf, prologue.n, data);
+                } else if (!(ctx = vm_fork(snap))) {
+                    fprintf(stderr, "fork: %s\n", strerror(errno));
+                    vm_destroysnapshot(snap);
+                    return;
+                }
+                if (m < 2) {
+                    ctx->rbx = i;
+                    vm_execdata(ctx, request.buf, request.n, (char*) ctx->data_base);
+                    bench_result = ctx->rax;
+                }
+                if (m == 0)
+                    vm_recyclectx(ctx);
+                else
+                    vm_destroyfork(ctx);
+            }
+            double t = (vm_now() - start) / BENCH_REQUESTS;
+            if (t < best)
+                best = t;
+        }
+        if (m == 0)
+            baseline = best;
+        if (json)
+            printf(",\n  {\"snapshot\": \"%s\", \"ns_per_request\": %.0f, \"speedup\": %.2f}",
+                   modes[m], best, baseline / best);
+        else
+            printf("%-10s %14.0f %9.1fx\n", modes[m], best, baseline / best);
+    }
+    vm_destroysnapshot(snap);
+}
+
+// Runs the branch workload encrypted, with a cache that holds its loop and
+// with one too small for it, against the same interpreter on plaintext
+static void bench_encrypted(int runs, int json) {
+    static const char * const modes[] = {"plaintext", "cached", "thrashing"};
+    static const int caches[] = {0, 64, 2};
+    static const uint64_t key[2] = {0x243f6a8885a308d3ull, 0x13198a2e03707344ull};
+    struct bench_code code = {{0}, 0};
+    char cipher[sizeof(code.buf)];
+    double baseline = 0;
+    build_branch(&code);
+    qword insns = bench_count(&code);
+    vm_encrypt(key, code.buf, cipher, code.n);
+    if (!json)
+        printf("\n%-10s %10s %10s %10s %14s\n", "encrypted", "ns/insn", "vs plain", "hit rate", "decrypt ns/B");
+    for (int m = 0; m < 3; m++) {
+        struct vm_encrypted * enc = m ? vm_makeencrypted(cipher, code.n, key, caches[m]) : 0;
+        double best = 1e300;
+        for (int r = 0; r < runs; r++) {
+            struct vm_context * ctx = vm_acquirectx();
+            double start = vm_now();
+            if (m)
+                vm_execencrypted(ctx, enc, 0);
+            else
+                run_switch(ctx, &code);
+            double t = vm_now() - start;
+            vm_recyclectx(ctx);
+            if (t < best)
+                best = t;
+        }
+        if (m == 0)
+            baseline = best;
+        struct vm_cryptstats stats = {0, 0, 0, 0, 0};
+        if (enc)
+            stats = enc->stats;
+        double entries = (double)(stats.hits + stats.misses);
+        double hits = entries ? 100.0 * stats.hits / entries : 100.0;
+        double cost = stats.decrypted ? (double) stats.decrypt_ns / stats.decrypted : 0.0;
+        if (json)
+            printf(",\n  {\"encrypted\": \"%s\", \"ns_per_insn\": %.3f, \"slowdown\": %.2f, \"hit_rate\": %.2f, \"decrypt_ns_per_byte\": %.2f}",
+                   modes[m], best / insns, best / baseline, hits, cost);
+        else
+            printf("%-10s %10.3f %9.2fx %9.2f%% %14.2f\n", modes[m], best / insns, best / baseline, hits, cost);
+        vm_destroyencrypted(enc);
+    }
+}
+
+// Sizes of the workloads in both encodings, the cost of converting between
+// them and vm_exec on either, compact code running from the expansion cache.
+// Both encodings run once untimed and then alternate, in CPU time.
+static void bench_compact(int runs, int json) {
+    if (!json)
+        printf("\n%-8s %8s %8s %7s %12s %12s %13s %13s\n", "compact", "bytes", "compact", "ratio",
+               "compact ns/B", "expand ns/B", "byte ns/insn", "cmpct ns/insn");
+    for (size_t w = 0; w < sizeof(bench_workloads) / sizeof(bench_workloads[0]); w++) {
+        struct bench_code code = {{0}, 0}, compact = {{0}, 0}, expanded = {{0}, 0};
+        double best[4] = {1e300, 1e300, 1e300, 1e300};
+        bench_workloads[w].build(&code);
+        qword insns = bench_count(&code);
+        compact.n = (int) vm_compact(code.buf, code.n, compact.buf, sizeof(compact.buf));
+        for (int r = 0; r <= runs; r++) {
+            double t[4], start = bench_cputime();
+            for (int i = 0; i < 1000; i++) // vmem's data, and so its size, changes between runs
+                compact.n = (int) vm_compact(code.buf, code.n, compact.buf, sizeof(compact.buf));
+            t[0] = (bench_cputime() - start) / 1000;
+            start = bench_cputime();
+            for (int i = 0; i < 1000; i++)
+                expanded.n = (int) vm_expand(compact.buf, compact.n, expanded.buf, sizeof(expanded.buf));
+            t[1] = (bench_cputime() - start) / 1000;
+            // before the runs below store into embedded data
+            if (expanded.n != code.n || memcmp(expanded.buf, code.buf, code.n))
+                fprintf(stderr, "%s/compact: expanded code differs\n", bench_workloads[w].name);
+            for (int k = 0; k < 2; k++) {
+                int m = (r + k) & 1; // alternate which encoding runs first
+                struct vm_context * ctx = vm_acquirectx();
+                vm_setheap(ctx, bench_heapmem, sizeof(bench_heapmem));
+                start = bench_cputime();
+                int error = m ? vm_exec(ctx, compact.buf, compact.n) : vm_exec(ctx, code.buf, code.n);
+                t[2 + m] = bench_cputime() - start;
+                vm_recyclectx(ctx);
+                if (error)
+                    fprintf(stderr, "%s/compact: %s\n", bench_workloads[w].name, vm_errorstr(error));
+            }
+            for (int i = 0; i < 4 && r; i++) // the first round warms both encodings' caches
+                if (t[i] < best[i])
+                    best[i] = t[i];
+        }
+        if (json)
+            printf(",\n  {\"compact\": \"%s\", \"bytes\": %d, \"compact_bytes\": %d, \"compact_ns_per_byte\": %.2f, "
+                   "\"expand_ns_per_byte\": %.2f, \"ns_per_insn\": %.3f, \"compact_ns_per_insn\": %.3f}",
+                   bench_workloads[w].name, code.n, compact.n, best[0] / code.n, best[1] / code.n,
+                   best[2] / insns, best[3] / insns);
+        else
+            printf("%-8s %8d %8d %6.0f%% %12.2f %12.2f %13.3f %13.3f\n", bench_workloads[w].name, code.n, compact.n,
+                   100.0 * compact.n / code.n, best[0] / code.n, best[1] / code.n, best[2] / insns, best[3] / insns);
+    }
+}
+
+// Loop body for the subroutine table: rax += rdx * rdx
+static void build_square(struct bench_code * c) {
+    bench_rr(c, VM_MOV, RCX, RDX);
+    bench_rr(c, VM_MUL, RCX, RCX);
+    bench_rr(c, VM_ADD, RAX, RCX);
+}
+
+// The body inline, as a VM_CALLSUB subroutine, or reached by pushing a return
+// offset for RET and jumping, the way bytecode called itself before VM_CALLSUB
+static void build_subroutine(struct bench_code * c, int mode) {
+    int exit, head, call = 0, back = 0;
+    bench_ri(c, VM_MOV, RAX, 0);
+    head = bench_loop_head(c, &exit);
+    if (mode == 0)
+        build_square(c);
+    else if (mode == 1)
+        call = bench_jump(c, VM_CALLSUB);
+    else {
+        back = c->n;
+        bench_pushi(c, 0); // patched below: the return point relative to the RET
+        call = bench_jump(c, VM_JMP);
+    }
+    int after = c->n;
+    bench_loop_tail(c, head, exit);
+    c->buf[c->n] = JOINBITS(2, 0); // ends the program
+    c->buf[c->n + 1] = VM_RETSUB;
+    c->n += 2;
+    if (mode) {
+        bench_patch(c, call, c->n);
+        build_square(c);
+        if (mode == 2) {
+            qword offset = after - c->n;
+            memcpy(c->buf + back + 2, &offset, 8);
+        }
+        c->buf[c->n] = JOINBITS(2, 0);
+        c->buf[c->n + 1] = mode == 1 ? VM_RETSUB : VM_RET;
+        c->n += 2;
+    }
+}
+
+#define BENCH_SUB_RUNS 3 // repetitions per run of the other tables, for medians
+
+static int bench_cmpdouble(const void * a, const void * b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double bench_abs(double x) {
+    return x < 0 ? -x : x;
+}
+
+// Sorts `v` in place
+static double bench_median(double * v, int n) {
+    qsort(v, n, sizeof(double), bench_cmpdouble);
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+// ns of CPU time per loop iteration with the body inline and called, and what
+// a call and return add to it, on the engines that handle subroutines
+// themselves. Each repetition runs the three forms back to back, so a call's
+// cost is the median of paired differences. One that isn't above twice the
+// median deviation, of those differences or of the inline runs, is printed as
+// noise. Verified code can't return with RET: it faults with
+// VM_BAD_TARGET.
+static void bench_subroutines(int runs, int json) {
+    static const char * const modes[] = {"inline", "callsub", "push+ret"};
+    static const struct bench_engine engines[] = {
+        {"exec", run_exec}, {"fused", run_fused}, {"verified", run_verified}, {"jit", run_jit},
+    };
+    static struct bench_code code[3];
+    struct vm_decoded * fused[3];
+    struct vm_verified * verified[3];
+    int reps = runs * BENCH_SUB_RUNS + 1;
+    double * times = (double *) malloc(sizeof(double) * reps * 3);
+    double * diffs = (double *) malloc(sizeof(double) * reps);
+    qword expect = 0;
+    for (qword i = 0; i < BENCH_ITER; i++)
+        expect += i * i;
+    for (int m = 0; m < 3; m++) {
+        qword bad;
+        const char * reason;
+        memset(&code[m], 0, sizeof(code[m]));
+        build_subroutine(&code[m], m);
+        fused[m] = vm_predecode(code[m].buf, code[m].n);
+        vm_optimize(fused[m]);
+        memset(&bench_program, 0, sizeof(bench_program));
+        bench_program.code = code[m].buf;
+        bench_program.code_size = code[m].n;
+        verified[m] = vm_verifyprogram(&bench_program, 0, 0, &bad, &reason);
+        if (!verified[m])
+            fprintf(stderr, "%s: %s at %lld\n", modes[m], reason, (long long) bad);
+    }
+    if (!json)
+        printf("\n%-10s %-8s %10s %10s %10s\n", "subroutine", "engine", "ns/iter", "vs inline", "ns/call");
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+        // the verifier never decodes the point RET returns to: it follows a JMP
+        int count = engines[e].run == run_verified ? 2 : 3;
+        if (engines[e].run == run_verified && !(verified[0] && verified[1]))
+            continue;
+        for (int r = 0; r <= reps; r++) {
+            for (int m = 0; m < count; m++) {
+                struct vm_context * ctx = vm_acquirectx();
+                bench_fused = fused[m];
+                bench_verified = verified[m];
+                double start = bench_cputime();
+                int error = engines[e].run(ctx, &code[m]);
+                double t = bench_cputime() - start;
+                if (error || ctx->rax != expect)
+                    fprintf(stderr, "%s/%s: %s, rax %lld\n", modes[m], engines[e].name, vm_errorstr(error),
+                            (long long) ctx->rax);
+                vm_recyclectx(ctx);
+                if (r) // the first run warms the caches
+                    times[m * reps + r - 1] = t / BENCH_ITER;
+            }
+        }
+        double inline_ns = 0, inline_spread = 0;
+        for (int m = 0; m < count; m++) {
+            double ns, per_call = 0, spread = 0;
+            memcpy(diffs, times + m * reps, sizeof(double) * reps);
+            ns = bench_median(diffs, reps);
+            if (!m) {
+                inline_ns = ns;
+                for (int r = 0; r < reps; r++)
+                    diffs[r] = bench_abs(times[r] - ns);
+                inline_spread = bench_median(diffs, reps);
+            } else {
+                for (int r = 0; r < reps; r++)
+                    diffs[r] = times[m * reps + r] - times[r];
+                per_call = bench_median(diffs, reps);
+                for (int r = 0; r < reps; r++)
+                    diffs[r] = bench_abs(diffs[r] - per_call);
+                spread = bench_median(diffs, reps);
+                if (spread < inline_spread)
+                    spread = inline_spread;
+            }
+            // a call can't cost less than nothing: below the noise, layout wins
+            int noise = m && per_call <= 2 * spread;
+            if (json) {
+                printf(",\n  {\"subroutine\": \"%s\", \"engine\": \"%s\", \"ns_per_iter\": %.3f, \"vs_inline\": %.3f, ",
+                       modes[m], engines[e].name, ns, ns / inline_ns);
+                if (noise)
+                    printf("\"ns_per_call\": null}");
+                else
+                    printf("\"ns_per_call\": %.3f}", per_call);
+            } else if (noise)
+                printf("%-10s %-8s %10.3f %9.2fx %10s\n", modes[m], engines[e].name, ns, ns / inline_ns, "noise");
+            else
+                printf("%-10s %-8s %10.3f %9.2fx %10.3f\n", modes[m], engines[e].name, ns, ns / inline_ns, per_call);
+        }
+    }
+    for (int m = 0; m < 3; m++) {
+        vm_destroydecoded(fused[m]);
+        vm_destroyverified(verified[m]);
+    }
+    free(times);
+    free(diffs);
+}
+
+#define BENCH_JOBS 64 // jobs per batch in the executor table
+
+// Throughput of the executor on batches of BENCH_JOBS pow runs, sharing one
+// code buffer, with 1, 2, 4 .. workers up to the online CPUs, and the speedup
+// over one worker. Wall time, from the first vm_submit until vm_waitall.
+static void bench_executor(int runs, int json) {
+    static struct vm_job jobs[BENCH_JOBS];
+    struct bench_code code = {{0}, 0};
+    int cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    double single = 0;
+    if (cpus < 1)
+        cpus = 1;
+    build_pow(&code);
+    if (!json)
+        printf("\n%-8s %8s %12s %10s %10s\n", "executor", "threads", "jobs/s", "speedup", "efficiency");
+    for (int threads = 1; threads <= cpus; threads = threads < cpus && threads * 2 > cpus ? cpus : threads * 2) {
+        struct vm_executor * ex = vm_makeexecutor(threads);
+        double best = 1e300;
+        if (!ex) {
+            fprintf(stderr, "executor: can't start %d threads\n", threads);
+            break;
+        }
+        for (int r = 0; r <= runs; r++) {
+            double start = vm_now();
+            for (int i = 0; i < BENCH_JOBS; i++) {
+                memset(&jobs[i], 0, sizeof(jobs[i]));
+                jobs[i].code = code.buf;
+                jobs[i].size = code.n;
+                if (!vm_submit(ex, &jobs[i]))
+                    fprintf(stderr, "executor: job %d not queued\n", i);
+            }
+            vm_waitall(ex);
+            double t = vm_now() - start;
+            for (int i = 0; i < BENCH_JOBS; i++)
+                if (jobs[i].error || jobs[i].regs[0] != jobs[0].regs[0])
+                    fprintf(stderr, "executor/%d: job %d: %s\n", threads, i, vm_errorstr(jobs[i].error));
+            if (r && t < best) // the first batch warms the workers' pools and caches
+                best = t;
+        }
+        vm_destroyexecutor(ex);
+        if (threads == 1)
+            single = best;
+        if (json)
+            printf(",\n  {\"executor_threads\": %d, \"jobs_per_sec\": %.0f, \"speedup\": %.2f, \"efficiency\": %.2f}",
+                   threads, BENCH_JOBS / best * 1e9, single / best, single / best / threads);
+        else
+            printf("%-8s %8d %12.0f %9.2fx %9.0f%%\n", "pow", threads, BENCH_JOBS / best * 1e9, single / best,
+                   single / best / threads * 100);
+    }
+}
+
+int main(int argc, char * argv[]) {
+    int json = 0, runs = 20;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--json"))
+            json = 1;
+        else if (!strcmp(argv[i], "--quick"))
+            runs = 3;
+    }
+    bench_sink = 3;
+    for (int i = 0; i < BENCH_BLOCK; i++)
+        bench_heapmem[i] = (char)(i % 255);
+    bench_heapmem[BENCH_BLOCK - 1] = (char) 0xff;
+    for (int i = BENCH_BLOCK; i < BENCH_ITER; i++)
+        bench_heapmem[i] = (char)(i * 131);
+    if (json)
+        printf("{\"config\": {\"threaded\": %d, \"predecode\": %d, \"fuse\": %d, \"jit\": %d, \"iterations\": %d},\n\"results\": [",
+               VM_THREADED, VM_PREDECODE, VM_FUSE, CVM_JIT, BENCH_ITER);
+    else
+        printf("%-8s %-8s %12s %10s %12s %10s %10s\n", "workload", "engine", "insns/run", "ns/insn", "Minsn/s", "allocs", "vs native");
+    const char * sep = "";
+    for (size_t w = 0; w < sizeof(bench_workloads) / sizeof(bench_workloads[0]); w++) {
+        struct bench_code code = {{0}, 0};
+        double native = 1e300;
+        bench_workloads[w].build(&code);
+        qword insns = bench_count(&code);
+        for (int r = 0; r < runs; r++) {
+            double start = bench_cputime();
+            bench_result = bench_workloads[w].native();
+            double t = bench_cputime() - start;
+            if (t < native)
+                native = t;
+        }
+        bench_plain = vm_predecode(code.buf, code.n);
+        bench_fused = vm_predecode(code.buf, code.n);
+        vm_optimize(bench_fused);
+        bench_tiered = vm_maketiered(code.buf, code.n, 0);
+        bench_trace = vm_maketrace(BENCH_TRACE_SLICE * 2, 1);
+        memset(&bench_program, 0, sizeof(bench_program));
+        bench_program.code = code.buf;
+        bench_program.code_size = code.n;
+        bench_program.data = code.buf;
+        bench_program.data_size = code.n;
+        qword bad;
+        const char * reason;
+        bench_verified = vm_verifyprogram(&bench_program, 0, 0, &bad, &reason);
+        if (!bench_verified)
+            fprintf(stderr, "%s: %s at %lld\n", bench_workloads[w].name, reason, (long long) bad);
+        for (size_t e = 0; e < sizeof(bench_engines) / sizeof(bench_engines[0]); e++) {
+            double best = 1e300;
+            long allocs;
+            if (bench_engines[e].run == run_verified && !bench_verified)
+                continue;
+            struct vm_context * ctx = vm_acquirectx();
+            vm_setheap(ctx, bench_heapmem, sizeof(bench_heapmem));
+            bench_engines[e].run(ctx, &code); // warm caches and the pool
+            vm_recyclectx(ctx);
+            allocs = bench_allocs;
+            for (int r = 0; r < runs; r++) {
+                double start = bench_cputime();
+                ctx = vm_acquirectx();
+                vm_setheap(ctx, bench_heapmem, sizeof(bench_heapmem));
+                int error = bench_engines[e].run(ctx, &code);
+                vm_recyclectx(ctx);
+                double t = bench_cputime() - start;
+                if (error)
+                    fprintf(stderr, "%s/%s: %s\n", bench_workloads[w].name, bench_engines[e].name, vm_errorstr(error));
+                if (t < best)
+                    best = t;
+            }
+            double allocs_per_run = (double)(bench_allocs - allocs) / runs;
+            if (json)
+                printf("%s\n  {\"workload\": \"%s\", \"engine\": \"%s\", \"insns\": %lld, \"ns_per_insn\": %.3f, "
+                       "\"insns_per_sec\": %.0f, \"allocs_per_run\": %.2f, \"native_ns\": %.0f, \"slowdown\": %.2f}",
+                       sep, bench_workloads[w].name, bench_engines[e].name, (long long) insns, best / insns,
+                       insns / best * 1e9, allocs_per_run, native, best / native);
+            else
+                printf("%-8s %-8s %12lld %10.3f %12.1f %10.2f %9.1fx\n", bench_workloads[w].name, bench_engines[e].name,
+                       (long long) insns, best / insns, insns / best * 1e3, allocs_per_run, best / native);
+            sep = ",";
+        }
+        vm_destroydecoded(bench_plain);
+        vm_destroydecoded(bench_fused);
+        vm_destroyverified(bench_verified);
+        vm_destroytiered(bench_tiered);
+        vm_destroytrace(bench_trace);
+    }
+    if (!json)
+        printf("\n%-8s %-8s %10s %12s\n", "callee", "call", "ns/call", "Mcalls/s");
+    for (size_t f = 0; f < sizeof(bench_callees) / sizeof(bench_callees[0]); f++) {
+        struct vm_native native;
+        struct vm_program program;
+        vm_makenative(&native, bench_callees[f].fn, bench_callees[f].signature);
+        for (int typed = 0; typed < 2; typed++) {
+            struct bench_code code = {{0}, 0};
+            double best = 1e300;
+            // untyped calls take at most 15 arguments and return rax as is
+            if (!typed && (bench_callees[f].nargs > 15 || bench_callees[f].signature[0] != 'q'))
+                continue;
+            build_calls(&code, &bench_callees[f], typed);
+            memset(&program, 0, sizeof(program));
+            program.code = code.buf;
+            program.code_size = code.n;
+            program.imports = &native;
+            program.import_count = 1;
+            for (int r = 0; r < runs; r++) {
+                double start = vm_now();
+                struct vm_context * ctx = vm_acquirectx();
+                int error = vm_execprogram(ctx, &program);
+                vm_recyclectx(ctx);
+                double t = vm_now() - start;
+                if (error)
+                    fprintf(stderr, "%s: %s\n", bench_callees[f].name, vm_errorstr(error));
+                if (t < best)
+                    best = t;
+            }
+            if (json)
+                printf(",\n  {\"callee\": \"%s\", \"call\": \"%s\", \"ns_per_call\": %.3f, \"calls_per_sec\": %.0f}",
+                       bench_callees[f].name, typed ? "import" : "absolute", best / BENCH_ITER, BENCH_ITER / best * 1e9);
+            else
+                printf("%-8s %-8s %10.3f %12.1f\n", bench_callees[f].name, typed ? "import" : "absolute",
+                       best / BENCH_ITER, BENCH_ITER / best * 1e3);
+        }
+    }
+    bench_snapshots(runs, json);
+    bench_encrypted(runs, json);
+    bench_compact(runs, json);
+    bench_subroutines(runs, json);
+    bench_executor(runs, json);
+    if (json)
+        printf("]}\n");
+    vm_jit_flush();
+    vm_flushdecoded();
+    vm_flushcompact();
+    vm_drainpool();
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include <time.h>
+#include "include/cvm.hpp"
+
+/*
+ vm_compiled against the runtime engines on main.c's pow_virt
+
+ pow_code is the same bytecode as in main.c, but constexpr, so vm_compiled
+ can specialize on it. Each engine computes n ** b through vm_call-style
+ entry (pooled context, arguments in rax and rbx), for a short loop where
+ entry dominates and a long one where the loop does.
+
+   c++ -std=c++17 -O2 compiled.cpp -o compiled && ./compiled
+
+ This is a C++ build, where vm_exec runs the vm_eval switch: the threaded
+ engine needs GNU C, see bench.c for it.
+*/
+
+static constexpr char pow_code[] = {
+    // mov rdx, 1
+    JOINBITS(11, VM_VAL2REG), VM_MOV, JOINBITS(3, 0), ENCODE_QWORD(1),
+    // mov rcx, rax
+    JOINBITS(3, VM_REG2REG), VM_MOV, JOINBITS(2, 0),
+    // loop start: cmp rdx, rbx
+    JOINBITS(3, VM_REG2REG), VM_CMP, JOINBITS(3, 1),
+    // jge end_loop
+    JOINBITS(10, VM_REG2REG), VM_JGE, ENCODE_QWORD(34),
+    // mul rcx, rax
+    JOINBITS(3, VM_REG2REG), VM_MUL, JOINBITS(2, 0),
+    // add rdx, 1
+    JOINBITS(11, VM_VAL2REG), VM_ADD, JOINBITS(3, 0), ENCODE_QWORD(1),
+    // jmp loop_start
+    JOINBITS(10, VM_VAL2REG), VM_JMP, ENCODE_QWORD(-27),
+    // end_loop: mov rax, rcx
+    JOINBITS(3, VM_REG2REG), VM_MOV, JOINBITS(0, 2)
+};
+
+static const struct vm_program pow_program = { pow_code, sizeof(pow_code), 0, 0, 0, 0, 0 };
+static struct vm_decoded * pow_decoded;
+static volatile qword compiled_sink;
+
+static qword pow_native(qword n, qword b) {
+    uint64_t r = (uint64_t) n;
+    for (qword i = 1; i < b; i++)
+        r *= (uint64_t) n;
+    return (qword) r;
+}
+
+static qword pow_interpreted(qword n, qword b) {
+    qword args[] = { n, b };
+    return vm_call(&pow_program, args, 2);
+}
+
+static qword pow_decoded_run(qword n, qword b) {
+    struct vm_context * ctx = vm_acquirectx();
+    qword result;
+    ctx->rax = n;
+    ctx->rbx = b;
+    vm_execdecoded(ctx, pow_decoded);
+    result = ctx->rax;
+    vm_recyclectx(ctx);
+    return result;
+}
+
+static qword pow_compiled(qword n, qword b) {
+    qword args[] = { n, b };
+    return vm_compiled<pow_code>::call(args, 2);
+}
+
+static const struct {
+    const char * name;
+    qword (* run)(qword n, qword b);
+} compiled_engines[] = {
+    {"native", pow_native},
+    {"vm_call", pow_interpreted},
+    {"fused", pow_decoded_run},
+    {"compiled", pow_compiled},
+};
+
+static double compiled_now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char * argv[]) {
+    static const qword exponents[] = { 3, 1000 };
+    int runs = argc > 1 && !strcmp(argv[1], "--quick") ? 3 : 20;
+    pow_decoded = vm_predecode((char*) pow_code, sizeof(pow_code));
+    vm_optimize(pow_decoded);
+    printf("%-8s %-9s %12s %12s %12s\n", "b", "engine", "ns/call", "ns/insn", "vs vm_call");
+    for (size_t e = 0; e < sizeof(exponents) / sizeof(exponents[0]); e++) {
+        qword b = exponents[e], calls = b < 100 ? 100000 : 1000;
+        qword insns = 2 + 5 * (b - 1) + 2 + 1; // setup, b - 1 iterations, the exit test and result
+        double interpreted = 0;
+        for (size_t i = 0; i < sizeof(compiled_engines) / sizeof(compiled_engines[0]); i++) {
+            double best = 1e300;
+            if (compiled_engines[i].run(3, b) != pow_native(3, b))
+                fprintf(stderr, "%s: wrong result for 3 ** %lld\n", compiled_engines[i].name, (long long) b);
+            for (int r = 0; r < runs; r++) {
+                double start = compiled_now();
+                for (qword c = 0; c < calls; c++)
+                    compiled_sink = compiled_engines[i].run(3 + (c & 1), b);
+                double t = (compiled_now() - start) / calls;
+                if (t < best)
+                    best = t;
+            }
+            if (compiled_engines[i].run == pow_interpreted)
+                interpreted = best;
+            printf("%-8lld %-9s %12.1f %12.3f", (long long) b, compiled_engines[i].name, best, best / insns);
+            if (interpreted)
+                printf(" %11.1fx", interpreted / best);
+            printf("\n");
+        }
+    }
+    vm_destroydecoded(pow_decoded);
+    vm_drainpool();
+    return 0;
+}
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <time.h>
 
 /*
 
@@ -37,22 +39,128 @@ Github: https://github.com/ac3s0r/cvm
     (char)((x >> 16) & 0xff), \
     (char)((x >> 24) & 0xff)
 
-#define ENCODE_QWORD(x)(char)((x >> 0) & 0xff), \
-    (char)((x >> 8) & 0xff), \
-    (char)((x >> 16) & 0xff), \
-    (char)((x >> 24) & 0xff), \
-    (char)((x >> 32) & 0xff), \
-    (char)((x >> 40) & 0xff), \
-    (char)((x >> 48) & 0xff), \
-    (char)((x >> 56) & 0xff)
-
-#define ALLOCSTRUCT(x)(struct x*) malloc(sizeof(struct x));
-#define JOINBITS(x, y)((0b00001111 & x) | (y << 4))
+// x is widened first, so int literals encode sign-extended and the macro is
+// a constant expression in C++ too
+#define ENCODE_QWORD(x)(char)(((qword)(x) >> 0) & 0xff), \
+    (char)(((qword)(x) >> 8) & 0xff), \
+    (char)(((qword)(x) >> 16) & 0xff), \
+    (char)(((qword)(x) >> 24) & 0xff), \
+    (char)(((qword)(x) >> 32) & 0xff), \
+    (char)(((qword)(x) >> 40) & 0xff), \
+    (char)(((qword)(x) >> 48) & 0xff), \
+    (char)(((qword)(x) >> 56) & 0xff)
+
+#define ALLOCSTRUCT(x)(struct x*) VM_MALLOC(sizeof(struct x));
+#define JOINBITS(x, y)((0b00001111 & (x)) | ((y) << 4))
 #define GETFIRST(x)(x & 0b00001111)
 #define GETSECOND(x)((x >> 4) & 0b00001111)
 
 #define VM_DEBUG 0
 
+// Direct-threaded dispatch (computed goto) inside vm_exec, GNU C only.
+// The vm_eval switch stays as the portable fallback and is used for VM_DEBUG
+// and VM_PROFILE.
+#ifndef VM_THREADED
+#if defined(__GNUC__) && !defined(__cplusplus)
+#define VM_THREADED 1
+#else
+#define VM_THREADED 0
+#endif
+#endif
+
+// vm_exec runs through the per-thread predecode cache (see vm_getdecoded)
+#ifndef VM_PREDECODE
+#define VM_PREDECODE 0
+#endif
+
+#ifndef VM_STACK_INITIAL
+#define VM_STACK_INITIAL 64 // entries allocated by the first push
+#endif
+
+#ifndef VM_STACK_MAX
+#define VM_STACK_MAX (1 << 20) // default stack_limit of new contexts
+#endif
+
+#ifndef VM_CALL_INITIAL
+#define VM_CALL_INITIAL 16 // frames allocated by the first VM_CALLSUB
+#endif
+
+#ifndef VM_CALL_MAX
+#define VM_CALL_MAX 1024 // default call_limit of new contexts
+#endif
+
+#ifndef VM_POOL_SIZE
+#define VM_POOL_SIZE 8 // contexts kept per thread by vm_recyclectx
+#endif
+
+#ifndef VM_POOL_STACK
+#define VM_POOL_STACK 256 // stack entries preallocated for pooled contexts
+#endif
+
+// Programs in the decode cache get superinstruction fusion (see vm_optimize)
+#ifndef VM_FUSE
+#define VM_FUSE 1
+#endif
+
+// Per-opcode, per-rip and branch counters for vm_exec (see vm_profdump).
+// VM_PROFILE_CYCLES also attributes rdtsc cycles to each opcode+variant.
+#ifndef VM_PROFILE
+#define VM_PROFILE 0
+#endif
+
+#ifndef VM_PROFILE_CYCLES
+#define VM_PROFILE_CYCLES 0
+#endif
+
+#ifndef VM_DECODE_CACHE
+#define VM_DECODE_CACHE 16 // entries in the per-thread decode cache
+#endif
+
+// Host SIMD behind the vector opcodes: 2 AVX2, 1 SSE2 (256-bit shapes run as
+// two halves), 0 plain C loops. Follows what the compiler targets.
+#ifndef VM_SIMD
+#if defined(__AVX2__)
+#define VM_SIMD 2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VM_SIMD 1
+#else
+#define VM_SIMD 0
+#endif
+#endif
+
+#if VM_SIMD
+#include <immintrin.h>
+#endif
+
+#ifndef VM_THREAD_LOCAL
+#if defined(__cplusplus) && __cplusplus >= 201103L
+#define VM_THREAD_LOCAL thread_local
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define VM_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define VM_THREAD_LOCAL __thread
+#else
+#define VM_THREAD_LOCAL
+#endif
+#endif
+
+// Heap functions used by the VM, override them for a custom allocator
+#ifndef VM_MALLOC
+#define VM_MALLOC malloc
+#endif
+
+#ifndef VM_CALLOC
+#define VM_CALLOC calloc
+#endif
+
+#ifndef VM_REALLOC
+#define VM_REALLOC realloc
+#endif
+
+#ifndef VM_FREE
+#define VM_FREE free
+#endif
+
 enum opcode {
     // Math operations
     VM_ADD, VM_SUB,
@@ -73,7 +181,23 @@ enum opcode {
     VM_JG, VM_JL,
     VM_JLE, VM_JGE,
     // Vm-specific
-    VM_CPUID, VM_ABORT
+    VM_CPUID, VM_ABORT,
+    // Heap
+    VM_LOAD, VM_STORE,
+    VM_MEMCPY, VM_MEMSET,
+    VM_MEMCMP, VM_FINDBYTE,
+    // Vector registers
+    VM_VADD, VM_VSUB,
+    VM_VXOR, VM_VAND,
+    VM_VOR, VM_VSHL,
+    VM_VSHR, VM_VSHUF,
+    VM_VCMPEQ, VM_VCMPGT,
+    VM_VLOAD, VM_VSTORE,
+    VM_VBCAST, VM_VMOVMSK,
+    VM_VEXTRACT,
+    // Subroutines
+    VM_CALLSUB, VM_RETSUB,
+    VM_OPCOUNT // keep last, at most 64 for the compact encoding
 };
 
 // Variants flags for some instructions
@@ -84,7 +208,22 @@ enum variants {
     VM_VAL2REG,
     VM_MEM2MEM,
     VM_VMEM2REG, // Interact with VM memory
-    VM_REG2VMEM
+    VM_REG2VMEM,
+    VM_IMPORT // VM_CALL through ctx->imports, the immediate is an index
+};
+
+// VM_LOAD / VM_STORE access 1 << width bytes, the width is the variant
+enum vm_width {
+    VM_BYTE,
+    VM_WORD,
+    VM_DWORD,
+    VM_QWORD
+};
+
+// Vector opcodes take a shape as the variant: a lane width | VM_V128 or VM_V256
+enum vm_shape {
+    VM_V128 = 0,
+    VM_V256 = 4
 };
 
 // flags register possible values
@@ -94,68 +233,319 @@ enum flags {
     VM_FLAG_LESSER=0b00100000
 };
 
-struct stack_entry {
-    struct stack_entry * next;
-    qword value;
+// vm_context.error values, execution stops at the faulting instruction
+enum vm_error {
+    VM_OK,
+    VM_STACK_OVERFLOW,
+    VM_STACK_UNDERFLOW,
+    VM_OUT_OF_MEMORY,
+    VM_BAD_IMPORT,
+    VM_BAD_TARGET,
+    VM_BAD_ADDRESS,
+    VM_BAD_ENCODING,
+    VM_CALL_OVERFLOW
 };
 
+typedef qword (* vm_thunk)(qword target, const qword * args);
+
+// A native function for VM_IMPORT calls, set up once by vm_makenative
+struct vm_native {
+    qword target;
+    vm_thunk thunk; // per-arity caller, NULL if the signature has floating point
+    uint8_t typed; // 0: the argument count comes from each VM_CALL
+    uint8_t nargs;
+    uint8_t ret; // 'q', 'd', 'f' or 'v'
+    uint16_t fp; // bit i set: argument i is a double or float
+};
+
+#if defined(_MSC_VER)
+#define VM_ALIGNED(n) __declspec(align(n))
+#else
+#define VM_ALIGNED(n) __attribute__((aligned(n)))
+#endif
+
+// A vector register, read as lanes of any width
+union VM_ALIGNED(32) vm_vector {
+    uint8_t b[32];
+    uint16_t w[16];
+    uint32_t d[8];
+    uint64_t q[4];
+#if VM_SIMD
+    __m128i x[2];
+#endif
+#if VM_SIMD >= 2
+    __m256i y;
+#endif
+};
+
+// The register file takes the first two cache lines, so register nibbles
+// index regs[] directly. The names are the same registers: rax is regs[0],
+// rip regs[12], and existing code using them keeps working.
 struct vm_context {
-    qword rax, rbx, rcx, rdx; // General-use registers
-    qword r8, r9, r10, r11, r12, r13, r14, r15; // Additional registers
-    qword rip, flags, rsi, rbp, rsp; // Special registers
+    union VM_ALIGNED(64) {
+        qword regs[16];
+        struct {
+            qword rax, rbx, rcx, rdx; // General-use registers
+            qword r8, r9, r10, r11, r12, r13, r14, r15; // Additional registers
+            qword rip, flags, rsi, rbp; // Special registers
+        };
+    };
 
+    // Hot: touched by stack traffic, VMEM and calls
+    qword rsp; // indexes the stack
+    qword * stack; // contiguous, grows up, rsp is the next free slot
+    qword stack_capacity; // allocated entries
+    qword data_base; // VMEM operands are offsets from here
     qword code_base, code_size; // base address of the code
-    struct stack_entry * stack;
-    qword stack_size;
+    qword error; // enum vm_error
+    const struct vm_native * imports; // native functions for VM_IMPORT calls
+
+    // Heap: linear memory for VM_LOAD, VM_STORE and the block opcodes
+    char * heap;
+    qword heap_size;
+
+    // Subroutines: return addresses of VM_CALLSUB, contiguous, grows up
+    qword * calls;
+    qword call_depth, call_capacity;
+
+    // Cold
+    qword import_count;
+    qword executed; // instructions run by the last vm_run
+    qword stack_limit; // maximum entries
+    qword call_limit; // maximum VM_CALLSUB frames
+    qword stack_borrowed; // stack memory belongs to the caller (vm_initctx)
+    struct vm_trace * trace; // records runs while set, see vm_settrace
+    void * allocation; // block holding a vm_makectx context
+
+    // Vector registers for the VM_V* opcodes, last so that vm_resetctx only
+    // clears them when a program used them
+    qword vregs_used;
+    union vm_vector vregs[16];
 };
 
+// Contexts from vm_makectx are aligned by hand, VM_MALLOC may not honour 64
 static struct vm_context * vm_makectx() {
-    struct vm_context * ctx = ALLOCSTRUCT(vm_context);
-    if (ctx) {
-        memset(ctx, 0, sizeof(struct vm_context));
-    }
+    void * block = VM_MALLOC(sizeof(struct vm_context) + 63);
+    struct vm_context * ctx = (struct vm_context*)(((uintptr_t) block + 63) & ~(uintptr_t) 63);
+    if (!block)
+        return 0;
+    memset(ctx, 0, sizeof(struct vm_context));
+    ctx->stack_limit = VM_STACK_MAX;
+    ctx->call_limit = VM_CALL_MAX;
+    ctx->allocation = block;
     return ctx;
 }
 
 static void vm_destroyctx(struct vm_context * ctx) {
     if (ctx) {
-        while (ctx->stack) {
-            struct stack_entry * temp = ctx->stack;
-            ctx->stack = temp->next;
-            free(temp);
-        }
-        free(ctx);
+        if (!ctx->stack_borrowed)
+            VM_FREE(ctx->stack);
+        VM_FREE(ctx->calls);
+        VM_FREE(ctx->allocation);
     }
 }
 
+// Sets up a caller-owned context, e.g. one on the C stack. The VM stack starts
+// in the given buffer (may be NULL) and moves to the heap only if it outgrows it.
+static void vm_initctx(struct vm_context * ctx, qword * stack, qword capacity) {
+    memset(ctx, 0, sizeof(struct vm_context));
+    ctx->stack = stack;
+    ctx->stack_capacity = stack ? capacity : 0;
+    ctx->stack_borrowed = stack != 0;
+    ctx->stack_limit = VM_STACK_MAX;
+    ctx->call_limit = VM_CALL_MAX;
+}
+
+// Releases what vm_initctx contexts allocated, not the context itself
+static void vm_finictx(struct vm_context * ctx) {
+    if (ctx) {
+        if (!ctx->stack_borrowed)
+            VM_FREE(ctx->stack);
+        VM_FREE(ctx->calls);
+    }
+}
+
+// Clears registers, flags and both stacks in place, keeping their memory
+static void vm_resetctx(struct vm_context * ctx) {
+    if (ctx) {
+        qword * stack = ctx->stack, * calls = ctx->calls;
+        qword capacity = ctx->stack_capacity, limit = ctx->stack_limit,
+              borrowed = ctx->stack_borrowed, call_capacity = ctx->call_capacity,
+              call_limit = ctx->call_limit;
+        void * allocation = ctx->allocation;
+        if (ctx->vregs_used)
+            memset(ctx->vregs, 0, sizeof(ctx->vregs));
+        memset(ctx, 0, offsetof(struct vm_context, vregs));
+        ctx->stack = stack;
+        ctx->stack_capacity = capacity;
+        ctx->stack_limit = limit;
+        ctx->stack_borrowed = borrowed;
+        ctx->calls = calls;
+        ctx->call_capacity = call_capacity;
+        ctx->call_limit = call_limit;
+        ctx->allocation = allocation;
+    }
+}
+
+// Gives the context a caller-owned heap, addressed from 0 to size - 1
+static void vm_setheap(struct vm_context * ctx, void * memory, qword size) {
+    ctx->heap = (char*) memory;
+    ctx->heap_size = memory ? size : 0;
+}
+
+static const char * vm_errorstr(qword error) {
+    switch (error) {
+    case VM_OK: return "ok";
+    case VM_STACK_OVERFLOW: return "stack overflow";
+    case VM_STACK_UNDERFLOW: return "stack underflow";
+    case VM_OUT_OF_MEMORY: return "out of memory";
+    case VM_BAD_IMPORT: return "bad import index";
+    case VM_BAD_TARGET: return "jump into unverified code";
+    case VM_BAD_ADDRESS: return "heap access out of bounds";
+    case VM_BAD_ENCODING: return "malformed compact code";
+    case VM_CALL_OVERFLOW: return "call stack overflow";
+    }
+    return "unknown error";
+}
+
+static void vm_fault(struct vm_context * ctx, qword error) {
+    if (!ctx->error)
+        ctx->error = error;
+}
+
+// Wall clock in nanoseconds, for the engines' time statistics
+static qword vm_now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (qword) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Doubles the stack up to stack_limit entries
+static int vm_growstack(struct vm_context * ctx) {
+    qword capacity = ctx->stack_capacity ? ctx->stack_capacity * 2 : VM_STACK_INITIAL;
+    if (capacity > ctx->stack_limit)
+        capacity = ctx->stack_limit;
+    if (capacity <= ctx->rsp) {
+        vm_fault(ctx, VM_STACK_OVERFLOW);
+        return 0;
+    }
+    qword * stack = (qword*) (ctx->stack_borrowed
+        ? VM_MALLOC(capacity * sizeof(qword))
+        : VM_REALLOC(ctx->stack, capacity * sizeof(qword)));
+    if (!stack) {
+        vm_fault(ctx, VM_OUT_OF_MEMORY);
+        return 0;
+    }
+    if (ctx->stack_borrowed)
+        memcpy(stack, ctx->stack, ctx->rsp * sizeof(qword));
+    ctx->stack_borrowed = 0;
+    ctx->stack = stack;
+    ctx->stack_capacity = capacity;
+    return 1;
+}
+
 static void vm_push(struct vm_context * ctx, qword value) {
     if (ctx) {
-        if (!ctx->stack) { // first entry
-            ctx->stack = ALLOCSTRUCT(stack_entry);
-            memset(ctx->stack, 0, sizeof(struct stack_entry));
-        }
-        struct stack_entry * entry = ALLOCSTRUCT(stack_entry);
-        memset(entry, 0, sizeof(struct stack_entry));
-        entry->value = value;
-        entry->next = ctx->stack->next;
-        ctx->stack->next = entry;
-        ctx->stack_size++;
+        if (ctx->rsp >= ctx->stack_capacity && !vm_growstack(ctx))
+            return;
+        ctx->stack[ctx->rsp++] = value;
     }
 }
 
 static qword vm_pop(struct vm_context * ctx) {
     if (ctx) {
-        if (!ctx->stack || !ctx->stack->next)
+        if (ctx->rsp <= 0) {
+            vm_fault(ctx, VM_STACK_UNDERFLOW);
             return 0;
-        struct stack_entry * entry = ctx->stack->next;
-        qword value = entry->value;
-        ctx->stack->next = entry->next;
-        free(entry);
-        ctx->stack_size--;
-        return value;
+        }
+        return ctx->stack[--ctx->rsp];
+    }
+    return 0;
+}
+
+/*
+ Subroutines
+
+ VM_CALLSUB jumps like VM_JMP and pushes the address of the next instruction
+ on ctx->calls, a return stack separate from the data stack; VM_RETSUB pops it.
+ PUSH and POP can't reach return addresses, so bytecode can neither clobber
+ nor forge one.
+
+   JOINBITS(10, VM_VAL2REG), VM_CALLSUB, qword offset    relative to the CALLSUB
+   JOINBITS(2, 0), VM_RETSUB
+
+ Frames hold absolute addresses. The stack grows up to ctx->call_limit frames
+ (VM_CALL_MAX by default), past which VM_CALLSUB faults with VM_CALL_OVERFLOW.
+ VM_RETSUB with no frames ends the program like VM_RET on an empty stack.
+ Every run starts with no frames.
+*/
+
+// Doubles the call stack up to call_limit frames
+static int vm_growcalls(struct vm_context * ctx) {
+    qword capacity = ctx->call_capacity ? ctx->call_capacity * 2 : VM_CALL_INITIAL;
+    if (capacity > ctx->call_limit)
+        capacity = ctx->call_limit;
+    if (capacity <= ctx->call_depth) {
+        vm_fault(ctx, VM_CALL_OVERFLOW);
+        return 0;
+    }
+    qword * calls = (qword*) VM_REALLOC(ctx->calls, capacity * sizeof(qword));
+    if (!calls) {
+        vm_fault(ctx, VM_OUT_OF_MEMORY);
+        return 0;
+    }
+    ctx->calls = calls;
+    ctx->call_capacity = capacity;
+    return 1;
+}
+
+// Pushes the absolute return address of a VM_CALLSUB. Returns 0 on a fault.
+static int vm_callsub(struct vm_context * ctx, qword back) {
+    if (ctx->call_depth >= ctx->call_capacity && !vm_growcalls(ctx))
+        return 0;
+    ctx->calls[ctx->call_depth++] = back;
+    return 1;
+}
+
+// Per-thread free list of contexts with preallocated stacks, so a hot
+// virtualized function doesn't touch the heap once the pool is warm
+static VM_THREAD_LOCAL struct vm_context * vm_pool[VM_POOL_SIZE];
+static VM_THREAD_LOCAL int vm_pool_count;
+
+static struct vm_context * vm_acquirectx() {
+    struct vm_context * ctx;
+    if (vm_pool_count) {
+        ctx = vm_pool[--vm_pool_count];
+        ctx->stack_limit = VM_STACK_MAX;
+        ctx->call_limit = VM_CALL_MAX;
+        return ctx;
+    }
+    ctx = vm_makectx();
+    if (ctx) {
+        ctx->stack = (qword*) VM_MALLOC(VM_POOL_STACK * sizeof(qword));
+        ctx->stack_capacity = ctx->stack ? VM_POOL_STACK : 0;
+    }
+    return ctx;
+}
+
+// Returns a context from vm_acquirectx or vm_makectx to this thread's pool
+static void vm_recyclectx(struct vm_context * ctx) {
+    if (!ctx)
+        return;
+    if (vm_pool_count < VM_POOL_SIZE && !ctx->stack_borrowed) {
+        vm_resetctx(ctx);
+        vm_pool[vm_pool_count++] = ctx;
+    } else {
+        vm_destroyctx(ctx);
     }
 }
 
+// Frees this thread's pooled contexts, call before the thread exits
+static void vm_drainpool() {
+    while (vm_pool_count)
+        vm_destroyctx(vm_pool[--vm_pool_count]);
+}
+
 static void vm_debug(struct vm_context *ctx) {
 	printf("Registers:\n"
 	           "    rax: %llu\n"
@@ -177,7 +567,538 @@ static void vm_debug(struct vm_context *ctx) {
                (ctx->flags & 0b00000100) != 0,
                (ctx->flags & 0b00000010) != 0,
                (ctx->flags & 0b00000001) != 0,
-               ctx->stack_size);
+               ctx->rsp);
+}
+
+/*
+ Native calls
+
+ Arguments are read straight off the VM stack, the first argument on top, and
+ passed with exactly as many arguments as the call has through one thunk per
+ arity. The callee is reached through a variadic prototype, so variadic
+ functions like printf work too.
+*/
+
+typedef qword (* vm_cfunc)(qword, ...);
+
+static qword vm_thunk0(qword t, const qword * a) {
+    (void) a;
+    return ((qword (*)(void)) t)();
+}
+
+// `a` points at the deepest argument, the first one is a[n - 1]
+#define VM_THUNK(n, ...) \
+    static qword vm_thunk##n(qword t, const qword * a) { return ((vm_cfunc) t)(__VA_ARGS__); }
+VM_THUNK(1, a[0])
+VM_THUNK(2, a[1], a[0])
+VM_THUNK(3, a[2], a[1], a[0])
+VM_THUNK(4, a[3], a[2], a[1], a[0])
+VM_THUNK(5, a[4], a[3], a[2], a[1], a[0])
+VM_THUNK(6, a[5], a[4], a[3], a[2], a[1], a[0])
+VM_THUNK(7, a[6], a[5], a[4], a[3], a[2], a[1], a[0])
+VM_THUNK(8, a[7], a[6], a[5], a[4], a[3], a[2], a[1], a[0])
+VM_THUNK(9, a[8], a[7], a[6], a[5], a[4], a[3], a[2], a[1], a[0])
+VM_THUNK(10, a[9], a[8], a[7], a[6], a[5], a[4], a[3], a[2], a[1], a[0])
+VM_THUNK(11, a[10], a[9], a[8], a[7], a[6], a[5], a[4], a[3], a[2], a[1], a[0])
+VM_THUNK(12, a[11], a[10], a[9], a[8], a[7], a[6], a[5], a[4], a[3], a[2], a[1], a[0])
+VM_THUNK(13, a[12], a[11], a[10], a[9], a[8], a[7], a[6], a[5], a[4], a[3], a[2], a[1], a[0])
+VM_THUNK(14, a[13], a[12], a[11], a[10], a[9], a[8], a[7], a[6], a[5], a[4], a[3], a[2], a[1], a[0])
+VM_THUNK(15, a[14], a[13], a[12], a[11], a[10], a[9], a[8], a[7], a[6], a[5], a[4], a[3], a[2], a[1], a[0])
+VM_THUNK(16, a[15], a[14], a[13], a[12], a[11], a[10], a[9], a[8], a[7], a[6], a[5], a[4], a[3], a[2], a[1], a[0])
+#undef VM_THUNK
+
+static const vm_thunk vm_thunks[17] = {
+    vm_thunk0, vm_thunk1, vm_thunk2, vm_thunk3, vm_thunk4, vm_thunk5, vm_thunk6, vm_thunk7, vm_thunk8,
+    vm_thunk9, vm_thunk10, vm_thunk11, vm_thunk12, vm_thunk13, vm_thunk14, vm_thunk15, vm_thunk16
+};
+
+static void vm_callnative(struct vm_context * ctx, qword target, int args_count) {
+    if (ctx->rsp < args_count) {
+        vm_fault(ctx, VM_STACK_UNDERFLOW);
+        return;
+    }
+    ctx->rsp -= args_count;
+    ctx->rax = vm_thunks[args_count](target, ctx->stack + ctx->rsp);
+}
+
+// Floating point arguments and results need the SysV x86-64 convention:
+// integer and floating point arguments fill separate registers in order, so
+// one prototype with 6 integer and 8 double parameters fits every signature
+// up to that size. A float travels in the low 32 bits of its qword.
+#if defined(__x86_64__) && !defined(_WIN32)
+#define VM_SYSV_FP 1
+typedef qword (* vm_sysv_q)(qword, qword, qword, qword, qword, qword,
+                             double, double, double, double, double, double, double, double);
+typedef double (* vm_sysv_d)(qword, qword, qword, qword, qword, qword,
+                             double, double, double, double, double, double, double, double);
+typedef float (* vm_sysv_f)(qword, qword, qword, qword, qword, qword,
+                            double, double, double, double, double, double, double, double);
+
+static qword vm_callsysv(const struct vm_native * native, const qword * a) {
+    qword in[6] = {0}, result = 0;
+    double fp[8] = {0};
+    int ni = 0, nf = 0;
+    for (int i = 0; i < native->nargs; i++) {
+        qword value = a[native->nargs - 1 - i];
+        if (native->fp >> i & 1)
+            memcpy(&fp[nf++], &value, sizeof(value));
+        else
+            in[ni++] = value;
+    }
+    #define VM_SYSV_ARGS in[0], in[1], in[2], in[3], in[4], in[5], fp[0], fp[1], fp[2], fp[3], fp[4], fp[5], fp[6], fp[7]
+    if (native->ret == 'd') {
+        double r = ((vm_sysv_d) native->target)(VM_SYSV_ARGS);
+        memcpy(&result, &r, sizeof(r));
+    } else if (native->ret == 'f') {
+        float r = ((vm_sysv_f) native->target)(VM_SYSV_ARGS);
+        memcpy(&result, &r, sizeof(r));
+    } else {
+        result = ((vm_sysv_q) native->target)(VM_SYSV_ARGS);
+    }
+    #undef VM_SYSV_ARGS
+    return result;
+}
+#else
+#define VM_SYSV_FP 0
+#endif
+
+// Parses a signature like "d(qd)": the return type, then the arguments, with
+// q for integers and pointers, d for double, f for float and v for no result.
+// A NULL signature leaves the argument count to each VM_CALL and returns rax
+// as a qword. Returns 0 for signatures this platform can't call.
+static int vm_makenative(struct vm_native * native, void * target, const char * signature) {
+    int ints = 0, fps = 0;
+    memset(native, 0, sizeof(struct vm_native));
+    native->target = (qword) target;
+    native->ret = 'q';
+    native->thunk = vm_thunk0;
+    if (!signature)
+        return 1;
+    native->typed = 1;
+    native->ret = signature[0];
+    if (!native->ret || !strchr("qdfv", native->ret) || signature[1] != '(')
+        return 0;
+    for (signature += 2; *signature != ')'; signature++) {
+        if (*signature == 'd' || *signature == 'f') {
+            native->fp |= (uint16_t)(1 << native->nargs);
+            fps++;
+        } else if (*signature == 'q') {
+            ints++;
+        } else {
+            return 0;
+        }
+        if (++native->nargs > 16)
+            return 0;
+    }
+    if (signature[1])
+        return 0;
+    if (!fps && native->ret != 'd' && native->ret != 'f') {
+        native->thunk = vm_thunks[native->nargs];
+        return 1;
+    }
+    native->thunk = 0;
+    return VM_SYSV_FP && ints <= 6 && fps <= 8;
+}
+
+// VM_CALL with the VM_IMPORT variant
+static void vm_callimport(struct vm_context * ctx, qword index, int args_count) {
+    if ((uint64_t) index >= (uint64_t) ctx->import_count) {
+        vm_fault(ctx, VM_BAD_IMPORT);
+        return;
+    }
+    const struct vm_native * native = &ctx->imports[index];
+    if (native->typed)
+        args_count = native->nargs;
+    if (ctx->rsp < args_count) {
+        vm_fault(ctx, VM_STACK_UNDERFLOW);
+        return;
+    }
+    ctx->rsp -= args_count;
+    const qword * args = ctx->stack + ctx->rsp;
+    vm_thunk thunk = native->typed ? native->thunk : vm_thunks[args_count];
+    qword result;
+#if VM_SYSV_FP
+    if (!thunk)
+        result = vm_callsysv(native, args);
+    else
+#endif
+        result = thunk(native->target, args);
+    if (native->ret != 'v')
+        ctx->rax = result;
+}
+
+static qword vm_cmpflags(qword a, qword b) {
+    return (a == b ? VM_FLAG_EQUALS : 0)
+        | (a > b ? VM_FLAG_GREATER : 0)
+        | (a < b ? VM_FLAG_LESSER : 0);
+}
+
+/*
+ Heap
+
+ VM_LOAD and VM_STORE move 1, 2, 4 or 8 bytes (the variant, enum vm_width)
+ between a register and the heap set with vm_setheap. Loads zero-extend.
+
+   JOINBITS(8, width), VM_LOAD, JOINBITS(reg, base), JOINBITS(index, scale), disp32
+
+ The address is base + index * scale + disp; scale 0 means no index. The
+ block opcodes take heap offsets and a byte count in registers:
+
+   JOINBITS(4, 0), VM_MEMCPY, JOINBITS(dst, src), JOINBITS(count, 0)
+   VM_MEMSET    dst, value: fills with the low byte of value
+   VM_MEMCMP    a, b: sets flags like CMP on the first differing bytes
+   VM_FINDBYTE  at, value: moves `at` to the first byte equal to the low byte
+                of value and sets VM_FLAG_EQUALS, or past the range with flags 0
+
+ Anything outside the heap faults with VM_BAD_ADDRESS. The block opcodes run
+ in libc's memmove, memset, memcmp and memchr, which are vectorized.
+*/
+
+// Whether `width` bytes at heap offset `at` are inside the heap
+#define VM_INHEAP(ctx, at, width) ((uint64_t)(at) <= (uint64_t)(ctx)->heap_size \
+    && (uint64_t)(ctx)->heap_size - (uint64_t)(at) >= (uint64_t)(width))
+#define VM_HEAPADDR(regs, instr) (qword)((uint64_t)(regs)[GETSECOND((instr)[2])] \
+    + (uint64_t)(regs)[GETFIRST((instr)[3])] * GETSECOND((instr)[3]) + (uint64_t)*(dword*)((instr) + 4))
+
+static qword vm_heapload(const char * at, int width) {
+    uint64_t value = 0;
+    memcpy(&value, at, (size_t) 1 << width);
+    return (qword) value;
+}
+
+static void vm_heapstore(char * at, qword value, int width) {
+    memcpy(at, &value, (size_t) 1 << width);
+}
+
+// Runs a block opcode, returns 0 if it faulted
+static int vm_block(struct vm_context * ctx, int op, int r1, int r2, int count, qword * flags) {
+    qword a = ctx->regs[r1], b = ctx->regs[r2], n = ctx->regs[count];
+    if (!VM_INHEAP(ctx, a, n) || ((op == VM_MEMCPY || op == VM_MEMCMP) && !VM_INHEAP(ctx, b, n))) {
+        vm_fault(ctx, VM_BAD_ADDRESS);
+        return 0;
+    }
+    switch (op) {
+    case VM_MEMCPY:
+        if (n)
+            memmove(ctx->heap + a, ctx->heap + b, n);
+        break;
+    case VM_MEMSET:
+        if (n)
+            memset(ctx->heap + a, (int)(b & 0xff), n);
+        break;
+    case VM_MEMCMP:
+        *flags = vm_cmpflags(n ? memcmp(ctx->heap + a, ctx->heap + b, n) : 0, 0);
+        break;
+    case VM_FINDBYTE: {
+        const char * hit = n ? (const char*) memchr(ctx->heap + a, (int)(b & 0xff), n) : 0;
+        ctx->regs[r1] = hit ? hit - ctx->heap : a + n;
+        *flags = hit ? VM_FLAG_EQUALS : 0;
+        break;
+    }
+    }
+    return 1;
+}
+
+/*
+ Vector registers
+
+ ctx->vregs are sixteen 256-bit registers for packed integer work. Vector
+ opcodes take a shape as the variant: the lane width (enum vm_width) in bits
+ 0-1, and VM_V256 to use all 256 bits instead of the low 128. A 128-bit
+ result clears the upper half of its register.
+
+   JOINBITS(4, shape), VM_VADD, JOINBITS(vd, va), JOINBITS(vb, 0)    vd = va + vb per lane
+   VM_VSUB, VM_VXOR, VM_VAND, VM_VOR       the same, wrapping
+   VM_VCMPEQ, VM_VCMPGT  lanes of vd all ones where va == vb, va > vb (signed)
+   VM_VSHUF    byte lanes only: vd[i] = va[vb[i] & 15] from the same 128-bit
+               half, or 0 if vb[i] has its top bit set (pshufb)
+   JOINBITS(4, shape), VM_VSHL, JOINBITS(vd, va), count    logical shifts, counts
+               of the lane width or more clear the lanes (VM_VSHR too)
+   JOINBITS(3, shape), VM_VBCAST, JOINBITS(vd, reg)        every lane = reg
+   JOINBITS(3, shape), VM_VMOVMSK, JOINBITS(reg, va)       reg = the top bit of each lane
+   JOINBITS(4, shape), VM_VEXTRACT, JOINBITS(reg, va), lane    reg = the lane, zero-extended
+   JOINBITS(8, shape), VM_VLOAD, JOINBITS(vd, base), JOINBITS(index, scale), disp32
+   VM_VSTORE   16 or 32 bytes at a heap address, as for VM_LOAD, unaligned
+
+ Every opcode works on all its lanes in one dispatch, with SSE2 or AVX2
+ intrinsics when the compiler targets them (VM_SIMD) and plain loops
+ otherwise. A few pairs SSE2 lacks (64-bit VCMPGT, VSHUF without SSSE3) take
+ the loops. Invalid shapes are ignored like other invalid variants.
+*/
+
+// Encoded length of a vector opcode
+#define VM_VECTOR_SIZE(op) ((op) == VM_VLOAD || (op) == VM_VSTORE ? 8 \
+    : (op) == VM_VBCAST || (op) == VM_VMOVMSK ? 3 : 4)
+
+static int vm_vectorshape(int op, int shape) {
+    return shape <= ((int) VM_V256 | VM_QWORD) && (op != VM_VSHUF || (shape & 3) == VM_BYTE);
+}
+
+// Whether a vector opcode has rip or flags as a scalar register operand
+static int vm_vectorsysreg(const char * instr) {
+    int reg;
+    switch (instr[1]) {
+    case VM_VBCAST:
+        reg = GETSECOND(instr[2]);
+        break;
+    case VM_VMOVMSK: case VM_VEXTRACT:
+        reg = GETFIRST(instr[2]);
+        break;
+    case VM_VLOAD: case VM_VSTORE:
+        if (GETSECOND(instr[3]) && (GETFIRST(instr[3]) == 12 || GETFIRST(instr[3]) == 13))
+            return 1;
+        reg = GETSECOND(instr[2]);
+        break;
+    default:
+        return 0;
+    }
+    return reg == 12 || reg == 13;
+}
+
+static uint64_t vm_vlane(const union vm_vector * v, int width, int i) {
+    switch (width) {
+    case VM_BYTE: return v->b[i];
+    case VM_WORD: return v->w[i];
+    case VM_DWORD: return v->d[i];
+    }
+    return v->q[i];
+}
+
+static void vm_vsetlane(union vm_vector * v, int width, int i, uint64_t value) {
+    switch (width) {
+    case VM_BYTE: v->b[i] = (uint8_t) value; break;
+    case VM_WORD: v->w[i] = (uint16_t) value; break;
+    case VM_DWORD: v->d[i] = (uint32_t) value; break;
+    default: v->q[i] = value;
+    }
+}
+
+// The portable version of the lane-wise opcodes
+static void vm_vloop(int op, int width, int lanes, union vm_vector * d,
+                     const union vm_vector * a, const union vm_vector * b, int count) {
+    union vm_vector r;
+    int bits = 8 << width;
+    uint64_t sign = (uint64_t) 1 << (bits - 1);
+    memset(&r, 0, sizeof(r));
+    for (int i = 0; i < lanes; i++) {
+        uint64_t x = vm_vlane(a, width, i), y = vm_vlane(b, width, i), v = 0;
+        switch (op) {
+        case VM_VADD: v = x + y; break;
+        case VM_VSUB: v = x - y; break;
+        case VM_VXOR: v = x ^ y; break;
+        case VM_VAND: v = x & y; break;
+        case VM_VOR: v = x | y; break;
+        case VM_VSHL: v = count < bits ? x << count : 0; break;
+        case VM_VSHR: v = count < bits ? x >> count : 0; break;
+        case VM_VSHUF: v = y & 0x80 ? 0 : a->b[(i & ~15) | (y & 15)]; break;
+        case VM_VCMPEQ: v = x == y ? ~(uint64_t) 0 : 0; break;
+        case VM_VCMPGT: v = (x ^ sign) > (y ^ sign) ? ~(uint64_t) 0 : 0; break;
+        }
+        vm_vsetlane(&r, width, i, v);
+    }
+    *d = r;
+}
+
+#if VM_SIMD
+// A lane-wise opcode on `halves` 128-bit halves, returns 0 if SSE2 has no
+// instruction for it
+static int vm_vsse(int op, int width, int halves, __m128i * r, const __m128i * va, const __m128i * vb, int count) {
+    __m128i n = _mm_cvtsi32_si128(count);
+    for (int h = 0; h < halves; h++) {
+        __m128i a = va[h], b = vb[h];
+        switch (op) {
+        case VM_VXOR: r[h] = _mm_xor_si128(a, b); break;
+        case VM_VAND: r[h] = _mm_and_si128(a, b); break;
+        case VM_VOR: r[h] = _mm_or_si128(a, b); break;
+        case VM_VADD:
+            r[h] = width == VM_BYTE ? _mm_add_epi8(a, b) : width == VM_WORD ? _mm_add_epi16(a, b)
+                : width == VM_DWORD ? _mm_add_epi32(a, b) : _mm_add_epi64(a, b);
+            break;
+        case VM_VSUB:
+            r[h] = width == VM_BYTE ? _mm_sub_epi8(a, b) : width == VM_WORD ? _mm_sub_epi16(a, b)
+                : width == VM_DWORD ? _mm_sub_epi32(a, b) : _mm_sub_epi64(a, b);
+            break;
+        case VM_VSHL: // no byte shifts: shift words and drop the bits that crossed
+            r[h] = width == VM_BYTE ? (count > 7 ? _mm_setzero_si128()
+                    : _mm_and_si128(_mm_sll_epi16(a, n), _mm_set1_epi8((char)(0xff << count))))
+                : width == VM_WORD ? _mm_sll_epi16(a, n) : width == VM_DWORD ? _mm_sll_epi32(a, n) : _mm_sll_epi64(a, n);
+            break;
+        case VM_VSHR:
+            r[h] = width == VM_BYTE ? (count > 7 ? _mm_setzero_si128()
+                    : _mm_and_si128(_mm_srl_epi16(a, n), _mm_set1_epi8((char)(0xff >> count))))
+                : width == VM_WORD ? _mm_srl_epi16(a, n) : width == VM_DWORD ? _mm_srl_epi32(a, n) : _mm_srl_epi64(a, n);
+            break;
+        case VM_VCMPEQ:
+            if (width == VM_QWORD) { // both dword halves equal
+                __m128i eq = _mm_cmpeq_epi32(a, b);
+                r[h] = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+            } else
+                r[h] = width == VM_BYTE ? _mm_cmpeq_epi8(a, b) : width == VM_WORD ? _mm_cmpeq_epi16(a, b) : _mm_cmpeq_epi32(a, b);
+            break;
+        case VM_VCMPGT:
+            if (width == VM_QWORD) {
+#if defined(__SSE4_2__)
+                r[h] = _mm_cmpgt_epi64(a, b);
+                break;
+#else
+                return 0;
+#endif
+            }
+            r[h] = width == VM_BYTE ? _mm_cmpgt_epi8(a, b) : width == VM_WORD ? _mm_cmpgt_epi16(a, b) : _mm_cmpgt_epi32(a, b);
+            break;
+        case VM_VSHUF:
+#if defined(__SSSE3__)
+            r[h] = _mm_shuffle_epi8(a, b);
+            break;
+#else
+            return 0;
+#endif
+        default:
+            return 0;
+        }
+    }
+    return 1;
+}
+#endif
+
+#if VM_SIMD >= 2
+// A whole 256-bit lane-wise opcode, AVX2 has all of them
+static void vm_vavx(int op, int width, __m256i * r, __m256i a, __m256i b, int count) {
+    __m128i n = _mm_cvtsi32_si128(count);
+    switch (op) {
+    case VM_VXOR: *r = _mm256_xor_si256(a, b); break;
+    case VM_VAND: *r = _mm256_and_si256(a, b); break;
+    case VM_VOR: *r = _mm256_or_si256(a, b); break;
+    case VM_VADD:
+        *r = width == VM_BYTE ? _mm256_add_epi8(a, b) : width == VM_WORD ? _mm256_add_epi16(a, b)
+            : width == VM_DWORD ? _mm256_add_epi32(a, b) : _mm256_add_epi64(a, b);
+        break;
+    case VM_VSUB:
+        *r = width == VM_BYTE ? _mm256_sub_epi8(a, b) : width == VM_WORD ? _mm256_sub_epi16(a, b)
+            : width == VM_DWORD ? _mm256_sub_epi32(a, b) : _mm256_sub_epi64(a, b);
+        break;
+    case VM_VSHL:
+        *r = width == VM_BYTE ? (count > 7 ? _mm256_setzero_si256()
+                : _mm256_and_si256(_mm256_sll_epi16(a, n), _mm256_set1_epi8((char)(0xff << count))))
+            : width == VM_WORD ? _mm256_sll_epi16(a, n) : width == VM_DWORD ? _mm256_sll_epi32(a, n) : _mm256_sll_epi64(a, n);
+        break;
+    case VM_VSHR:
+        *r = width == VM_BYTE ? (count > 7 ? _mm256_setzero_si256()
+                : _mm256_and_si256(_mm256_srl_epi16(a, n), _mm256_set1_epi8((char)(0xff >> count))))
+            : width == VM_WORD ? _mm256_srl_epi16(a, n) : width == VM_DWORD ? _mm256_srl_epi32(a, n) : _mm256_srl_epi64(a, n);
+        break;
+    case VM_VCMPEQ:
+        *r = width == VM_BYTE ? _mm256_cmpeq_epi8(a, b) : width == VM_WORD ? _mm256_cmpeq_epi16(a, b)
+            : width == VM_DWORD ? _mm256_cmpeq_epi32(a, b) : _mm256_cmpeq_epi64(a, b);
+        break;
+    case VM_VCMPGT:
+        *r = width == VM_BYTE ? _mm256_cmpgt_epi8(a, b) : width == VM_WORD ? _mm256_cmpgt_epi16(a, b)
+            : width == VM_DWORD ? _mm256_cmpgt_epi32(a, b) : _mm256_cmpgt_epi64(a, b);
+        break;
+    case VM_VSHUF: // per 128-bit half, like the opcode
+        *r = _mm256_shuffle_epi8(a, b);
+        break;
+    }
+}
+#endif
+
+static void vm_vlanewise(int op, int width, int bytes, union vm_vector * d,
+                         const union vm_vector * a, const union vm_vector * b, int count) {
+#if VM_SIMD >= 2
+    if (bytes == 32) {
+        vm_vavx(op, width, &d->y, a->y, b->y, count);
+        return;
+    }
+#endif
+#if VM_SIMD
+    union vm_vector r;
+    if (vm_vsse(op, width, bytes / 16, r.x, a->x, b->x, count)) {
+        if (bytes == 16)
+            r.x[1] = _mm_setzero_si128();
+        *d = r;
+        return;
+    }
+#endif
+    vm_vloop(op, width, bytes >> width, d, a, b, count);
+}
+
+static void vm_vbroadcast(union vm_vector * d, int width, int bytes, qword value) {
+#if VM_SIMD
+    __m128i x = width == VM_BYTE ? _mm_set1_epi8((char) value) : width == VM_WORD ? _mm_set1_epi16((short) value)
+        : width == VM_DWORD ? _mm_set1_epi32((int) value) : _mm_set1_epi64x((long long) value);
+    d->x[0] = x;
+    d->x[1] = bytes == 32 ? x : _mm_setzero_si128();
+#else
+    union vm_vector r;
+    memset(&r, 0, sizeof(r));
+    for (int i = 0; i < bytes >> width; i++)
+        vm_vsetlane(&r, width, i, (uint64_t) value);
+    *d = r;
+#endif
+}
+
+// The top bit of each lane, lane 0 in bit 0
+static qword vm_vmovmask(const union vm_vector * v, int width, int bytes) {
+#if VM_SIMD
+    uint64_t mask = 0;
+    int lanes = 16 >> width;
+    for (int half = 0; half < bytes / 16; half++) {
+        __m128i x = v->x[half];
+        int bits = width == VM_BYTE ? _mm_movemask_epi8(x)
+            : width == VM_WORD ? _mm_movemask_epi8(_mm_packs_epi16(x, _mm_setzero_si128()))
+            : width == VM_DWORD ? _mm_movemask_ps(_mm_castsi128_ps(x)) : _mm_movemask_pd(_mm_castsi128_pd(x));
+        mask |= (uint64_t)(unsigned) bits << (half * lanes);
+    }
+    return (qword) mask;
+#else
+    uint64_t mask = 0;
+    for (int i = 0; i < bytes >> width; i++)
+        mask |= (vm_vlane(v, width, i) >> ((8 << width) - 1)) << i;
+    return (qword) mask;
+#endif
+}
+
+// Runs one vector opcode, faults with VM_BAD_ADDRESS like VM_LOAD
+static void vm_vector(struct vm_context * ctx, const char * instr) {
+    int op = (unsigned char) instr[1], shape = GETSECOND(instr[0]), width = shape & 3;
+    int bytes = shape & VM_V256 ? 32 : 16;
+    union vm_vector * v = ctx->vregs;
+    if (!vm_vectorshape(op, shape))
+        return;
+    ctx->vregs_used = 1;
+    switch (op) {
+    case VM_VLOAD:
+    case VM_VSTORE: {
+        qword at = VM_HEAPADDR(ctx->regs, instr);
+        union vm_vector * reg = &v[GETFIRST(instr[2])];
+        if (!VM_INHEAP(ctx, at, bytes))
+            vm_fault(ctx, VM_BAD_ADDRESS);
+        else if (op == VM_VSTORE && bytes == 32)
+            memcpy(ctx->heap + at, reg, 32);
+        else if (op == VM_VSTORE)
+            memcpy(ctx->heap + at, reg, 16);
+        else if (bytes == 32)
+            memcpy(reg, ctx->heap + at, 32);
+        else {
+            memcpy(reg, ctx->heap + at, 16);
+            memset(reg->b + 16, 0, 16);
+        }
+        break;
+    }
+    case VM_VBCAST:
+        vm_vbroadcast(&v[GETFIRST(instr[2])], width, bytes, ctx->regs[GETSECOND(instr[2])]);
+        break;
+    case VM_VMOVMSK:
+        ctx->regs[GETFIRST(instr[2])] = vm_vmovmask(&v[GETSECOND(instr[2])], width, bytes);
+        break;
+    case VM_VEXTRACT:
+        ctx->regs[GETFIRST(instr[2])] = (qword) vm_vlane(&v[GETSECOND(instr[2])], width,
+                                                         (unsigned char) instr[3] & ((bytes >> width) - 1));
+        break;
+    default:
+        vm_vlanewise(op, width, bytes, &v[GETFIRST(instr[2])], &v[GETSECOND(instr[2])],
+                     &v[GETFIRST(instr[3])], (unsigned char) instr[3]);
+    }
 }
 
 static void vm_eval(struct vm_context * ctx, char * instr) {
@@ -254,7 +1175,7 @@ static void vm_eval(struct vm_context * ctx, char * instr) {
                 case VM_REG2REG: {
                     qword *reg1 = (qword*)((char*)ctx + GETFIRST(instr[2]) * sizeof(qword)),
                           *reg2 = (qword*)((char*)ctx + GETSECOND(instr[2]) * sizeof(qword)),
-                          *rdx = (qword*)(ctx + 3 * sizeof(qword));
+                          *rdx = (qword*)((char*)ctx + 3 * sizeof(qword));
                     *rdx = *reg1 % *reg2;
                     *reg1 /= *reg2;
                     break;
@@ -264,30 +1185,35 @@ static void vm_eval(struct vm_context * ctx, char * instr) {
         }
         
         case VM_CALL: {
-        	void* target_addr = (void*)*(qword*)(instr+3);
-        	typedef qword(*call_t)(void*, ...);
-        	call_t call = (call_t)target_addr;
-            
-        	word args_count = GETFIRST(instr[2]);
-            void* ptrs[16];
-            memset(&ptrs, 0, sizeof(ptrs)/sizeof(ptrs[0]));
-            for(int i = 0; i < args_count; i++) {
-                ptrs[i] = (void*) vm_pop(ctx);
-            }
-          
-            ctx->rax = call(ptrs[0], ptrs[1], ptrs[2], ptrs[3], ptrs[4], ptrs[5], ptrs[6], ptrs[7], ptrs[8], 
-                            ptrs[9], ptrs[10], ptrs[11], ptrs[12], ptrs[13], ptrs[14], ptrs[15]);
+            if (GETSECOND(instr[0]) == VM_IMPORT)
+                vm_callimport(ctx, *(qword*)(instr+3), GETFIRST(instr[2]));
+            else
+                vm_callnative(ctx, *(qword*)(instr+3), GETFIRST(instr[2]));
             break;
         }
         
         case VM_RET: {
-        	qword offset = vm_pop(ctx);
+        	qword offset = ctx->rsp ? vm_pop(ctx) : 0;
         	if (offset)
         		next_instr_offset = (dword) offset;
         	else
         		next_instr_offset = ctx->code_size; // kill ourselves
         	break;
         }
+
+        case VM_CALLSUB: {
+            if (GETSECOND(instr[0]) == VM_VAL2REG && vm_callsub(ctx, ctx->rip + next_instr_offset))
+                next_instr_offset = (dword) *(qword*)(instr + 2);
+            break;
+        }
+
+        case VM_RETSUB: {
+            if (ctx->call_depth)
+                next_instr_offset = ctx->calls[--ctx->call_depth] - ctx->rip;
+            else
+                next_instr_offset = ctx->code_size; // like RET on an empty stack
+            break;
+        }
         
         case VM_MOV: {
             switch (GETSECOND(instr[0])) {
@@ -318,13 +1244,13 @@ static void vm_eval(struct vm_context * ctx, char * instr) {
                 case VM_VMEM2REG: {
                 	 qword *reg = (qword *)((char*)ctx + GETFIRST(instr[2]) * sizeof(qword)),
                                  offset = *(qword*)(instr + 3);
-                	 *reg = *(qword*)((char*)ctx->code_base + offset);
+                	 *reg = *(qword*)((char*)ctx->data_base + offset);
                 	 break; 
                 }
                 case VM_REG2VMEM: {
                 	 qword *reg = (qword *)((char*)ctx + GETFIRST(instr[2]) * sizeof(qword)),
                                  offset = *(qword*)(instr + 3);
-                	 *(qword*)((char*)ctx->code_base + offset) = *reg;
+                	 *(qword*)((char*)ctx->data_base + offset) = *reg;
                 	 break; 
                 }
             }
@@ -346,7 +1272,9 @@ static void vm_eval(struct vm_context * ctx, char * instr) {
             break;
         }
         case VM_POP: {
-        	*(dword*)((char*)ctx + GETFIRST(instr[2]) * sizeof(qword)) = vm_pop(ctx);
+        	dword value = (dword) vm_pop(ctx);
+        	if (!ctx->error)
+        		memcpy((char*)ctx + GETFIRST(instr[2]) * sizeof(qword), &value, sizeof(value)); // low dword only
             break;
         }
         case VM_LEA: {
@@ -497,29 +1425,2722 @@ static void vm_eval(struct vm_context * ctx, char * instr) {
         		qword value = *(qword*)(instr + 2);
                 next_instr_offset = (dword)value;
         	}
+        	break;
         }
         case VM_JE: {
         	if (ctx->flags & VM_FLAG_EQUALS) {
         		qword value = *(qword*)(instr + 2);
                 next_instr_offset = (dword)value;
         	}
+        	break;
+        }
+        case VM_LOAD:
+        case VM_STORE: {
+            int width = GETSECOND(instr[0]);
+            qword at = VM_HEAPADDR(ctx->regs, instr);
+            qword *reg = &ctx->regs[GETFIRST(instr[2])];
+            if (width > VM_QWORD)
+                break;
+            if (!VM_INHEAP(ctx, at, 1 << width))
+                vm_fault(ctx, VM_BAD_ADDRESS);
+            else if (instr[1] == VM_LOAD)
+                *reg = vm_heapload(ctx->heap + at, width);
+            else
+                vm_heapstore(ctx->heap + at, *reg, width);
+            break;
         }
+        case VM_MEMCPY: case VM_MEMSET:
+        case VM_MEMCMP: case VM_FINDBYTE:
+            if (GETSECOND(instr[0]) == 0)
+                vm_block(ctx, instr[1], GETFIRST(instr[2]), GETSECOND(instr[2]), GETFIRST(instr[3]), &ctx->flags);
+            break;
+        case VM_VADD: case VM_VSUB: case VM_VXOR: case VM_VAND: case VM_VOR:
+        case VM_VSHL: case VM_VSHR: case VM_VSHUF: case VM_VCMPEQ: case VM_VCMPGT:
+        case VM_VLOAD: case VM_VSTORE: case VM_VBCAST: case VM_VMOVMSK: case VM_VEXTRACT:
+            vm_vector(ctx, instr);
+            break;
        
         // TODO: implement more instructions & implement existing
         
         default: // All invalid opcodes are just ignored
             break;
         }
-        ctx->rip += next_instr_offset;
+        if (!ctx->error)
+            ctx->rip += next_instr_offset;
     }
 }
 
-static void vm_exec(struct vm_context *ctx, char *code, int size) {
-    ctx->code_base = (qword)code; // bad idea but whatever
-    ctx->code_size = (qword)size;   // bad idea but whatever
-    ctx->rip = (qword)code;
-    while (ctx->rip < (qword)(code+size))
-        vm_eval(ctx, (char*) ctx->rip);
+// Names for profiles and traces, the last opcode name covers invalid bytes
+static const char * const vm_opnames[VM_OPCOUNT + 1] = {
+    "add", "sub", "div", "mul", "neg", "xor", "shr", "shl", "and", "or", "not",
+    "mov", "lea", "cmp", "ret", "push", "pop", "call", "jmp", "jz", "jnz",
+    "je", "jne", "jg", "jl", "jle", "jge", "cpuid", "abort", "load", "store",
+    "memcpy", "memset", "memcmp", "findbyte", "vadd", "vsub", "vxor", "vand",
+    "vor", "vshl", "vshr", "vshuf", "vcmpeq", "vcmpgt", "vload", "vstore", "vbcast",
+    "vmovmsk", "vextract", "callsub", "retsub", "invalid"
+};
+
+static const char * const vm_variantnames[16] = {
+    "reg2reg", "reg2mem", "mem2reg", "val2reg", "mem2mem", "vmem2reg", "reg2vmem",
+    "import", "v8", "v9", "v10", "v11", "v12", "v13", "v14", "v15"
+};
+
+#if VM_PROFILE
+/*
+ Profiling
+
+ With VM_PROFILE, vm_exec runs every instruction through vm_profeval, which
+ counts it per opcode+variant and per rip, records taken / not taken for
+ conditional jumps and, with VM_PROFILE_CYCLES, the rdtsc cycles spent in
+ vm_eval. Counters are per thread and accumulate across runs until
+ vm_profreset. The threaded and predecoded engines are bypassed while
+ profiling, so counts don't depend on how the program was dispatched.
+*/
+
+#if VM_PROFILE_CYCLES
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+struct vm_profile {
+    qword count[VM_OPCOUNT + 1][16]; // last row counts invalid opcodes
+    qword cycles[VM_OPCOUNT + 1][16];
+    qword taken[VM_OPCOUNT], not_taken[VM_OPCOUNT];
+    qword * rips, * hits; // open addressing on the absolute rip
+    qword slots, used;
+};
+
+static VM_THREAD_LOCAL struct vm_profile vm_profile_data;
+
+// -1 for instructions that aren't conditional jumps
+static int vm_proftaken(int op, qword flags) {
+    switch (op) {
+    case VM_JZ: return flags == 0;
+    case VM_JNZ: return flags != 0;
+    case VM_JE: return (flags & VM_FLAG_EQUALS) != 0;
+    case VM_JNE: return !(flags & VM_FLAG_EQUALS);
+    case VM_JLE: return (flags & (VM_FLAG_EQUALS | VM_FLAG_LESSER)) != 0;
+    case VM_JGE: return (flags & (VM_FLAG_EQUALS | VM_FLAG_GREATER)) != 0;
+    }
+    return -1;
+}
+
+static void vm_profhit(struct vm_profile * p, qword rip) {
+    if (p->used * 2 >= p->slots) {
+        qword slots = p->slots ? p->slots * 2 : 1024, *rips, *hits;
+        rips = (qword*) VM_CALLOC(slots, sizeof(qword));
+        hits = (qword*) VM_CALLOC(slots, sizeof(qword));
+        if (!rips || !hits) {
+            VM_FREE(rips);
+            VM_FREE(hits);
+            return; // the histogram misses this hit
+        }
+        for (qword i = 0; i < p->slots; i++) {
+            if (p->rips[i]) {
+                qword at = ((uint64_t) p->rips[i] * 0x9E3779B97F4A7C15ull) >> 20 & (slots - 1);
+                while (rips[at])
+                    at = (at + 1) & (slots - 1);
+                rips[at] = p->rips[i];
+                hits[at] = p->hits[i];
+            }
+        }
+        VM_FREE(p->rips);
+        VM_FREE(p->hits);
+        p->rips = rips;
+        p->hits = hits;
+        p->slots = slots;
+    }
+    qword at = ((uint64_t) rip * 0x9E3779B97F4A7C15ull) >> 20 & (p->slots - 1);
+    while (p->rips[at] && p->rips[at] != rip)
+        at = (at + 1) & (p->slots - 1);
+    if (!p->rips[at]) {
+        p->rips[at] = rip;
+        p->used++;
+    }
+    p->hits[at]++;
+}
+
+static void vm_profeval(struct vm_context * ctx, char * instr) {
+    struct vm_profile * p = &vm_profile_data;
+    unsigned char op = (unsigned char) instr[1];
+    int variant = GETSECOND(instr[0]), row = op < VM_OPCOUNT ? op : (int) VM_OPCOUNT;
+    int taken = op < VM_OPCOUNT ? vm_proftaken(op, ctx->flags) : -1;
+    p->count[row][variant]++;
+    vm_profhit(p, ctx->rip);
+    if (taken > 0)
+        p->taken[op]++;
+    else if (!taken)
+        p->not_taken[op]++;
+#if VM_PROFILE_CYCLES
+    uint64_t start = __rdtsc();
+    vm_eval(ctx, instr);
+    p->cycles[row][variant] += __rdtsc() - start;
+#else
+    vm_eval(ctx, instr);
+#endif
+}
+
+static void vm_profreset(void) {
+    VM_FREE(vm_profile_data.rips);
+    VM_FREE(vm_profile_data.hits);
+    memset(&vm_profile_data, 0, sizeof(vm_profile_data));
+}
+
+static int vm_profcompare(const void * a, const void * b) {
+    qword x = ((const qword*) a)[1], y = ((const qword*) b)[1];
+    return x < y ? 1 : x > y ? -1 : ((const qword*) a)[0] < ((const qword*) b)[0] ? -1 : 1;
+}
+
+// Prints this thread's counters as text or JSON. The rip histogram lists the
+// hits inside [code, code + size) by code offset, hottest first.
+static void vm_profdump(FILE * out, char * code, qword size, int json) {
+    struct vm_profile * p = &vm_profile_data;
+    qword n = 0, * rows = (qword*) VM_MALLOC((p->used + 1) * 2 * sizeof(qword));
+    const char * sep = "";
+    for (qword i = 0; rows && i < p->slots; i++) {
+        if (p->rips[i] >= (qword) code && p->rips[i] < (qword) code + size) {
+            rows[n * 2] = p->rips[i] - (qword) code;
+            rows[n * 2 + 1] = p->hits[i];
+            n++;
+        }
+    }
+    if (n)
+        qsort(rows, n, 2 * sizeof(qword), vm_profcompare);
+    fprintf(out, json ? "{\"opcodes\": [" : "%-8s %-9s %14s %16s\n", "opcode", "variant", "count", "cycles");
+    for (int op = 0; op <= VM_OPCOUNT; op++) {
+        for (int v = 0; v < 16; v++) {
+            if (!p->count[op][v])
+                continue;
+            if (json)
+                fprintf(out, "%s\n  {\"op\": \"%s\", \"variant\": \"%s\", \"count\": %lld, \"cycles\": %lld}", sep,
+                        vm_opnames[op], vm_variantnames[v], (long long) p->count[op][v], (long long) p->cycles[op][v]);
+            else
+                fprintf(out, "%-8s %-9s %14lld %16lld\n", vm_opnames[op], vm_variantnames[v],
+                        (long long) p->count[op][v], (long long) p->cycles[op][v]);
+            sep = ",";
+        }
+    }
+    fprintf(out, json ? "],\n\"branches\": [" : "\n%-8s %14s %14s %8s\n", "branch", "taken", "not taken", "taken%");
+    sep = "";
+    for (int op = 0; op < VM_OPCOUNT; op++) {
+        qword total = p->taken[op] + p->not_taken[op];
+        if (!total)
+            continue;
+        if (json)
+            fprintf(out, "%s\n  {\"op\": \"%s\", \"taken\": %lld, \"not_taken\": %lld}", sep,
+                    vm_opnames[op], (long long) p->taken[op], (long long) p->not_taken[op]);
+        else
+            fprintf(out, "%-8s %14lld %14lld %7.1f%%\n", vm_opnames[op], (long long) p->taken[op],
+                    (long long) p->not_taken[op], 100.0 * p->taken[op] / total);
+        sep = ",";
+    }
+    fprintf(out, json ? "],\n\"rips\": [" : "\n%-8s %14s\n", "offset", "hits");
+    for (qword i = 0; i < n; i++) {
+        if (json)
+            fprintf(out, "%s\n  {\"offset\": %lld, \"hits\": %lld}", i ? "," : "",
+                    (long long) rows[i * 2], (long long) rows[i * 2 + 1]);
+        else
+            fprintf(out, "0x%06llx %14lld\n", (unsigned long long) rows[i * 2], (long long) rows[i * 2 + 1]);
+    }
+    if (json)
+        fprintf(out, "]}\n");
+    VM_FREE(rows);
+}
+#endif
+
+/*
+ Execution traces
+
+ A context with a vm_trace attached (vm_settrace) records the instructions
+ vm_exec, vm_run and vm_execprogram run in it as 16-byte records: code offset,
+ opcode, variant, the register the instruction wrote with its new value, and
+ the low byte of flags after it. Every vm_exec / vm_run slice starts with a
+ VM_TRACE_ENTRY record per register, so a trace can be replayed from any
+ entry, including after the host changed registers between slices. With a
+ sampling period of n, only every n-th instruction is recorded.
+
+ Records go into a ring that another thread may drain with vm_traceread while
+ the VM runs: one writer, one reader, no locks. The reader sees them
+ VM_TRACE_BATCH at a time and at the end of every slice, and the register
+ records opening a slice all at once. When the ring is
+ full new records are dropped, counted, and the next one stored carries
+ VM_TRACE_GAP. vm_tracesave drains it into a file with the traced code, for
+ trace.c to reconstruct control flow, list hot paths and replay against the
+ code.
+
+ Traced slices run the vm_eval loop, the threaded and predecoded engines are
+ bypassed. Without a trace the cost is one test per vm_exec / vm_run call.
+ Attaching or detaching takes effect at the next call.
+*/
+
+#ifndef VM_TRACE_CAPACITY
+#define VM_TRACE_CAPACITY (1 << 20) // records in a vm_maketrace ring by default
+#endif
+
+#ifndef VM_TRACE_BATCH
+#define VM_TRACE_BATCH 64 // records the VM writes before the reader can see them, a power of two
+#endif
+
+#define VM_TRACE_ENTRY 0xff // vm_tracerecord.op of the register records opening a slice
+#define VM_TRACE_NOREG 0xff // vm_tracerecord.reg of instructions that write no register
+#define VM_TRACE_GAP 0x80 // in vm_tracerecord.variant: records were dropped before this one
+#define VM_TRACE_VERSION 1
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define VM_LOAD_ACQUIRE(p) (*(volatile uint64_t*)(p))
+#define VM_STORE_RELEASE(p, v) (*(volatile uint64_t*)(p) = (v))
+#else
+#define VM_LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define VM_STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#endif
+
+struct vm_tracerecord {
+    int32_t offset; // rip - code_base before the instruction
+    uint8_t op;
+    uint8_t variant; // with VM_TRACE_GAP
+    uint8_t reg; // register written or VM_TRACE_NOREG, for entries the register
+    uint8_t flags; // low byte of flags after the instruction
+    qword value; // the register's new value, for entries of rip the code base
+};
+
+struct vm_trace {
+    struct vm_tracerecord * records;
+    uint64_t mask; // capacity - 1
+    uint64_t head; // next record to write, only the VM stores it
+    uint64_t tail; // next record to read, only the reader stores it
+    uint64_t tail_seen; // the VM's last look at tail
+    uint64_t dropped;
+    uint32_t period, countdown; // record every period-th instruction
+    uint32_t gap; // a record was dropped since the last one stored
+    qword code_base, code_size; // code of the first traced slice, for vm_tracesave
+};
+
+// The file vm_tracesave writes: this header, code_size bytes of code, then
+// `records` vm_tracerecords
+struct vm_tracefile {
+    char magic[8]; // "CVMTRACE"
+    uint32_t version, record_size;
+    uint32_t period, reserved;
+    qword code_base, code_size;
+    qword records, dropped;
+};
+
+static void vm_destroytrace(struct vm_trace * trace) {
+    if (trace) {
+        VM_FREE(trace->records);
+        VM_FREE(trace);
+    }
+}
+
+// capacity is rounded up to a power of two, 0 means VM_TRACE_CAPACITY.
+// period 0 or 1 records every instruction.
+static struct vm_trace * vm_maketrace(qword capacity, uint32_t period) {
+    struct vm_trace * trace = ALLOCSTRUCT(vm_trace);
+    uint64_t size = 1;
+    if (!trace)
+        return 0;
+    memset(trace, 0, sizeof(struct vm_trace));
+    while (size < (uint64_t)(capacity > 0 ? capacity : VM_TRACE_CAPACITY))
+        size *= 2;
+    trace->mask = size - 1;
+    trace->period = trace->countdown = period > 1 ? period : 1;
+    trace->records = (struct vm_tracerecord*) VM_MALLOC(size * sizeof(struct vm_tracerecord));
+    if (!trace->records) {
+        vm_destroytrace(trace);
+        return 0;
+    }
+    return trace;
+}
+
+// Starts recording the context's runs into a trace, NULL stops. A trace has
+// one writer: don't attach it to contexts running at the same time.
+static void vm_settrace(struct vm_context * ctx, struct vm_trace * trace) {
+    ctx->trace = trace;
+}
+
+// Whether the reader freed slots since the ring last looked full with the
+// writer at `head`, counts a dropped record if not
+static int vm_traceroom(struct vm_trace * trace, uint64_t head) {
+    trace->tail_seen = VM_LOAD_ACQUIRE(&trace->tail);
+    if (head - trace->tail_seen <= trace->mask)
+        return 1;
+    trace->dropped++;
+    trace->gap = 1;
+    return 0;
+}
+
+// Per opcode, bit v set: variant v writes the register in the first nibble
+// (CALL writes rax). A table rather than a switch, which costs the traced
+// loop a second indirect branch per instruction.
+static const uint16_t vm_tracewrites[VM_OPCOUNT] = {
+    0x0009, 0x0009, 0x0009, 0x0009, 0x0000, // add sub div mul neg
+    0x0009, 0x0009, 0x0009, 0x0000, 0x0000, 0x0000, // xor shr shl and or not
+    0x002d, 0x0009, 0x0000, 0x0000, 0x0000, 0xffff, // mov lea cmp ret push pop
+    0xffff, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, // call jmp jcc
+    0x0000, 0x0000, // cpuid abort
+    0x000f, 0x0000, 0x0000, 0x0000, 0x0000, 0x0001, // load store memcpy memset memcmp findbyte
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, // vadd ... vshuf
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x00ff, 0x00ff, // vcmpeq ... vbcast vmovmsk vextract
+    0x0000, 0x0000 // callsub retsub
+};
+
+// The register an instruction writes besides rip and flags, VM_TRACE_NOREG
+// if none. DIV also writes rdx.
+static int vm_tracereg(const char * instr) {
+    int op = (unsigned char) instr[1];
+    if (op >= VM_OPCOUNT || !(vm_tracewrites[op] >> GETSECOND(instr[0]) & 1))
+        return VM_TRACE_NOREG;
+    return op == VM_CALL ? 0 : GETFIRST(instr[2]);
+}
+
+// The register records that open a traced slice, published together
+static void vm_traceentry(struct vm_context * ctx, struct vm_trace * trace) {
+    uint64_t head = trace->head;
+    if (!trace->code_base) {
+        trace->code_base = ctx->code_base;
+        trace->code_size = ctx->code_size;
+    }
+    for (int i = 0; i < 16; i++) {
+        struct vm_tracerecord * rec = &trace->records[head & trace->mask];
+        if (head - trace->tail_seen > trace->mask && !vm_traceroom(trace, head))
+            continue;
+        rec->offset = (int32_t)(ctx->rip - ctx->code_base);
+        rec->op = VM_TRACE_ENTRY;
+        rec->variant = trace->gap ? VM_TRACE_GAP : 0;
+        rec->reg = (uint8_t) i;
+        rec->flags = (uint8_t) ctx->flags;
+        rec->value = i == 12 ? ctx->code_base : ctx->regs[i];
+        trace->gap = 0;
+        head++;
+    }
+    VM_STORE_RELEASE(&trace->head, head);
+}
+
+// Copies up to `max` records out of the ring and frees their slots.
+// Returns how many, 0 if the ring is empty. Only one thread may read.
+static qword vm_traceread(struct vm_trace * trace, struct vm_tracerecord * out, qword max) {
+    uint64_t tail = trace->tail, head = VM_LOAD_ACQUIRE(&trace->head), n = 0;
+    while (tail + n != head && n < (uint64_t) max) {
+        out[n] = trace->records[(tail + n) & trace->mask];
+        n++;
+    }
+    VM_STORE_RELEASE(&trace->tail, tail + n);
+    return (qword) n;
+}
+
+// Drains the ring into a trace file together with the code of the first
+// traced slice, which must still be alive. Returns 0 on success.
+static int vm_tracesave(struct vm_trace * trace, FILE * out) {
+    struct vm_tracefile header;
+    struct vm_tracerecord chunk[256];
+    qword left = (qword)(VM_LOAD_ACQUIRE(&trace->head) - trace->tail), n;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "CVMTRACE", 8);
+    header.version = VM_TRACE_VERSION;
+    header.record_size = sizeof(struct vm_tracerecord);
+    header.period = trace->period;
+    header.code_base = trace->code_base;
+    header.code_size = trace->code_size;
+    header.records = left;
+    header.dropped = trace->dropped;
+    if (fwrite(&header, sizeof(header), 1, out) != 1
+        || (trace->code_size && fwrite((char*) trace->code_base, (size_t) trace->code_size, 1, out) != 1))
+        return 1;
+    while (left && (n = vm_traceread(trace, chunk, left < 256 ? left : 256))) {
+        if (fwrite(chunk, sizeof(struct vm_tracerecord), (size_t) n, out) != (size_t) n)
+            return 1;
+        left -= n;
+    }
+    return fflush(out) != 0;
+}
+
+/*
+ Predecoded execution
+
+ vm_predecode converts a code buffer once into an array of fixed-width records
+ (handler, register indices, aligned immediate, resolved branch target), so
+ hot code doesn't re-parse nibbles or load unaligned immediates every time.
+ Decoding follows control flow from offset 0, so data embedded in the code is
+ never decoded. Targets of dynamic jumps (JMP reg, RET) are decoded on first
+ use. Instructions with rip or flags as an operand are handed to vm_eval.
+ CMP only records its operands, flags are computed when something reads them.
+*/
+
+// X(name, registers used (1 = first, 2 = second), immediate offset)
+#define VM_HANDLER_LIST(X) \
+    X(NOP, 0, 0) \
+    X(ADD_VAL, 1, 3) X(ADD_REG, 3, 0) X(SUB_VAL, 1, 3) X(SUB_REG, 3, 0) \
+    X(MUL_VAL, 1, 3) X(MUL_REG, 3, 0) X(DIV_VAL, 1, 3) X(DIV_REG, 3, 0) \
+    X(XOR_VAL, 1, 3) X(XOR_REG, 3, 0) X(SHL_VAL, 1, 3) X(SHL_REG, 3, 0) \
+    X(SHR_VAL, 1, 3) X(SHR_REG, 3, 0) \
+    X(MOV_VAL, 1, 3) X(MOV_REG, 3, 0) X(MOV_MEM2REG, 1, 3) X(MOV_REG2MEM, 1, 3) \
+    X(MOV_VMEM2REG, 1, 3) X(MOV_REG2VMEM, 1, 3) \
+    X(LEA_VAL, 1, 3) X(LEA_REG, 3, 0) X(CMP_VAL, 1, 3) X(CMP_REG, 3, 0) \
+    X(PUSH_VAL, 0, 2) X(PUSH_REG, 1, 0) X(POP, 1, 0) X(CALL, 0, 3) X(CALL_IMPORT, 0, 3) X(RET, 0, 0) \
+    X(JMP_VAL, 0, 2) X(JMP_REG, 1, 0) X(JZ, 0, 2) X(JNZ, 0, 2) \
+    X(JE, 0, 2) X(JNE, 0, 2) X(JLE, 0, 2) X(JGE, 0, 2) X(CALLSUB, 0, 2) X(RETSUB, 0, 0) \
+    X(LOAD8, 3, 0) X(LOAD16, 3, 0) X(LOAD32, 3, 0) X(LOAD64, 3, 0) \
+    X(STORE8, 3, 0) X(STORE16, 3, 0) X(STORE32, 3, 0) X(STORE64, 3, 0) X(BLOCK, 3, 0) \
+    X(VECTOR, 0, 0) \
+    X(GOTO, 0, 0) X(EXIT, 0, 0) X(SLOW, 0, 0) \
+    VM_FUSED_LIST(X)
+
+// Superinstructions made by vm_optimize. A fused record executes itself and
+// the records after it, which stay in place for code jumping to them directly.
+#define VM_FUSED_LIST(X) \
+    X(CMPJE_VAL, 0, 0) X(CMPJNE_VAL, 0, 0) X(CMPJLE_VAL, 0, 0) X(CMPJGE_VAL, 0, 0) \
+    X(CMPJE_REG, 0, 0) X(CMPJNE_REG, 0, 0) X(CMPJLE_REG, 0, 0) X(CMPJGE_REG, 0, 0) \
+    X(MOVI_ADD, 0, 0) X(MOVI_SUB, 0, 0) X(MOVI_MUL, 0, 0) X(MOVI_XOR, 0, 0) \
+    X(ADDI_JMP, 0, 0) X(SUBI_JMP, 0, 0) X(PUSH2_CALL, 0, 0)
+
+enum vm_handler {
+#define VM_HANDLER_ENUM(name, regs, imm) VM_H_##name,
+    VM_HANDLER_LIST(VM_HANDLER_ENUM)
+#undef VM_HANDLER_ENUM
+    VM_H_COUNT
+};
+
+enum vm_insn_flags {
+    VM_INSN_BRANCH = 1, // target is a static branch destination
+    VM_INSN_END = 2     // never falls through to the next record
+};
+
+struct vm_insn {
+    uint16_t handler;    // enum vm_handler
+    uint8_t op, variant; // original encoding
+    uint8_t r1, r2;      // register indices
+    uint8_t size, flags; // encoded length, enum vm_insn_flags
+    uint32_t offset;     // offset of the instruction in the code
+    int32_t target;      // record index of the branch target
+    qword imm;
+    qword imm2;          // spare operand for fused records
+};
+
+struct vm_decoded {
+    char *code;
+    qword code_size;
+    struct vm_insn *insns;
+    int32_t count, capacity;
+    int32_t *index;      // code offset -> record index, -1 if not decoded
+    char *covered;       // bytes read by decoded instructions
+    char *snapshot;      // covered bytes at decode time, validate cache hits
+    int refs, orphan;    // executions in flight, evicted while running
+    int fuse;            // run vm_fuse on newly decoded records
+};
+
+static void vm_fuse(struct vm_decoded *dec, int32_t from);
+
+static uint16_t vm_handlerof(int op, int variant) {
+#define VM_PAIR(name) (variant == VM_VAL2REG ? VM_H_##name##_VAL \
+    : variant == VM_REG2REG ? VM_H_##name##_REG : VM_H_NOP)
+    switch (op) {
+    case VM_ADD: return VM_PAIR(ADD);
+    case VM_SUB: return VM_PAIR(SUB);
+    case VM_MUL: return VM_PAIR(MUL);
+    case VM_DIV: return VM_PAIR(DIV);
+    case VM_XOR: return VM_PAIR(XOR);
+    case VM_SHL: return VM_PAIR(SHL);
+    case VM_SHR: return VM_PAIR(SHR);
+    case VM_LEA: return VM_PAIR(LEA);
+    case VM_CMP: return VM_PAIR(CMP);
+    case VM_PUSH: return VM_PAIR(PUSH);
+    case VM_JMP: return VM_PAIR(JMP);
+    case VM_MOV:
+        switch (variant) {
+        case VM_VAL2REG: return VM_H_MOV_VAL;
+        case VM_REG2REG: return VM_H_MOV_REG;
+        case VM_MEM2REG: return VM_H_MOV_MEM2REG;
+        case VM_REG2MEM: return VM_H_MOV_REG2MEM;
+        case VM_VMEM2REG: return VM_H_MOV_VMEM2REG;
+        case VM_REG2VMEM: return VM_H_MOV_REG2VMEM;
+        }
+        return VM_H_NOP;
+    case VM_POP: return VM_H_POP;
+    case VM_CALL: return variant == VM_IMPORT ? VM_H_CALL_IMPORT : VM_H_CALL;
+    case VM_RET: return VM_H_RET;
+    case VM_JZ: return VM_H_JZ;
+    case VM_JNZ: return VM_H_JNZ;
+    case VM_JE: return VM_H_JE;
+    case VM_JNE: return VM_H_JNE;
+    case VM_JLE: return VM_H_JLE;
+    case VM_JGE: return VM_H_JGE;
+    case VM_CALLSUB: return variant == VM_VAL2REG ? VM_H_CALLSUB : VM_H_NOP;
+    case VM_RETSUB: return VM_H_RETSUB;
+    case VM_LOAD: return variant <= VM_QWORD ? VM_H_LOAD8 + variant : VM_H_NOP;
+    case VM_STORE: return variant <= VM_QWORD ? VM_H_STORE8 + variant : VM_H_NOP;
+    case VM_MEMCPY: case VM_MEMSET:
+    case VM_MEMCMP: case VM_FINDBYTE:
+        return variant == 0 ? VM_H_BLOCK : VM_H_NOP;
+    case VM_VADD: case VM_VSUB: case VM_VXOR: case VM_VAND: case VM_VOR:
+    case VM_VSHL: case VM_VSHR: case VM_VSHUF: case VM_VCMPEQ: case VM_VCMPGT:
+    case VM_VLOAD: case VM_VSTORE: case VM_VBCAST: case VM_VMOVMSK: case VM_VEXTRACT:
+        return vm_vectorshape(op, variant) ? VM_H_VECTOR : VM_H_NOP;
+    }
+    return VM_H_NOP;
+#undef VM_PAIR
+}
+
+static const uint8_t vm_handler_regs[VM_H_COUNT] = {
+#define VM_HANDLER_REGS(name, regs, imm) regs,
+    VM_HANDLER_LIST(VM_HANDLER_REGS)
+#undef VM_HANDLER_REGS
+};
+
+static const uint8_t vm_handler_imm[VM_H_COUNT] = {
+#define VM_HANDLER_IMM(name, regs, imm) imm,
+    VM_HANDLER_LIST(VM_HANDLER_IMM)
+#undef VM_HANDLER_IMM
+};
+
+static int32_t vm_decode_emit(struct vm_decoded *dec, struct vm_insn *insn) {
+    if (dec->count == dec->capacity) {
+        int32_t capacity = dec->capacity ? dec->capacity * 2 : 64;
+        struct vm_insn *insns = (struct vm_insn*) VM_REALLOC(dec->insns, capacity * sizeof(struct vm_insn));
+        if (!insns)
+            return -1;
+        dec->insns = insns;
+        dec->capacity = capacity;
+    }
+    dec->insns[dec->count] = *insn;
+    return dec->count++;
+}
+
+// Decodes a straight-line run starting at offset, returns its first record
+static int32_t vm_decode_linear(struct vm_decoded *dec, qword offset) {
+    int32_t first = -1;
+    for (;;) {
+        struct vm_insn insn;
+        int32_t at;
+        memset(&insn, 0, sizeof(insn));
+        insn.offset = (uint32_t) offset;
+        insn.target = -1;
+        insn.flags = VM_INSN_END;
+        if (offset < 0 || offset >= dec->code_size) {
+            insn.handler = VM_H_EXIT;
+            insn.imm = offset;
+        } else if (dec->index[offset] >= 0) {
+            insn.handler = VM_H_GOTO;
+            insn.target = dec->index[offset];
+        } else {
+            char *instr = dec->code + offset;
+            qword end;
+            insn.size = GETFIRST(instr[0]);
+            insn.variant = GETSECOND(instr[0]);
+            insn.op = offset + 1 < dec->code_size ? (uint8_t)instr[1] : (int) VM_OPCOUNT;
+            insn.handler = insn.op < VM_OPCOUNT ? vm_handlerof(insn.op, insn.variant) : (int) VM_H_NOP;
+            if (offset + 2 < dec->code_size) {
+                insn.r1 = GETFIRST(instr[2]);
+                insn.r2 = GETSECOND(instr[2]);
+            }
+            end = offset + insn.size;
+            if (vm_handler_imm[insn.handler]) {
+                // immediates are read even past the encoded length, like vm_eval
+                qword at_imm = offset + vm_handler_imm[insn.handler];
+                if (at_imm < dec->code_size)
+                    memcpy(&insn.imm, dec->code + at_imm,
+                           dec->code_size - at_imm < 8 ? dec->code_size - at_imm : 8);
+                if (at_imm + 8 > end)
+                    end = at_imm + 8;
+            }
+            if (insn.handler >= VM_H_LOAD8 && insn.handler <= VM_H_BLOCK) {
+                // index and scale, or the count register, then a dword displacement
+                unsigned char extra = offset + 3 < dec->code_size ? (unsigned char) instr[3] : 0;
+                qword need = insn.handler == VM_H_BLOCK ? 4 : 8;
+                dword disp = 0;
+                if (need == 8 && offset + 4 < dec->code_size)
+                    memcpy(&disp, instr + 4, dec->code_size - offset - 4 < 4 ? dec->code_size - offset - 4 : 4);
+                insn.imm = disp;
+                insn.imm2 = GETFIRST(extra) | GETSECOND(extra) << 8;
+                if (offset + need > end)
+                    end = offset + need;
+                if ((GETFIRST(extra) == 12 || GETFIRST(extra) == 13)
+                    && (insn.handler == VM_H_BLOCK || GETSECOND(extra)))
+                    insn.handler = VM_H_SLOW;
+            }
+            if (insn.handler == VM_H_VECTOR) {
+                // scalar operands are checked here, vector ones can't be rip or flags
+                if (offset + VM_VECTOR_SIZE(insn.op) > end)
+                    end = offset + VM_VECTOR_SIZE(insn.op);
+                if (end > dec->code_size || vm_vectorsysreg(instr))
+                    insn.handler = VM_H_SLOW;
+            }
+            if (((vm_handler_regs[insn.handler] & 1) && (insn.r1 == 12 || insn.r1 == 13))
+                || ((vm_handler_regs[insn.handler] & 2) && (insn.r2 == 12 || insn.r2 == 13)))
+                insn.handler = VM_H_SLOW; // rip or flags as an operand
+            switch (insn.handler) {
+            case VM_H_JMP_VAL:
+                insn.flags = VM_INSN_BRANCH | VM_INSN_END;
+                break;
+            case VM_H_JZ: case VM_H_JNZ: case VM_H_JE:
+            case VM_H_JNE: case VM_H_JLE: case VM_H_JGE:
+            case VM_H_CALLSUB: // the return lands on the fallthrough
+                insn.flags = VM_INSN_BRANCH;
+                break;
+            case VM_H_JMP_REG: case VM_H_RET: case VM_H_RETSUB:
+                break;
+            default:
+                insn.flags = 0;
+            }
+            if (end > dec->code_size)
+                end = dec->code_size;
+            memset(dec->covered + offset, 1, end - offset);
+            memcpy(dec->snapshot + offset, dec->code + offset, end - offset);
+        }
+        at = vm_decode_emit(dec, &insn);
+        if (at < 0)
+            return -1;
+        if (first < 0)
+            first = at;
+        if (insn.handler != VM_H_EXIT && insn.handler != VM_H_GOTO)
+            dec->index[offset] = at;
+        if (insn.flags & VM_INSN_END)
+            return first;
+        offset += insn.size;
+    }
+}
+
+// Returns the record index for a code offset, decoding it if needed
+static int32_t vm_decode_at(struct vm_decoded *dec, qword offset) {
+    int32_t first, i;
+    if (offset < 0 || offset >= dec->code_size)
+        return -1;
+    if (dec->index[offset] >= 0)
+        return dec->index[offset];
+    i = dec->count;
+    first = vm_decode_linear(dec, offset);
+    // resolve static branch targets, decoding new runs as they're found
+    for (; first >= 0 && i < dec->count; i++) {
+        if ((dec->insns[i].flags & VM_INSN_BRANCH) && dec->insns[i].target < 0) {
+            qword target = dec->insns[i].offset + (qword)(dword)dec->insns[i].imm;
+            int32_t at = target >= 0 && target < dec->code_size && dec->index[target] >= 0
+                ? dec->index[target] : vm_decode_linear(dec, target);
+            if (at < 0)
+                return -1;
+            dec->insns[i].target = at;
+        }
+    }
+    if (first >= 0 && dec->fuse)
+        vm_fuse(dec, first);
+    return first;
+}
+
+static void vm_decode_reset(struct vm_decoded *dec) {
+    dec->count = 0;
+    memset(dec->index, 0xff, dec->code_size * sizeof(int32_t));
+    memset(dec->covered, 0, dec->code_size);
+}
+
+// Whether the decoded instructions still match the code. Data stored between
+// them doesn't count, so code that keeps counters in its own buffer stays cached.
+static int vm_decode_current(struct vm_decoded *dec) {
+    for (qword i = 0; i < dec->code_size; ) {
+        qword start = i;
+        if (!dec->covered[i]) {
+            i++;
+            continue;
+        }
+        while (i < dec->code_size && dec->covered[i])
+            i++;
+        if (memcmp(dec->snapshot + start, dec->code + start, i - start))
+            return 0;
+    }
+    return 1;
+}
+
+// Whether a qword store at a code offset hits decoded instructions
+static int vm_decode_touched(struct vm_decoded *dec, qword offset) {
+    for (qword i = offset < 0 ? 0 : offset; i < offset + 8 && i < dec->code_size; i++)
+        if (dec->covered[i])
+            return 1;
+    return 0;
+}
+
+static void vm_destroydecoded(struct vm_decoded *dec) {
+    if (dec) {
+        VM_FREE(dec->insns);
+        VM_FREE(dec->index);
+        VM_FREE(dec->covered);
+        VM_FREE(dec->snapshot);
+        VM_FREE(dec);
+    }
+}
+
+static struct vm_decoded *vm_predecode(char *code, qword size) {
+    struct vm_decoded *dec = ALLOCSTRUCT(vm_decoded);
+    if (!dec)
+        return 0;
+    memset(dec, 0, sizeof(struct vm_decoded));
+    dec->code = code;
+    dec->code_size = size;
+    dec->index = (int32_t*) VM_MALLOC(size * sizeof(int32_t) + 1);
+    dec->covered = (char*) VM_MALLOC(size + 1);
+    dec->snapshot = (char*) VM_MALLOC(size + 1);
+    if (!dec->index || !dec->covered || !dec->snapshot) {
+        vm_destroydecoded(dec);
+        return 0;
+    }
+    vm_decode_reset(dec);
+    if (size && vm_decode_at(dec, 0) < 0) {
+        vm_destroydecoded(dec);
+        return 0;
+    }
+    return dec;
+}
+
+// Rewrites handlers of records from index `from` on into superinstructions
+static void vm_fuse(struct vm_decoded *dec, int32_t from) {
+    for (int32_t i = from; i + 1 < dec->count; i++) {
+        struct vm_insn *a = &dec->insns[i], *b = a + 1;
+        if (a->flags & VM_INSN_END)
+            continue; // b isn't the fallthrough of a
+        switch (a->handler) {
+        case VM_H_CMP_VAL:
+        case VM_H_CMP_REG: {
+            int reg = a->handler == VM_H_CMP_REG;
+            switch (b->handler) {
+            case VM_H_JE: a->handler = reg ? VM_H_CMPJE_REG : VM_H_CMPJE_VAL; break;
+            case VM_H_JNE: a->handler = reg ? VM_H_CMPJNE_REG : VM_H_CMPJNE_VAL; break;
+            case VM_H_JLE: a->handler = reg ? VM_H_CMPJLE_REG : VM_H_CMPJLE_VAL; break;
+            case VM_H_JGE: a->handler = reg ? VM_H_CMPJGE_REG : VM_H_CMPJGE_VAL; break;
+            }
+            break;
+        }
+        case VM_H_MOV_VAL:
+            if (b->r2 != a->r1)
+                break;
+            switch (b->handler) {
+            case VM_H_ADD_REG: a->handler = VM_H_MOVI_ADD; break;
+            case VM_H_SUB_REG: a->handler = VM_H_MOVI_SUB; break;
+            case VM_H_MUL_REG: a->handler = VM_H_MOVI_MUL; break;
+            case VM_H_XOR_REG: a->handler = VM_H_MOVI_XOR; break;
+            }
+            break;
+        case VM_H_ADD_VAL:
+            if (b->handler == VM_H_JMP_VAL)
+                a->handler = VM_H_ADDI_JMP;
+            break;
+        case VM_H_SUB_VAL:
+            if (b->handler == VM_H_JMP_VAL)
+                a->handler = VM_H_SUBI_JMP;
+            break;
+        case VM_H_PUSH_VAL:
+        case VM_H_PUSH_REG:
+            if ((b->handler == VM_H_PUSH_VAL || b->handler == VM_H_PUSH_REG)
+                && i + 2 < dec->count && b[1].handler == VM_H_CALL)
+                a->handler = VM_H_PUSH2_CALL;
+            break;
+        }
+    }
+}
+
+// Enables superinstruction fusion for a decoded program, including records
+// decoded later on demand
+static void vm_optimize(struct vm_decoded *dec) {
+    if (dec && !dec->fuse) {
+        dec->fuse = 1;
+        vm_fuse(dec, 0);
+    }
+}
+
+static const char *vm_fusionname(int handler) {
+    switch (handler) {
+    case VM_H_CMPJE_VAL: case VM_H_CMPJE_REG: return "cmp+je";
+    case VM_H_CMPJNE_VAL: case VM_H_CMPJNE_REG: return "cmp+jne";
+    case VM_H_CMPJLE_VAL: case VM_H_CMPJLE_REG: return "cmp+jle";
+    case VM_H_CMPJGE_VAL: case VM_H_CMPJGE_REG: return "cmp+jge";
+    case VM_H_MOVI_ADD: return "mov imm+add";
+    case VM_H_MOVI_SUB: return "mov imm+sub";
+    case VM_H_MOVI_MUL: return "mov imm+mul";
+    case VM_H_MOVI_XOR: return "mov imm+xor";
+    case VM_H_ADDI_JMP: return "add imm+jmp";
+    case VM_H_SUBI_JMP: return "sub imm+jmp";
+    case VM_H_PUSH2_CALL: return "push+push+call";
+    }
+    return 0;
+}
+
+// Prints which fusions fired, per kind and per code offset
+static int vm_fusionreport(struct vm_decoded *dec, FILE *out) {
+    int counts[VM_H_COUNT] = {0}, total = 0;
+    for (int32_t i = 0; i < dec->count; i++) {
+        const char *name = vm_fusionname(dec->insns[i].handler);
+        if (name) {
+            fprintf(out, "  %#06x  %s\n", (unsigned) dec->insns[i].offset, name);
+            counts[dec->insns[i].handler]++;
+            total++;
+        }
+    }
+    for (int h = 0; h < VM_H_COUNT; h++)
+        if (counts[h])
+            fprintf(out, "%-16s %d\n", vm_fusionname(h), counts[h]);
+    fprintf(out, "%d fusions in %d records\n", total, (int) dec->count);
+    return total;
+}
+
+#define VM_DR1 regs[insn->r1]
+#define VM_DR2 regs[insn->r2]
+#if VM_THREADED
+#define VM_DCASE(name) vm_h_##name:
+#define VM_DDISPATCH() do { insn = &insns[pc]; goto *vm_dtable[insn->handler]; } while (0)
+#else
+#define VM_DCASE(name) case VM_H_##name:
+#define VM_DDISPATCH() goto dispatch
+#endif
+#define VM_DNEXT() do { pc++; VM_DDISPATCH(); } while (0)
+#define VM_DCHECKED() do { \
+        if (ctx->error) { \
+            next = insn->offset; \
+            goto leave; \
+        } \
+        VM_DNEXT(); \
+    } while (0)
+#define VM_DGOTO(to) do { pc = (to); VM_DDISPATCH(); } while (0)
+#define VM_DFLAGS() do { \
+        if (lazy) { \
+            ctx->flags = vm_cmpflags(fa, fb); \
+            lazy = 0; \
+        } \
+    } while (0)
+#define VM_DCMPJ(a, b, cond) do { \
+        fa = (a); \
+        fb = (b); \
+        lazy = 1; \
+        if (cond) \
+            VM_DGOTO(insn[1].target); \
+        pc += 2; \
+        VM_DDISPATCH(); \
+    } while (0)
+// Heap address of a LOAD / STORE record in `at`, a fault stops at the record
+#define VM_DHEAP(width) \
+        at = (qword)((uint64_t)VM_DR2 + (uint64_t)regs[insn->imm2 & 15] * (insn->imm2 >> 8) + (uint64_t)insn->imm); \
+        if (!VM_INHEAP(ctx, at, 1 << (width))) { \
+            vm_fault(ctx, VM_BAD_ADDRESS); \
+            next = insn->offset; \
+            goto leave; \
+        }
+#define VM_DJUMP(to) do { \
+        next = (to); \
+        pc = vm_decode_at(dec, next); \
+        if (pc < 0) \
+            goto leave; \
+        insns = dec->insns; \
+        VM_DDISPATCH(); \
+    } while (0)
+
+// vm_execdecoded without setting data_base
+static int vm_rundecoded(struct vm_context *ctx, struct vm_decoded *dec) {
+    qword *regs = ctx->regs, base = (qword)dec->code, size = dec->code_size, next = 0;
+    qword fa = 0, fb = 0; // operands of the last CMP while its flags are pending
+    qword at; // heap offset of a LOAD / STORE
+    int lazy = 0;
+    struct vm_insn *insns, *insn;
+    int32_t pc;
+#if VM_THREADED
+    static void * const vm_dtable[VM_H_COUNT] = {
+#define VM_HANDLER_LABEL(name, regs, imm) &&vm_h_##name,
+        VM_HANDLER_LIST(VM_HANDLER_LABEL)
+#undef VM_HANDLER_LABEL
+    };
+#endif
+    ctx->code_base = base;
+    ctx->code_size = size;
+    ctx->error = VM_OK;
+    dec->refs++;
+    pc = vm_decode_at(dec, 0);
+    if (pc < 0)
+        goto leave;
+    insns = dec->insns;
+#if VM_THREADED
+    VM_DDISPATCH();
+#else
+dispatch:
+    insn = &insns[pc];
+    switch (insn->handler) {
+#endif
+
+    VM_DCASE(NOP)
+        VM_DNEXT();
+    VM_DCASE(ADD_VAL)
+        VM_DR1 += insn->imm;
+        VM_DNEXT();
+    VM_DCASE(ADD_REG)
+        VM_DR1 += VM_DR2;
+        VM_DNEXT();
+    VM_DCASE(SUB_VAL)
+        VM_DR1 -= insn->imm;
+        VM_DNEXT();
+    VM_DCASE(SUB_REG)
+        VM_DR1 -= VM_DR2;
+        VM_DNEXT();
+    VM_DCASE(MUL_VAL)
+        VM_DR1 *= insn->imm;
+        VM_DNEXT();
+    VM_DCASE(MUL_REG)
+        VM_DR1 *= VM_DR2;
+        VM_DNEXT();
+    VM_DCASE(DIV_VAL) {
+        qword *reg = &VM_DR1, value = insn->imm;
+        ctx->rdx = *reg % value;
+        *reg /= value;
+        VM_DNEXT();
+    }
+    VM_DCASE(DIV_REG) {
+        qword *reg1 = &VM_DR1, *reg2 = &VM_DR2;
+        ctx->rdx = *reg1 % *reg2;
+        *reg1 /= *reg2;
+        VM_DNEXT();
+    }
+    VM_DCASE(XOR_VAL)
+        VM_DR1 ^= insn->imm;
+        VM_DNEXT();
+    VM_DCASE(XOR_REG)
+        VM_DR1 ^= VM_DR2;
+        VM_DNEXT();
+    VM_DCASE(SHL_VAL)
+        VM_DR1 <<= insn->imm;
+        VM_DNEXT();
+    VM_DCASE(SHL_REG)
+        VM_DR1 <<= VM_DR2;
+        VM_DNEXT();
+    VM_DCASE(SHR_VAL)
+        VM_DR1 >>= insn->imm;
+        VM_DNEXT();
+    VM_DCASE(SHR_REG)
+        VM_DR1 >>= VM_DR2;
+        VM_DNEXT();
+    VM_DCASE(MOV_VAL)
+        VM_DR1 = insn->imm;
+        VM_DNEXT();
+    VM_DCASE(MOV_REG)
+        VM_DR1 = VM_DR2;
+        VM_DNEXT();
+    VM_DCASE(MOV_MEM2REG)
+        VM_DR1 = *(qword*)insn->imm;
+        VM_DNEXT();
+    VM_DCASE(MOV_REG2MEM)
+        *(qword*)insn->imm = VM_DR1;
+        if (vm_decode_touched(dec, insn->imm - base)) {
+            vm_decode_reset(dec); // the code rewrote itself
+            VM_DJUMP(insn->offset + insn->size);
+        }
+        VM_DNEXT();
+    VM_DCASE(MOV_VMEM2REG)
+        VM_DR1 = *(qword*)(ctx->data_base + insn->imm);
+        VM_DNEXT();
+    VM_DCASE(MOV_REG2VMEM)
+        *(qword*)(ctx->data_base + insn->imm) = VM_DR1;
+        if ((uint64_t)(ctx->data_base + insn->imm + 8 - base) < (uint64_t)(size + 8)
+            && vm_decode_touched(dec, ctx->data_base + insn->imm - base)) {
+            vm_decode_reset(dec);
+            VM_DJUMP(insn->offset + insn->size);
+        }
+        VM_DNEXT();
+    VM_DCASE(LEA_VAL)
+        VM_DR1 = base + insn->offset + (dword)insn->imm;
+        VM_DNEXT();
+    VM_DCASE(LEA_REG)
+        VM_DR1 = base + insn->offset + (dword)VM_DR2;
+        VM_DNEXT();
+    VM_DCASE(CMP_VAL)
+        fa = VM_DR1;
+        fb = insn->imm;
+        lazy = 1;
+        VM_DNEXT();
+    VM_DCASE(CMP_REG)
+        fa = VM_DR1;
+        fb = VM_DR2;
+        lazy = 1;
+        VM_DNEXT();
+    VM_DCASE(PUSH_VAL)
+        vm_push(ctx, insn->imm);
+        VM_DCHECKED();
+    VM_DCASE(PUSH_REG)
+        vm_push(ctx, VM_DR1);
+        VM_DCHECKED();
+    VM_DCASE(POP) {
+        dword value = (dword) vm_pop(ctx);
+        if (!ctx->error)
+            memcpy(&VM_DR1, &value, sizeof(value)); // low dword only
+        VM_DCHECKED();
+    }
+    VM_DCASE(CALL)
+        vm_callnative(ctx, insn->imm, insn->r1);
+        VM_DCHECKED();
+    VM_DCASE(CALL_IMPORT)
+        vm_callimport(ctx, insn->imm, insn->r1);
+        VM_DCHECKED();
+    VM_DCASE(RET) {
+        qword offset = ctx->rsp ? vm_pop(ctx) : 0;
+        VM_DJUMP(insn->offset + (offset ? (qword)(dword)offset : size)); // 0 kills us
+    }
+    VM_DCASE(JMP_VAL)
+        VM_DGOTO(insn->target);
+    VM_DCASE(JMP_REG)
+        VM_DJUMP(insn->offset + VM_DR1);
+    VM_DCASE(JZ)
+        VM_DFLAGS();
+        if (ctx->flags == 0)
+            VM_DGOTO(insn->target);
+        VM_DNEXT();
+    VM_DCASE(JNZ)
+        VM_DFLAGS();
+        if (ctx->flags != 0)
+            VM_DGOTO(insn->target);
+        VM_DNEXT();
+    VM_DCASE(JE)
+        VM_DFLAGS();
+        if (ctx->flags & VM_FLAG_EQUALS)
+            VM_DGOTO(insn->target);
+        VM_DNEXT();
+    VM_DCASE(JNE)
+        VM_DFLAGS();
+        if (!(ctx->flags & VM_FLAG_EQUALS))
+            VM_DGOTO(insn->target);
+        VM_DNEXT();
+    VM_DCASE(JLE)
+        VM_DFLAGS();
+        if ((ctx->flags & VM_FLAG_EQUALS) || (ctx->flags & VM_FLAG_LESSER))
+            VM_DGOTO(insn->target);
+        VM_DNEXT();
+    VM_DCASE(JGE)
+        VM_DFLAGS();
+        if ((ctx->flags & VM_FLAG_EQUALS) || (ctx->flags & VM_FLAG_GREATER))
+            VM_DGOTO(insn->target);
+        VM_DNEXT();
+    VM_DCASE(CALLSUB)
+        if (!vm_callsub(ctx, base + insn->offset + insn->size)) {
+            next = insn->offset;
+            goto leave;
+        }
+        VM_DGOTO(insn->target);
+    VM_DCASE(RETSUB) // frames are absolute, tier loops run with their own base
+        VM_DJUMP(ctx->call_depth ? ctx->calls[--ctx->call_depth] - base : insn->offset + size);
+    VM_DCASE(LOAD8)
+        VM_DHEAP(VM_BYTE);
+        VM_DR1 = vm_heapload(ctx->heap + at, VM_BYTE);
+        VM_DNEXT();
+    VM_DCASE(LOAD16)
+        VM_DHEAP(VM_WORD);
+        VM_DR1 = vm_heapload(ctx->heap + at, VM_WORD);
+        VM_DNEXT();
+    VM_DCASE(LOAD32)
+        VM_DHEAP(VM_DWORD);
+        VM_DR1 = vm_heapload(ctx->heap + at, VM_DWORD);
+        VM_DNEXT();
+    VM_DCASE(LOAD64)
+        VM_DHEAP(VM_QWORD);
+        VM_DR1 = vm_heapload(ctx->heap + at, VM_QWORD);
+        VM_DNEXT();
+    VM_DCASE(STORE8)
+        VM_DHEAP(VM_BYTE);
+        vm_heapstore(ctx->heap + at, VM_DR1, VM_BYTE);
+        VM_DNEXT();
+    VM_DCASE(STORE16)
+        VM_DHEAP(VM_WORD);
+        vm_heapstore(ctx->heap + at, VM_DR1, VM_WORD);
+        VM_DNEXT();
+    VM_DCASE(STORE32)
+        VM_DHEAP(VM_DWORD);
+        vm_heapstore(ctx->heap + at, VM_DR1, VM_DWORD);
+        VM_DNEXT();
+    VM_DCASE(STORE64)
+        VM_DHEAP(VM_QWORD);
+        vm_heapstore(ctx->heap + at, VM_DR1, VM_QWORD);
+        VM_DNEXT();
+    VM_DCASE(BLOCK)
+        VM_DFLAGS();
+        vm_block(ctx, insn->op, insn->r1, insn->r2, (int)(insn->imm2 & 15), &ctx->flags);
+        VM_DCHECKED();
+    VM_DCASE(VECTOR)
+        vm_vector(ctx, dec->code + insn->offset);
+        VM_DCHECKED();
+    VM_DCASE(GOTO)
+        VM_DGOTO(insn->target);
+    VM_DCASE(EXIT)
+        next = insn->imm;
+        goto leave;
+    VM_DCASE(SLOW)
+        VM_DFLAGS();
+        ctx->rip = base + insn->offset;
+        vm_eval(ctx, dec->code + insn->offset);
+        if (ctx->error) {
+            next = insn->offset;
+            goto leave;
+        }
+        if (insn->op == VM_MOV)
+            vm_decode_reset(dec); // may have stored into the code
+        VM_DJUMP(ctx->rip - base);
+
+    VM_DCASE(CMPJE_VAL)
+        VM_DCMPJ(VM_DR1, insn->imm, fa == fb);
+    VM_DCASE(CMPJNE_VAL)
+        VM_DCMPJ(VM_DR1, insn->imm, fa != fb);
+    VM_DCASE(CMPJLE_VAL)
+        VM_DCMPJ(VM_DR1, insn->imm, fa <= fb);
+    VM_DCASE(CMPJGE_VAL)
+        VM_DCMPJ(VM_DR1, insn->imm, fa >= fb);
+    VM_DCASE(CMPJE_REG)
+        VM_DCMPJ(VM_DR1, VM_DR2, fa == fb);
+    VM_DCASE(CMPJNE_REG)
+        VM_DCMPJ(VM_DR1, VM_DR2, fa != fb);
+    VM_DCASE(CMPJLE_REG)
+        VM_DCMPJ(VM_DR1, VM_DR2, fa <= fb);
+    VM_DCASE(CMPJGE_REG)
+        VM_DCMPJ(VM_DR1, VM_DR2, fa >= fb);
+    VM_DCASE(MOVI_ADD)
+        VM_DR1 = insn->imm;
+        regs[insn[1].r1] += insn->imm;
+        pc += 2;
+        VM_DDISPATCH();
+    VM_DCASE(MOVI_SUB)
+        VM_DR1 = insn->imm;
+        regs[insn[1].r1] -= insn->imm;
+        pc += 2;
+        VM_DDISPATCH();
+    VM_DCASE(MOVI_MUL)
+        VM_DR1 = insn->imm;
+        regs[insn[1].r1] *= insn->imm;
+        pc += 2;
+        VM_DDISPATCH();
+    VM_DCASE(MOVI_XOR)
+        VM_DR1 = insn->imm;
+        regs[insn[1].r1] ^= insn->imm;
+        pc += 2;
+        VM_DDISPATCH();
+    VM_DCASE(ADDI_JMP)
+        VM_DR1 += insn->imm;
+        VM_DGOTO(insn[1].target);
+    VM_DCASE(SUBI_JMP)
+        VM_DR1 -= insn->imm;
+        VM_DGOTO(insn[1].target);
+    VM_DCASE(PUSH2_CALL)
+        next = insn->offset; // a fault stops at the instruction that caused it
+        vm_push(ctx, insn->variant == VM_VAL2REG ? insn->imm : VM_DR1);
+        if (!ctx->error) {
+            next = insn[1].offset;
+            vm_push(ctx, insn[1].variant == VM_VAL2REG ? insn[1].imm : regs[insn[1].r1]);
+        }
+        if (!ctx->error) {
+            next = insn[2].offset;
+            vm_callnative(ctx, insn[2].imm, insn[2].r1);
+        }
+        if (ctx->error)
+            goto leave;
+        pc += 3;
+        VM_DDISPATCH();
+
+#if !VM_THREADED
+    }
+#endif
+leave:
+    VM_DFLAGS();
+    ctx->rip = base + next;
+    if (!ctx->error && next >= 0 && next < size) // out of memory while decoding
+        while (ctx->rip < base + size && !ctx->error)
+            vm_eval(ctx, (char*) ctx->rip);
+    if (--dec->refs == 0 && dec->orphan)
+        vm_destroydecoded(dec);
+    return (int) ctx->error;
+}
+
+// VMEM operands address the code itself, like vm_exec
+static int vm_execdecoded(struct vm_context *ctx, struct vm_decoded *dec) {
+    ctx->data_base = (qword)dec->code;
+    ctx->call_depth = 0;
+    return vm_rundecoded(ctx, dec);
+}
+
+// Per-thread decode cache keyed by code pointer and size. Entries are checked
+// against the current bytes of their decoded instructions, so code rebuilt in
+// place (like pow_virt's stack buffer) is decoded again instead of running
+// stale records, while data stored between instructions leaves them cached.
+static VM_THREAD_LOCAL struct vm_decoded *vm_decode_cache[VM_DECODE_CACHE];
+
+static struct vm_decoded *vm_getdecoded(char *code, qword size) {
+    struct vm_decoded **slot = &vm_decode_cache[
+        (((uintptr_t)code >> 4) ^ (uintptr_t)size) % VM_DECODE_CACHE];
+    if (*slot && (*slot)->code == code && (*slot)->code_size == size
+        && vm_decode_current(*slot))
+        return *slot;
+    if (*slot) {
+        if ((*slot)->refs)
+            (*slot)->orphan = 1; // freed when its last execution returns
+        else
+            vm_destroydecoded(*slot);
+    }
+    *slot = vm_predecode(code, size);
+#if VM_FUSE
+    vm_optimize(*slot);
+#endif
+    return *slot;
+}
+
+static void vm_flushdecoded(void) {
+    for (int i = 0; i < VM_DECODE_CACHE; i++) {
+        if (vm_decode_cache[i]) {
+            if (vm_decode_cache[i]->refs)
+                vm_decode_cache[i]->orphan = 1;
+            else
+                vm_destroydecoded(vm_decode_cache[i]);
+            vm_decode_cache[i] = 0;
+        }
+    }
+}
+
+#if VM_THREADED && !VM_DEBUG && !VM_PROFILE
+// Handler slot for an opcode+variant pair in the threaded dispatch table
+#define VM_SLOT(op, variant) ((op) * 16 + (variant))
+#define VM_ROW(op) [VM_SLOT(op, 0) ... VM_SLOT(op, 15)]
+// The threaded engines keep rip and flags in locals for the whole run and
+// store them to the context with VM_SYNC only on exit and around calls
+#define VM_R1 (&ctx->regs[GETFIRST(instr[2])])
+#define VM_R2 (&ctx->regs[GETSECOND(instr[2])])
+#define VM_IMM(at) (*(qword*)(instr + (at)))
+#define VM_SYNC() do { ctx->rip = rip; ctx->flags = flags; } while (0)
+#define VM_NEXT() do { \
+        if (rip >= end) \
+            goto leave; \
+        if (--fuel < 0) \
+            goto out_of_fuel; \
+        instr = (char*)rip; \
+        unsigned char op_ = (unsigned char)instr[1]; \
+        if (op_ >= VM_OPCOUNT) \
+            goto op_nop; \
+        goto *handlers[VM_SLOT(op_, GETSECOND(instr[0]))]; \
+    } while (0)
+#define VM_STEP() do { rip += GETFIRST(instr[0]); VM_NEXT(); } while (0)
+#define VM_STEP_CHECKED() do { \
+        if (ctx->error) \
+            goto leave; \
+        VM_STEP(); \
+    } while (0)
+#define VM_BRANCH(cond) do { \
+        rip += (cond) ? (qword)(dword)VM_IMM(2) : (qword)GETFIRST(instr[0]); \
+        VM_NEXT(); \
+    } while (0)
+// After a native call, which may have asked to suspend with vm_yield
+#define VM_CALLED() do { \
+        if (ctx->error) \
+            goto leave; \
+        if (vm_yielded) { \
+            rip += GETFIRST(instr[0]); \
+            status = VM_WAITING; \
+            goto leave; \
+        } \
+        VM_STEP(); \
+    } while (0)
+// rip or flags as the first / either operand, their context copies are stale:
+// hand the instruction to vm_eval
+#define VM_SYSREG1() do { \
+        if ((instr[2] & 0x0e) == 0x0c) \
+            goto op_slow; \
+    } while (0)
+#define VM_SYSREG2() do { \
+        if ((instr[2] & 0x0e) == 0x0c || (instr[2] & 0xe0) == 0xc0) \
+            goto op_slow; \
+    } while (0)
+// The index register of VM_LOAD / VM_STORE, the count of block opcodes
+#define VM_SYSREG3() do { \
+        if ((instr[3] & 0x0e) == 0x0c) \
+            goto op_slow; \
+    } while (0)
+// VM_LOAD / VM_STORE of 1 << width bytes
+#define VM_HEAPLOAD(width) do { \
+        qword at_ = VM_HEAPADDR(ctx->regs, instr); \
+        if (!VM_INHEAP(ctx, at_, 1 << (width))) \
+            goto heap_fault; \
+        *VM_R1 = vm_heapload(ctx->heap + at_, width); \
+    } while (0)
+#define VM_HEAPSTORE(width) do { \
+        qword at_ = VM_HEAPADDR(ctx->regs, instr); \
+        if (!VM_INHEAP(ctx, at_, 1 << (width))) \
+            goto heap_fault; \
+        vm_heapstore(ctx->heap + at_, *VM_R1, width); \
+    } while (0)
+#endif
+
+/*
+ Resumable execution
+
+ vm_resume runs from ctx->rip until the code ends, a fault, or `fuel`
+ instructions have run, and can be called again to continue exactly where it
+ stopped: rip, flags and the stack all live in the context between calls. A
+ native function can also end the slice early with vm_yield. vm_exec is
+ vm_resume with unlimited fuel, and vm_run is the public entry for
+ cooperative schedulers.
+*/
+
+enum vm_status {
+    VM_FINISHED,    // rip left the code
+    VM_OUT_OF_FUEL, // the budget ran out, call vm_run again to continue
+    VM_WAITING,     // a native call asked to suspend with vm_yield
+    VM_FAULTED      // see ctx->error
+};
+
+static VM_THREAD_LOCAL int vm_yielded;
+
+// Called by a native function: the VM stops right after the call returns and
+// vm_run reports VM_WAITING. Store the call's result in ctx->rax before
+// resuming. vm_exec ignores it and carries on.
+static void vm_yield(void) {
+    vm_yielded = 1;
+}
+
+// vm_resume's loop while a trace is attached. The producer's side of the
+// ring lives in locals for the slice and records are published
+// VM_TRACE_BATCH at a time: stores into the vm_trace on every instruction
+// cost more than writing the records.
+static int vm_traceresume(struct vm_context *ctx, struct vm_trace *trace, qword *fuel_left) {
+    qword end = ctx->code_base + ctx->code_size, fuel = *fuel_left;
+    struct vm_tracerecord * records = trace->records;
+    uint64_t head, limit, mask = trace->mask;
+    uint32_t countdown, period = trace->period, gap;
+    int status = VM_FINISHED;
+    vm_traceentry(ctx, trace);
+    head = trace->head;
+    limit = trace->tail_seen + mask + 1; // first slot the reader may still hold
+    countdown = trace->countdown;
+    gap = trace->gap;
+    while (ctx->rip < end && !ctx->error) {
+        char * instr = (char*) ctx->rip;
+        if (--fuel < 0) {
+            fuel = 0;
+            status = VM_OUT_OF_FUEL;
+            break;
+        }
+        if (--countdown) {
+            vm_eval(ctx, instr);
+        } else {
+            countdown = period;
+            if (head == limit) {
+                VM_STORE_RELEASE(&trace->head, head);
+                limit = vm_traceroom(trace, head) ? trace->tail_seen + mask + 1 : head;
+                gap = trace->gap;
+            }
+            if (head == limit) {
+                vm_eval(ctx, instr);
+            } else {
+                // Filled around vm_eval rather than copied in whole, which
+                // would stall on loading the partly written copy
+                struct vm_tracerecord * rec = &records[head & mask];
+                int reg = vm_tracereg(instr);
+                rec->offset = (int32_t)(ctx->rip - ctx->code_base);
+                rec->op = (uint8_t) instr[1];
+                rec->variant = (uint8_t)(GETSECOND(instr[0]) | (gap ? VM_TRACE_GAP : 0));
+                rec->reg = (uint8_t) reg;
+                vm_eval(ctx, instr);
+                rec->value = reg != VM_TRACE_NOREG ? ctx->regs[reg] : 0;
+                rec->flags = (uint8_t) ctx->flags;
+                gap = 0;
+                if (!(++head & (VM_TRACE_BATCH - 1)))
+                    VM_STORE_RELEASE(&trace->head, head);
+            }
+        }
+        if (vm_yielded && !ctx->error) {
+            status = VM_WAITING;
+            break;
+        }
+    }
+    VM_STORE_RELEASE(&trace->head, head);
+    trace->countdown = countdown;
+    trace->gap = gap;
+    vm_yielded = 0;
+    *fuel_left = fuel;
+    return ctx->error ? VM_FAULTED : status;
+}
+
+// Returns enum vm_status. Runs the byte engine: the threaded loop if enabled,
+// vm_eval otherwise.
+static int vm_resume(struct vm_context *ctx, qword *fuel_left) {
+    qword end = ctx->code_base + ctx->code_size, fuel = *fuel_left;
+    int status = VM_FINISHED;
+    if (ctx->error)
+        return VM_FAULTED;
+    vm_yielded = 0;
+    if (ctx->trace)
+        return vm_traceresume(ctx, ctx->trace, fuel_left);
+#if VM_THREADED && !VM_DEBUG && !VM_PROFILE
+    // One handler per opcode+variant, unknown pairs are ignored like in vm_eval
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Woverride-init"
+    static void * const handlers[VM_OPCOUNT * 16] = {
+        [0 ... VM_OPCOUNT * 16 - 1] = &&op_nop,
+        [VM_SLOT(VM_ADD, VM_VAL2REG)] = &&op_add_val,
+        [VM_SLOT(VM_ADD, VM_REG2REG)] = &&op_add_reg,
+        [VM_SLOT(VM_SUB, VM_VAL2REG)] = &&op_sub_val,
+        [VM_SLOT(VM_SUB, VM_REG2REG)] = &&op_sub_reg,
+        [VM_SLOT(VM_MUL, VM_VAL2REG)] = &&op_mul_val,
+        [VM_SLOT(VM_MUL, VM_REG2REG)] = &&op_mul_reg,
+        [VM_SLOT(VM_DIV, VM_VAL2REG)] = &&op_div_val,
+        [VM_SLOT(VM_DIV, VM_REG2REG)] = &&op_div_reg,
+        [VM_SLOT(VM_XOR, VM_VAL2REG)] = &&op_xor_val,
+        [VM_SLOT(VM_XOR, VM_REG2REG)] = &&op_xor_reg,
+        [VM_SLOT(VM_SHL, VM_VAL2REG)] = &&op_shl_val,
+        [VM_SLOT(VM_SHL, VM_REG2REG)] = &&op_shl_reg,
+        [VM_SLOT(VM_SHR, VM_VAL2REG)] = &&op_shr_val,
+        [VM_SLOT(VM_SHR, VM_REG2REG)] = &&op_shr_reg,
+        [VM_SLOT(VM_MOV, VM_VAL2REG)] = &&op_mov_val,
+        [VM_SLOT(VM_MOV, VM_REG2REG)] = &&op_mov_reg,
+        [VM_SLOT(VM_MOV, VM_MEM2REG)] = &&op_mov_mem2reg,
+        [VM_SLOT(VM_MOV, VM_REG2MEM)] = &&op_mov_reg2mem,
+        [VM_SLOT(VM_MOV, VM_VMEM2REG)] = &&op_mov_vmem2reg,
+        [VM_SLOT(VM_MOV, VM_REG2VMEM)] = &&op_mov_reg2vmem,
+        [VM_SLOT(VM_LEA, VM_VAL2REG)] = &&op_lea_val,
+        [VM_SLOT(VM_LEA, VM_REG2REG)] = &&op_lea_reg,
+        [VM_SLOT(VM_CMP, VM_VAL2REG)] = &&op_cmp_val,
+        [VM_SLOT(VM_CMP, VM_REG2REG)] = &&op_cmp_reg,
+        [VM_SLOT(VM_PUSH, VM_VAL2REG)] = &&op_push_val,
+        [VM_SLOT(VM_PUSH, VM_REG2REG)] = &&op_push_reg,
+        [VM_SLOT(VM_JMP, VM_VAL2REG)] = &&op_jmp_val,
+        [VM_SLOT(VM_JMP, VM_REG2REG)] = &&op_jmp_reg,
+        VM_ROW(VM_POP) = &&op_pop,
+        VM_ROW(VM_RET) = &&op_ret,
+        VM_ROW(VM_CALL) = &&op_call,
+        [VM_SLOT(VM_CALL, VM_IMPORT)] = &&op_call_import,
+        VM_ROW(VM_JZ) = &&op_jz,
+        VM_ROW(VM_JNZ) = &&op_jnz,
+        VM_ROW(VM_JE) = &&op_je,
+        VM_ROW(VM_JNE) = &&op_jne,
+        VM_ROW(VM_JLE) = &&op_jle,
+        VM_ROW(VM_JGE) = &&op_jge,
+        [VM_SLOT(VM_CALLSUB, VM_VAL2REG)] = &&op_callsub,
+        VM_ROW(VM_RETSUB) = &&op_retsub,
+        [VM_SLOT(VM_LOAD, VM_BYTE)] = &&op_load8,
+        [VM_SLOT(VM_LOAD, VM_WORD)] = &&op_load16,
+        [VM_SLOT(VM_LOAD, VM_DWORD)] = &&op_load32,
+        [VM_SLOT(VM_LOAD, VM_QWORD)] = &&op_load64,
+        [VM_SLOT(VM_STORE, VM_BYTE)] = &&op_store8,
+        [VM_SLOT(VM_STORE, VM_WORD)] = &&op_store16,
+        [VM_SLOT(VM_STORE, VM_DWORD)] = &&op_store32,
+        [VM_SLOT(VM_STORE, VM_QWORD)] = &&op_store64,
+        [VM_SLOT(VM_MEMCPY, 0)] = &&op_block,
+        [VM_SLOT(VM_MEMSET, 0)] = &&op_block,
+        [VM_SLOT(VM_MEMCMP, 0)] = &&op_block,
+        [VM_SLOT(VM_FINDBYTE, 0)] = &&op_block,
+        [VM_SLOT(VM_VADD, 0) ... VM_SLOT(VM_VEXTRACT, 15)] = &&op_vector, // checks its shape
+    };
+    #pragma GCC diagnostic pop
+    qword rip = ctx->rip, flags = ctx->flags;
+    char *instr;
+    VM_NEXT();
+
+op_nop:
+    VM_STEP();
+op_add_val:
+    VM_SYSREG1();
+    *VM_R1 += VM_IMM(3);
+    VM_STEP();
+op_add_reg:
+    VM_SYSREG2();
+    *VM_R1 += *VM_R2;
+    VM_STEP();
+op_sub_val:
+    VM_SYSREG1();
+    *VM_R1 -= VM_IMM(3);
+    VM_STEP();
+op_sub_reg:
+    VM_SYSREG2();
+    *VM_R1 -= *VM_R2;
+    VM_STEP();
+op_mul_val:
+    VM_SYSREG1();
+    *VM_R1 *= VM_IMM(3);
+    VM_STEP();
+op_mul_reg:
+    VM_SYSREG2();
+    *VM_R1 *= *VM_R2;
+    VM_STEP();
+op_div_val: {
+    VM_SYSREG1();
+    qword *reg = VM_R1, value = VM_IMM(3);
+    ctx->rdx = *reg % value;
+    *reg /= value;
+    VM_STEP();
+}
+op_div_reg: {
+    VM_SYSREG2();
+    qword *reg1 = VM_R1, *reg2 = VM_R2;
+    ctx->rdx = *reg1 % *reg2;
+    *reg1 /= *reg2;
+    VM_STEP();
+}
+op_xor_val:
+    VM_SYSREG1();
+    *VM_R1 ^= VM_IMM(3);
+    VM_STEP();
+op_xor_reg:
+    VM_SYSREG2();
+    *VM_R1 ^= *VM_R2;
+    VM_STEP();
+op_shl_val:
+    VM_SYSREG1();
+    *VM_R1 <<= VM_IMM(3);
+    VM_STEP();
+op_shl_reg:
+    VM_SYSREG2();
+    *VM_R1 <<= *VM_R2;
+    VM_STEP();
+op_shr_val:
+    VM_SYSREG1();
+    *VM_R1 >>= VM_IMM(3);
+    VM_STEP();
+op_shr_reg:
+    VM_SYSREG2();
+    *VM_R1 >>= *VM_R2;
+    VM_STEP();
+op_mov_val:
+    VM_SYSREG1();
+    *VM_R1 = VM_IMM(3);
+    VM_STEP();
+op_mov_reg:
+    VM_SYSREG2();
+    *VM_R1 = *VM_R2;
+    VM_STEP();
+op_mov_mem2reg:
+    VM_SYSREG1();
+    *VM_R1 = *(qword*)VM_IMM(3);
+    VM_STEP();
+op_mov_reg2mem:
+    VM_SYSREG1();
+    *(qword*)VM_IMM(3) = *VM_R1;
+    VM_STEP();
+op_mov_vmem2reg:
+    VM_SYSREG1();
+    *VM_R1 = *(qword*)((char*)ctx->data_base + VM_IMM(3));
+    VM_STEP();
+op_mov_reg2vmem:
+    VM_SYSREG1();
+    *(qword*)((char*)ctx->data_base + VM_IMM(3)) = *VM_R1;
+    VM_STEP();
+op_lea_val:
+    VM_SYSREG1();
+    *VM_R1 = rip + (dword)VM_IMM(3);
+    VM_STEP();
+op_lea_reg:
+    VM_SYSREG2();
+    *VM_R1 = rip + (dword)*VM_R2;
+    VM_STEP();
+op_cmp_val:
+    VM_SYSREG1();
+    flags = vm_cmpflags(*VM_R1, VM_IMM(3));
+    VM_STEP();
+op_cmp_reg:
+    VM_SYSREG2();
+    flags = vm_cmpflags(*VM_R1, *VM_R2);
+    VM_STEP();
+op_push_val:
+    vm_push(ctx, VM_IMM(2));
+    VM_STEP_CHECKED();
+op_push_reg:
+    VM_SYSREG1();
+    vm_push(ctx, *VM_R1);
+    VM_STEP_CHECKED();
+op_pop: {
+    VM_SYSREG1();
+    dword value = (dword) vm_pop(ctx);
+    if (!ctx->error)
+        memcpy(VM_R1, &value, sizeof(value)); // low dword only
+    VM_STEP_CHECKED();
+}
+op_call:
+    VM_SYNC();
+    vm_callnative(ctx, VM_IMM(3), GETFIRST(instr[2]));
+    VM_CALLED();
+op_call_import:
+    VM_SYNC();
+    vm_callimport(ctx, VM_IMM(3), GETFIRST(instr[2]));
+    VM_CALLED();
+op_ret: {
+    qword offset = ctx->rsp ? vm_pop(ctx) : 0;
+    rip += offset ? (qword)(dword)offset : ctx->code_size; // 0 kills us
+    VM_NEXT();
+}
+op_jmp_val:
+    VM_BRANCH(1);
+op_jmp_reg:
+    VM_SYSREG1();
+    rip += *VM_R1;
+    VM_NEXT();
+op_jz:
+    VM_BRANCH(flags == 0);
+op_jnz:
+    VM_BRANCH(flags != 0);
+op_je:
+    VM_BRANCH(flags & VM_FLAG_EQUALS);
+op_jne:
+    VM_BRANCH(!(flags & VM_FLAG_EQUALS));
+op_jle:
+    VM_BRANCH((flags & VM_FLAG_EQUALS) || (flags & VM_FLAG_LESSER));
+op_jge:
+    VM_BRANCH((flags & VM_FLAG_EQUALS) || (flags & VM_FLAG_GREATER));
+op_callsub:
+    if (!vm_callsub(ctx, rip + GETFIRST(instr[0])))
+        goto leave;
+    VM_BRANCH(1);
+op_retsub:
+    rip = ctx->call_depth ? ctx->calls[--ctx->call_depth] : rip + ctx->code_size;
+    VM_NEXT();
+op_load8:
+    VM_SYSREG2();
+    VM_SYSREG3();
+    VM_HEAPLOAD(VM_BYTE);
+    VM_STEP();
+op_load16:
+    VM_SYSREG2();
+    VM_SYSREG3();
+    VM_HEAPLOAD(VM_WORD);
+    VM_STEP();
+op_load32:
+    VM_SYSREG2();
+    VM_SYSREG3();
+    VM_HEAPLOAD(VM_DWORD);
+    VM_STEP();
+op_load64:
+    VM_SYSREG2();
+    VM_SYSREG3();
+    VM_HEAPLOAD(VM_QWORD);
+    VM_STEP();
+op_store8:
+    VM_SYSREG2();
+    VM_SYSREG3();
+    VM_HEAPSTORE(VM_BYTE);
+    VM_STEP();
+op_store16:
+    VM_SYSREG2();
+    VM_SYSREG3();
+    VM_HEAPSTORE(VM_WORD);
+    VM_STEP();
+op_store32:
+    VM_SYSREG2();
+    VM_SYSREG3();
+    VM_HEAPSTORE(VM_DWORD);
+    VM_STEP();
+op_store64:
+    VM_SYSREG2();
+    VM_SYSREG3();
+    VM_HEAPSTORE(VM_QWORD);
+    VM_STEP();
+op_block: {
+    VM_SYSREG2();
+    VM_SYSREG3();
+    qword block_flags = flags;
+    vm_block(ctx, instr[1], GETFIRST(instr[2]), GETSECOND(instr[2]), GETFIRST(instr[3]), &block_flags);
+    flags = block_flags;
+    VM_STEP_CHECKED();
+}
+op_vector:
+    if (vm_vectorsysreg(instr))
+        goto op_slow;
+    vm_vector(ctx, instr);
+    VM_STEP_CHECKED();
+heap_fault:
+    vm_fault(ctx, VM_BAD_ADDRESS);
+    goto leave;
+op_slow:
+    VM_SYNC();
+    vm_eval(ctx, instr);
+    rip = ctx->rip;
+    flags = ctx->flags;
+    if (ctx->error)
+        goto leave;
+    VM_NEXT();
+out_of_fuel:
+    fuel = 0;
+    status = VM_OUT_OF_FUEL;
+leave:
+    VM_SYNC();
+#else
+    while (ctx->rip < end && !ctx->error) {
+        if (--fuel < 0) {
+            fuel = 0;
+            status = VM_OUT_OF_FUEL;
+            break;
+        }
+#if VM_PROFILE
+        vm_profeval(ctx, (char*) ctx->rip);
+#else
+        vm_eval(ctx, (char*) ctx->rip);
+#endif
+        if (vm_yielded && !ctx->error) {
+            status = VM_WAITING;
+            break;
+        }
+    }
+#endif
+    vm_yielded = 0;
+    *fuel_left = fuel;
+    return ctx->error ? VM_FAULTED : status;
+}
+
+// Points a context at code for vm_run, VMEM operands address `data`
+static void vm_load(struct vm_context *ctx, const char *code, qword size, char *data) {
+    ctx->code_base = (qword)code; // bad idea but whatever
+    ctx->code_size = size;
+    ctx->data_base = (qword)data;
+    ctx->rip = (qword)code;
+    ctx->error = VM_OK;
+    ctx->call_depth = 0;
+}
+
+// Runs a loaded context for at most `budget` instructions, no limit if
+// budget <= 0, and returns enum vm_status. Call it again to continue after
+// VM_OUT_OF_FUEL or VM_WAITING. ctx->executed says how much was used.
+static int vm_run(struct vm_context *ctx, qword budget) {
+    qword fuel = budget > 0 ? budget : INT64_MAX, limit = fuel;
+    int status = vm_resume(ctx, &fuel);
+    ctx->executed = limit - fuel;
+    return status;
+}
+
+static int vm_iscompact(const char *code, qword size);
+static int vm_execcompact(struct vm_context *ctx, char *code, int size, char *data);
+
+// Runs code whose VMEM operands address a separate data segment, either
+// encoding. Returns enum vm_error, also left in ctx->error
+static int vm_execdata(struct vm_context *ctx, char *code, int size, char *data) {
+    qword fuel = INT64_MAX;
+    if (vm_iscompact(code, size))
+        return vm_execcompact(ctx, code, size, data);
+    vm_load(ctx, code, size, data);
+#if VM_PREDECODE && !VM_PROFILE
+    struct vm_decoded *dec = ctx->trace ? 0 : vm_getdecoded(code, size);
+    if (dec)
+        return vm_rundecoded(ctx, dec);
+#endif
+    while (vm_resume(ctx, &fuel) == VM_WAITING)
+        ;
+    return (int) ctx->error;
+}
+
+// Returns enum vm_error, also left in ctx->error. VMEM operands address the code.
+static int vm_exec(struct vm_context *ctx, char *code, int size) {
+    return vm_execdata(ctx, code, size, code);
+}
+
+/*
+ Compact encoding
+
+ The byte encoding spends a full qword on every immediate and jump offset,
+ so `add rdx, 1` takes 11 bytes. vm_compact converts code into a second,
+ denser version that vm_exec and vm_execdata recognize by its header:
+
+   0x00 0xff 'C' 2 | varint size of the byte encoding | records
+
+ 0x00 0xff would be a first instruction of length 0 that never advances, so
+ no working program starts with it. A record's tag byte keeps an opcode or
+ count in its low six bits, and its top two pick the form:
+
+   0x00 | count - 1   raw, the next count bytes as they are
+   0x40 | op          byte 0 is JOINBITS(usual length, VM_REG2REG)
+   0x80 | op          byte 0 is JOINBITS(usual length, VM_VAL2REG)
+   0xc0 | op          byte 0 follows
+
+ The operand bytes come next, except that the qword immediate or the heap
+ disp32 is a zigzag LEB128 varint. `add rdx, 1` takes 3 bytes and a jump of
+ up to 64 bytes either way takes 2. Bytes that don't parse as an instruction,
+ like data between instructions, go into raw records. vm_expand therefore
+ returns exactly the bytes vm_compact was given, and offsets, rip-relative
+ LEA, VMEM addressing and RET targets keep their meaning.
+
+ It is a storage format. vm_execdata expands compact code once into a
+ per-thread cache, checked against the compact bytes like the decode cache,
+ and runs the result with the usual engines. vm_load, the verifier and the
+ JIT take byte encoded code only, so call vm_expand for them.
+
+ Writes into embedded data don't persist, unlike with byte code. vm_exec
+ runs on the cached expansion, and every call starts again from the compact
+ bytes, undoing whatever the previous call stored into its code. A counter
+ kept after the instructions reads its initial value on each call, and the
+ caller never sees stores in the compact buffer. Keep state that must
+ survive a call in a separate data segment (vm_execdata, vm_program).
+*/
+
+#ifndef VM_COMPACT_CACHE
+#define VM_COMPACT_CACHE 16 // expanded programs kept per thread by vm_execdata
+#endif
+
+#define VM_COMPACT_VERSION 2
+#define VM_COMPACT_HEADER 4 // magic bytes before the size
+
+enum vm_compact_form {
+    VM_C_RAW = 0x00,
+    VM_C_REG2REG = 0x40,
+    VM_C_VAL2REG = 0x80,
+    VM_C_EXPLICIT = 0xc0
+};
+
+// Sizes are counted past `capacity` so a short buffer reports what it needs
+struct vm_cwriter {
+    char *out;
+    qword capacity, n;
+};
+
+static void vm_cput(struct vm_cwriter *w, int b) {
+    if (w->n < w->capacity)
+        w->out[w->n] = (char) b;
+    w->n++;
+}
+
+static void vm_cputs(struct vm_cwriter *w, const char *p, qword count) {
+    for (qword i = 0; i < count; i++)
+        vm_cput(w, p[i]);
+}
+
+static void vm_cvarint(struct vm_cwriter *w, uint64_t v) {
+    for (; v >= 0x80; v >>= 7)
+        vm_cput(w, (int) (v & 0x7f) | 0x80);
+    vm_cput(w, (int) v);
+}
+
+static int vm_cgetvarint(const unsigned char **p, const unsigned char *end, uint64_t *v) {
+    uint64_t x = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        int b = *(*p)++;
+        x |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = x;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Where an opcode + variant keeps its immediate (size 0 if it has none),
+// returns the length it is usually written with
+static int vm_compactshape(int op, int variant, int *at, int *size) {
+    *at = 3;
+    *size = 8;
+    switch (op) {
+    case VM_JMP: case VM_CALLSUB:
+        if (variant != VM_VAL2REG)
+            break;
+        // fallthrough
+    case VM_JZ: case VM_JNZ: case VM_JE: case VM_JNE:
+    case VM_JG: case VM_JL: case VM_JLE: case VM_JGE:
+        *at = 2;
+        return 10;
+    case VM_RETSUB:
+        *size = 0;
+        return 2;
+    case VM_PUSH:
+        if (variant != VM_VAL2REG)
+            break;
+        *at = 2;
+        return 10;
+    case VM_CALL:
+        return 11;
+    case VM_LOAD: case VM_STORE: case VM_VLOAD: case VM_VSTORE:
+        *at = 4;
+        *size = 4;
+        return 8;
+    case VM_MEMCPY: case VM_MEMSET: case VM_MEMCMP: case VM_FINDBYTE:
+        *size = 0;
+        return 4;
+    case VM_VADD: case VM_VSUB: case VM_VXOR: case VM_VAND: case VM_VOR:
+    case VM_VSHL: case VM_VSHR: case VM_VSHUF: case VM_VCMPEQ: case VM_VCMPGT:
+    case VM_VBCAST: case VM_VMOVMSK: case VM_VEXTRACT:
+        *size = 0;
+        return VM_VECTOR_SIZE(op);
+    default:
+        if (variant != VM_REG2REG)
+            return 11;
+        break;
+    }
+    *size = 0;
+    return 3;
+}
+
+static int vm_iscompact(const char *code, qword size) {
+    return size > VM_COMPACT_HEADER && code[0] == 0 && code[1] == (char) 0xff
+        && code[2] == 'C' && code[3] == VM_COMPACT_VERSION;
+}
+
+// Converts byte encoded code, writing at most `capacity` bytes to `out`.
+// Returns the compact size, call again with a larger buffer if it is bigger.
+static qword vm_compact(const char *code, qword size, char *out, qword capacity) {
+    struct vm_cwriter w = { out, capacity, 0 };
+    const unsigned char *p = (const unsigned char *) code;
+    qword at = 0, raw = 0, raw_count = 0;
+    static const char magic[VM_COMPACT_HEADER] = { 0, (char) 0xff, 'C', VM_COMPACT_VERSION };
+    vm_cputs(&w, magic, VM_COMPACT_HEADER);
+    vm_cvarint(&w, (uint64_t) size);
+    while (at < size || raw_count) {
+        int len = at < size ? GETFIRST(p[at]) : 0, op = at + 1 < size ? p[at + 1] : (int) VM_OPCOUNT;
+        int insn = op < VM_OPCOUNT && len >= 2 && len <= size - at;
+        if (raw_count && (insn || at == size || raw_count == 64)) {
+            vm_cput(&w, VM_C_RAW | (int) (raw_count - 1));
+            vm_cputs(&w, code + raw, raw_count);
+            raw_count = 0;
+        }
+        if (at == size)
+            break;
+        if (!insn) {
+            if (!raw_count++)
+                raw = at;
+            at++;
+            continue;
+        }
+        int variant = GETSECOND(p[at]), imm_at, imm_size;
+        int usual = vm_compactshape(op, variant, &imm_at, &imm_size);
+        if (len == usual && variant == VM_REG2REG)
+            vm_cput(&w, VM_C_REG2REG | op);
+        else if (len == usual && variant == VM_VAL2REG)
+            vm_cput(&w, VM_C_VAL2REG | op);
+        else {
+            vm_cput(&w, VM_C_EXPLICIT | op);
+            vm_cput(&w, p[at]);
+        }
+        if (imm_size && imm_at + imm_size <= len) {
+            qword value = 0;
+            dword disp;
+            if (imm_size == 8)
+                memcpy(&value, code + at + imm_at, 8);
+            else {
+                memcpy(&disp, code + at + imm_at, 4);
+                value = disp;
+            }
+            vm_cputs(&w, code + at + 2, imm_at - 2);
+            vm_cvarint(&w, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+            vm_cputs(&w, code + at + imm_at + imm_size, len - imm_at - imm_size);
+        } else
+            vm_cputs(&w, code + at + 2, len - 2);
+        at += len;
+    }
+    return w.n;
+}
+
+// Turns compact code back into the byte encoding, writing at most `capacity`
+// bytes to `out`. Returns the expanded size, or -1 if the code is malformed.
+static qword vm_expand(const char *compact, qword size, char *out, qword capacity) {
+    const unsigned char *p = (const unsigned char *) compact + VM_COMPACT_HEADER, *end = p - VM_COMPACT_HEADER + size;
+    uint64_t expected;
+    if (!vm_iscompact(compact, size) || !vm_cgetvarint(&p, end, &expected))
+        return -1;
+    struct vm_cwriter w = { out, (qword) expected <= capacity ? capacity : 0, 0 };
+    while (p < end && (uint64_t) w.n <= expected) {
+        int tag = *p++, op = tag & 0x3f, byte0, imm_at, imm_size;
+        if ((tag & 0xc0) == VM_C_RAW) {
+            if (end - p < op + 1)
+                return -1;
+            vm_cputs(&w, (const char *) p, op + 1);
+            p += op + 1;
+            continue;
+        }
+        if ((tag & 0xc0) == VM_C_EXPLICIT) {
+            if (p == end)
+                return -1;
+            byte0 = *p++;
+        } else {
+            int variant = (tag & 0xc0) == VM_C_REG2REG ? VM_REG2REG : VM_VAL2REG;
+            byte0 = JOINBITS(vm_compactshape(op, variant, &imm_at, &imm_size), variant);
+        }
+        int len = GETFIRST(byte0);
+        vm_compactshape(op, GETSECOND(byte0), &imm_at, &imm_size);
+        if (op >= VM_OPCOUNT || len < 2)
+            return -1;
+        vm_cput(&w, byte0);
+        vm_cput(&w, op);
+        if (imm_size && imm_at + imm_size <= len) {
+            uint64_t zigzag;
+            if (end - p < imm_at - 2)
+                return -1;
+            vm_cputs(&w, (const char *) p, imm_at - 2);
+            p += imm_at - 2;
+            if (!vm_cgetvarint(&p, end, &zigzag))
+                return -1;
+            uint64_t value = (zigzag >> 1) ^ (0 - (zigzag & 1));
+            for (int i = 0; i < imm_size; i++)
+                vm_cput(&w, (int) (value >> (8 * i)) & 0xff);
+            len -= imm_at + imm_size - 2;
+        }
+        if (end - p < len - 2)
+            return -1;
+        vm_cputs(&w, (const char *) p, len - 2);
+        p += len - 2;
+    }
+    return (uint64_t) w.n == expected && p == end ? w.n : -1;
+}
+
+// `code` is followed by a pristine copy of itself and of the compact bytes
+struct vm_expanded {
+    const char *compact;
+    qword compact_size, size;
+    int refs, orphan;
+    char *code;
+};
+
+static VM_THREAD_LOCAL struct vm_expanded *vm_compact_cache[VM_COMPACT_CACHE];
+
+// Drops an expansion, or leaves it to its last running vm_execcompact
+static void vm_dropexpanded(struct vm_expanded *e) {
+    if (e && e->refs)
+        e->orphan = 1;
+    else
+        VM_FREE(e);
+}
+
+static struct vm_expanded *vm_getexpanded(const char *compact, qword size, qword *error) {
+    struct vm_expanded **slot = &vm_compact_cache[
+        (((uintptr_t)compact >> 4) ^ (uintptr_t)size) % VM_COMPACT_CACHE];
+    struct vm_expanded *e = *slot;
+    if (e && e->compact == compact && e->compact_size == size
+        && !memcmp(e->code + 2 * e->size, compact, size))
+        return e;
+    qword expanded = vm_expand(compact, size, 0, 0);
+    if (expanded < 0 || expanded > INT32_MAX) {
+        *error = VM_BAD_ENCODING;
+        return 0;
+    }
+    if (!(e = (struct vm_expanded *) VM_MALLOC(sizeof(struct vm_expanded) + 2 * expanded + size))) {
+        *error = VM_OUT_OF_MEMORY;
+        return 0;
+    }
+    e->compact = compact;
+    e->compact_size = size;
+    e->size = expanded;
+    e->refs = e->orphan = 0;
+    e->code = (char *) (e + 1);
+    vm_expand(compact, size, e->code, expanded);
+    memcpy(e->code + expanded, e->code, expanded);
+    memcpy(e->code + 2 * expanded, compact, size);
+    vm_dropexpanded(*slot);
+    return *slot = e;
+}
+
+// VMEM operands of vm_exec address the expanded code as they would the
+// original. The compact bytes never change, so neither does what the next
+// call starts from: writes into the code are undone first.
+static int vm_execcompact(struct vm_context *ctx, char *code, int size, char *data) {
+    qword error = VM_OK;
+    struct vm_expanded *e = vm_getexpanded(code, size, &error);
+    if (!e) {
+        vm_load(ctx, code, 0, data);
+        vm_fault(ctx, error);
+        return (int) error;
+    }
+    if (data == code && !e->refs && memcmp(e->code, e->code + e->size, e->size))
+        memcpy(e->code, e->code + e->size, e->size);
+    e->refs++;
+    error = vm_execdata(ctx, e->code, (int) e->size, data == code ? e->code : data);
+    if (!--e->refs && e->orphan)
+        VM_FREE(e);
+    return (int) error;
+}
+
+static void vm_flushcompact(void) {
+    for (int i = 0; i < VM_COMPACT_CACHE; i++) {
+        vm_dropexpanded(vm_compact_cache[i]);
+        vm_compact_cache[i] = 0;
+    }
+}
+
+/*
+ Programs
+
+ A vm_program pairs read-only code with its own writable data segment for
+ VMEM operands, so the code can be static const, shared between threads and
+ stay in the decode cache, while arguments come in through vm_call instead of
+ being baked into immediates. The data segment belongs to the program object:
+ threads running the same code concurrently each need their own vm_program
+ unless it has no data.
+*/
+
+struct vm_program {
+    const char * code;
+    qword code_size;
+    char * data; // VMEM operands address this, may be NULL if no VMEM is used
+    qword data_size;
+    qword owned; // data allocated by vm_makeprogram
+    const struct vm_native * imports; // for VM_IMPORT calls, see vm_makenative
+    qword import_count;
+};
+
+// Wraps code without copying it. The data segment starts as a copy of `data`,
+// or zeroed if `data` is NULL.
+static struct vm_program * vm_makeprogram(const char * code, qword code_size, const char * data, qword data_size) {
+    struct vm_program * program = ALLOCSTRUCT(vm_program);
+    if (!program)
+        return 0;
+    memset(program, 0, sizeof(struct vm_program)); // no imports until the caller sets them
+    program->code = code;
+    program->code_size = code_size;
+    program->data = data_size ? (char*) VM_CALLOC(1, data_size) : 0;
+    program->data_size = program->data ? data_size : 0;
+    program->owned = 1;
+    if (data_size && !program->data) {
+        VM_FREE(program);
+        return 0;
+    }
+    if (data)
+        memcpy(program->data, data, data_size);
+    return program;
+}
+
+static void vm_destroyprogram(struct vm_program * program) {
+    if (program) {
+        if (program->owned)
+            VM_FREE(program->data);
+        VM_FREE(program);
+    }
+}
+
+// Arguments go to rax, rbx, rcx, rdx, r8 .. r15 in order, any beyond that are
+// pushed so that the 13th argument ends up on top of the stack
+static void vm_loadargs(struct vm_context * ctx, const qword * args, int nargs) {
+    for (int i = 0; i < nargs && i < 12; i++)
+        ((qword*)ctx)[i] = args[i];
+    for (int i = nargs - 1; i >= 12 && !ctx->error; i--)
+        vm_push(ctx, args[i]);
+}
+
+// Runs a program in a context with its registers already set up
+static int vm_execprogram(struct vm_context * ctx, const struct vm_program * program) {
+    ctx->imports = program->imports;
+    ctx->import_count = program->import_count;
+    return vm_execdata(ctx, (char*) program->code, (int) program->code_size, program->data);
+}
+
+// Points a context at a program for vm_run, registers are left alone
+static void vm_loadprogram(struct vm_context * ctx, const struct vm_program * program) {
+    ctx->imports = program->imports;
+    ctx->import_count = program->import_count;
+    vm_load(ctx, program->code, program->code_size, program->data);
+}
+
+// Calls a program with arguments in a pooled context and returns rax. Use
+// vm_loadargs and vm_execprogram to check for errors.
+static qword vm_call(const struct vm_program * program, const qword * args, int nargs) {
+    struct vm_context * ctx = vm_acquirectx();
+    qword result = 0;
+    if (ctx) {
+        vm_loadargs(ctx, args, nargs);
+        if (!ctx->error && vm_execprogram(ctx, program) == VM_OK)
+            result = ctx->rax;
+        vm_recyclectx(ctx);
+    }
+    return result;
+}
+
+/*
+ Verification
+
+ vm_verify checks code once so it can run without per-instruction checks. It
+ decodes everything reachable from offset 0 and the given entries through
+ fallthrough and static branches, so data embedded in the code is skipped, and
+ rejects:
+   - unknown opcodes and opcode+variant pairs vm_eval would ignore
+   - instructions shorter than their operands or running past the code
+   - rip or flags as register operands
+   - static branches that leave the code or land inside an instruction
+   - absolute memory operands and VMEM offsets outside the data segment
+   - import indexes past the import table
+   - division by a zero immediate and shifts by 64 or more
+   - heap index scales other than 0, 1, 2, 4 and 8, for VM_LOAD and VM_VLOAD alike
+
+ vm_execverified then dispatches straight from one instruction to the next:
+ no end of code test and no opcode range test. The code runs from a copy that
+ ends in a halt record, which is where falling off the end lands. Only RET and
+ JMP reg, whose targets are known at run time, are checked; leaving the code
+ ends execution as usual, landing on an offset the verifier didn't decode
+ faults with VM_BAD_TARGET. VM_RETSUB isn't: its frames only come from
+ VM_CALLSUB, whose fallthrough was decoded. Stack faults are still raised.
+*/
+
+// Returns -1 if the code passes, otherwise the offset of the first offending
+// instruction, with a description in *reason (may be NULL). `starts` (may be
+// NULL, size + 1 bytes) receives 1 at every verified instruction start.
+static qword vm_verify(const char * code, qword size, qword data_size, qword import_count,
+                       const uint32_t * entries, qword entry_count, char * starts, const char ** reason) {
+    // 0 unseen, 1 instruction start, 2 inside an instruction
+    char * seen = (char*) VM_CALLOC(size + 1, 1);
+    qword * work = (qword*) VM_MALLOC((size + entry_count + 1) * sizeof(qword));
+    qword pending = 0, bad = -1;
+    const char * why = 0;
+    if (!seen || !work) {
+        VM_FREE(seen);
+        VM_FREE(work);
+        if (reason)
+            *reason = "out of memory";
+        return 0;
+    }
+    if (size)
+        work[pending++] = 0;
+    for (qword i = 0; i < entry_count; i++) {
+        if (entries[i] >= size) {
+            why = "entry outside the code";
+            bad = entries[i];
+            pending = 0;
+            break;
+        }
+        work[pending++] = entries[i];
+    }
+    while (pending && !why) {
+        qword offset = work[--pending];
+        while (!why) {
+            const char * instr = code + offset;
+            if (offset == size || seen[offset] == 1)
+                break; // exit, or joins verified code
+            bad = offset;
+            if (seen[offset]) {
+                why = "branch into the middle of an instruction";
+                break;
+            }
+            if (offset + 2 > size) {
+                why = "instruction runs past the code";
+                break;
+            }
+            int op = (unsigned char) instr[1], variant = GETSECOND(instr[0]), len = GETFIRST(instr[0]);
+            int handler = op < VM_OPCOUNT ? vm_handlerof(op, variant) : (int) VM_H_NOP;
+            int regs = vm_handler_regs[handler], at = vm_handler_imm[handler];
+            int need = at ? at + 8 : regs ? 3 : 2;
+            qword imm = 0;
+            if (handler >= VM_H_LOAD8 && handler <= VM_H_BLOCK)
+                need = handler == VM_H_BLOCK ? 4 : 8;
+            if (handler == VM_H_VECTOR)
+                need = VM_VECTOR_SIZE(op);
+            if (handler == VM_H_NOP) {
+                why = "invalid opcode";
+                break;
+            }
+            if (len < need) {
+                why = "instruction shorter than its operands";
+                break;
+            }
+            if (offset + len > size) {
+                why = "instruction runs past the code";
+                break;
+            }
+            for (int i = 1; i < len; i++) {
+                if (seen[offset + i] == 1) {
+                    why = "instruction overlaps another one";
+                    break;
+                }
+            }
+            if (why)
+                break;
+            if (at)
+                memcpy(&imm, instr + at, sizeof(imm));
+            if (((regs & 1) && (GETFIRST(instr[2]) == 12 || GETFIRST(instr[2]) == 13))
+                || ((regs & 2) && (GETSECOND(instr[2]) == 12 || GETSECOND(instr[2]) == 13))) {
+                why = "rip or flags as an operand";
+                break;
+            }
+            switch (handler) {
+            case VM_H_MOV_MEM2REG: case VM_H_MOV_REG2MEM:
+                why = "absolute memory operand";
+                break;
+            case VM_H_MOV_VMEM2REG: case VM_H_MOV_REG2VMEM:
+                if (imm < 0 || data_size < 8 || imm > data_size - 8)
+                    why = "VMEM offset outside the data segment";
+                break;
+            case VM_H_CALL_IMPORT:
+                if ((uint64_t) imm >= (uint64_t) import_count)
+                    why = "bad import index";
+                break;
+            case VM_H_DIV_VAL:
+                if (!imm)
+                    why = "division by zero";
+                break;
+            case VM_H_LOAD8: case VM_H_LOAD16: case VM_H_LOAD32: case VM_H_LOAD64:
+            case VM_H_STORE8: case VM_H_STORE16: case VM_H_STORE32: case VM_H_STORE64: {
+                int scale = GETSECOND(instr[3]);
+                if (scale != 0 && scale != 1 && scale != 2 && scale != 4 && scale != 8)
+                    why = "bad index scale";
+                else if (scale && (GETFIRST(instr[3]) == 12 || GETFIRST(instr[3]) == 13))
+                    why = "rip or flags as an operand";
+                break;
+            }
+            case VM_H_BLOCK:
+                if (GETFIRST(instr[3]) == 12 || GETFIRST(instr[3]) == 13)
+                    why = "rip or flags as an operand";
+                break;
+            case VM_H_VECTOR: {
+                int scale = GETSECOND(instr[3]);
+                if ((op == VM_VLOAD || op == VM_VSTORE) && scale != 0 && scale != 1 && scale != 2
+                    && scale != 4 && scale != 8)
+                    why = "bad index scale";
+                else if (vm_vectorsysreg(instr))
+                    why = "rip or flags as an operand";
+                break;
+            }
+            case VM_H_SHL_VAL: case VM_H_SHR_VAL:
+                if ((uint64_t) imm > 63)
+                    why = "shift count out of range";
+                break;
+            case VM_H_JMP_VAL: case VM_H_JZ: case VM_H_JNZ:
+            case VM_H_JE: case VM_H_JNE: case VM_H_JLE: case VM_H_JGE: case VM_H_CALLSUB: {
+                qword target = offset + (qword)(dword) imm;
+                if (target < 0 || target > size)
+                    why = "branch outside the code";
+                else
+                    work[pending++] = target; // at most one per instruction start
+                break;
+            }
+            }
+            if (why)
+                break;
+            seen[offset] = 1;
+            memset(seen + offset + 1, 2, len - 1);
+            if (handler == VM_H_JMP_VAL || handler == VM_H_JMP_REG || handler == VM_H_RET
+                || handler == VM_H_RETSUB)
+                break;
+            offset += len;
+        }
+    }
+    if (!why && starts) {
+        for (qword i = 0; i < size; i++)
+            starts[i] = seen[i] == 1;
+        starts[size] = 1;
+    }
+    VM_FREE(seen);
+    VM_FREE(work);
+    if (reason)
+        *reason = why;
+    return why ? bad : -1;
+}
+
+struct vm_verified {
+    const struct vm_program * program;
+    char * code; // copy of the program's code followed by a halt record
+    char * starts; // 1 at verified instruction starts, code_size + 1 bytes
+    qword code_size;
+};
+
+#define VM_HALT_SIZE 11 // halt record after the code, padded for immediate reads
+
+static void vm_destroyverified(struct vm_verified * verified) {
+    if (verified) {
+        VM_FREE(verified->code);
+        VM_FREE(verified->starts);
+        VM_FREE(verified);
+    }
+}
+
+// Verifies a program against its data segment and imports. Returns NULL if it
+// fails, with the offset in *bad and a description in *reason (both may be
+// NULL). The program must outlive the result and keep its data size.
+static struct vm_verified * vm_verifyprogram(const struct vm_program * program, const uint32_t * entries,
+                                             qword entry_count, qword * bad, const char ** reason) {
+    struct vm_verified * verified = (struct vm_verified*) VM_CALLOC(1, sizeof(struct vm_verified));
+    qword size = program->code_size, at;
+    if (bad)
+        *bad = 0;
+    if (reason)
+        *reason = "out of memory";
+    if (!verified)
+        return 0;
+    verified->program = program;
+    verified->code_size = size;
+    verified->code = (char*) VM_CALLOC(size + VM_HALT_SIZE, 1);
+    verified->starts = (char*) VM_MALLOC(size + 1);
+    if (!verified->code || !verified->starts) {
+        vm_destroyverified(verified);
+        return 0;
+    }
+    at = vm_verify(program->code, size, program->data_size, program->import_count,
+                   entries, entry_count, verified->starts, reason);
+    if (at >= 0 || (reason && *reason)) {
+        if (bad)
+            *bad = at;
+        vm_destroyverified(verified);
+        return 0;
+    }
+    memcpy(verified->code, program->code, size);
+    verified->code[size] = JOINBITS(2, 0);
+    verified->code[size + 1] = VM_OPCOUNT;
+    return verified;
+}
+
+#if VM_THREADED && !VM_DEBUG && !VM_PROFILE
+#define VM_VNEXT() do { \
+        instr = (char*)rip; \
+        goto *handlers[VM_SLOT((unsigned char)instr[1], GETSECOND(instr[0]))]; \
+    } while (0)
+#define VM_VSTEP() do { rip += GETFIRST(instr[0]); VM_VNEXT(); } while (0)
+#define VM_VSTEP_CHECKED() do { \
+        if (ctx->error) \
+            goto leave; \
+        VM_VSTEP(); \
+    } while (0)
+#define VM_VBRANCH(cond) do { \
+        rip += (cond) ? (qword)(dword)VM_IMM(2) : (qword)GETFIRST(instr[0]); \
+        VM_VNEXT(); \
+    } while (0)
+// Targets only known at run time
+#define VM_VJUMP(delta) do { \
+        rip += (delta); \
+        if (rip < base || rip >= base + size) \
+            goto leave; \
+        if (!starts[rip - base]) { \
+            rip = (qword)instr; \
+            vm_fault(ctx, VM_BAD_TARGET); \
+            goto leave; \
+        } \
+        VM_VNEXT(); \
+    } while (0)
+#endif
+
+// Runs verified code. Returns enum vm_error, also left in ctx->error.
+static int vm_execverified(struct vm_context * ctx, const struct vm_verified * verified) {
+    const struct vm_program * program = verified->program;
+    const char * starts = verified->starts;
+    qword base = (qword) verified->code, size = verified->code_size;
+    ctx->code_base = base;
+    ctx->code_size = size;
+    ctx->data_base = (qword) program->data;
+    ctx->imports = program->imports;
+    ctx->import_count = program->import_count;
+    ctx->rip = base;
+    ctx->error = VM_OK;
+    ctx->call_depth = 0;
+#if VM_THREADED && !VM_DEBUG && !VM_PROFILE
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Woverride-init"
+    static void * const handlers[(VM_OPCOUNT + 1) * 16] = {
+        [0 ... (VM_OPCOUNT + 1) * 16 - 1] = &&op_halt, // never reached by verified code
+        [VM_SLOT(VM_ADD, VM_VAL2REG)] = &&op_add_val,
+        [VM_SLOT(VM_ADD, VM_REG2REG)] = &&op_add_reg,
+        [VM_SLOT(VM_SUB, VM_VAL2REG)] = &&op_sub_val,
+        [VM_SLOT(VM_SUB, VM_REG2REG)] = &&op_sub_reg,
+        [VM_SLOT(VM_MUL, VM_VAL2REG)] = &&op_mul_val,
+        [VM_SLOT(VM_MUL, VM_REG2REG)] = &&op_mul_reg,
+        [VM_SLOT(VM_DIV, VM_VAL2REG)] = &&op_div_val,
+        [VM_SLOT(VM_DIV, VM_REG2REG)] = &&op_div_reg,
+        [VM_SLOT(VM_XOR, VM_VAL2REG)] = &&op_xor_val,
+        [VM_SLOT(VM_XOR, VM_REG2REG)] = &&op_xor_reg,
+        [VM_SLOT(VM_SHL, VM_VAL2REG)] = &&op_shl_val,
+        [VM_SLOT(VM_SHL, VM_REG2REG)] = &&op_shl_reg,
+        [VM_SLOT(VM_SHR, VM_VAL2REG)] = &&op_shr_val,
+        [VM_SLOT(VM_SHR, VM_REG2REG)] = &&op_shr_reg,
+        [VM_SLOT(VM_MOV, VM_VAL2REG)] = &&op_mov_val,
+        [VM_SLOT(VM_MOV, VM_REG2REG)] = &&op_mov_reg,
+        [VM_SLOT(VM_MOV, VM_VMEM2REG)] = &&op_mov_vmem2reg,
+        [VM_SLOT(VM_MOV, VM_REG2VMEM)] = &&op_mov_reg2vmem,
+        [VM_SLOT(VM_LEA, VM_VAL2REG)] = &&op_lea_val,
+        [VM_SLOT(VM_LEA, VM_REG2REG)] = &&op_lea_reg,
+        [VM_SLOT(VM_CMP, VM_VAL2REG)] = &&op_cmp_val,
+        [VM_SLOT(VM_CMP, VM_REG2REG)] = &&op_cmp_reg,
+        [VM_SLOT(VM_PUSH, VM_VAL2REG)] = &&op_push_val,
+        [VM_SLOT(VM_PUSH, VM_REG2REG)] = &&op_push_reg,
+        [VM_SLOT(VM_JMP, VM_VAL2REG)] = &&op_jmp_val,
+        [VM_SLOT(VM_JMP, VM_REG2REG)] = &&op_jmp_reg,
+        VM_ROW(VM_POP) = &&op_pop,
+        VM_ROW(VM_RET) = &&op_ret,
+        VM_ROW(VM_CALL) = &&op_call,
+        [VM_SLOT(VM_CALL, VM_IMPORT)] = &&op_call_import,
+        VM_ROW(VM_JZ) = &&op_jz,
+        VM_ROW(VM_JNZ) = &&op_jnz,
+        VM_ROW(VM_JE) = &&op_je,
+        VM_ROW(VM_JNE) = &&op_jne,
+        VM_ROW(VM_JLE) = &&op_jle,
+        VM_ROW(VM_JGE) = &&op_jge,
+        [VM_SLOT(VM_CALLSUB, VM_VAL2REG)] = &&op_callsub,
+        VM_ROW(VM_RETSUB) = &&op_retsub,
+        [VM_SLOT(VM_LOAD, VM_BYTE)] = &&op_load8,
+        [VM_SLOT(VM_LOAD, VM_WORD)] = &&op_load16,
+        [VM_SLOT(VM_LOAD, VM_DWORD)] = &&op_load32,
+        [VM_SLOT(VM_LOAD, VM_QWORD)] = &&op_load64,
+        [VM_SLOT(VM_STORE, VM_BYTE)] = &&op_store8,
+        [VM_SLOT(VM_STORE, VM_WORD)] = &&op_store16,
+        [VM_SLOT(VM_STORE, VM_DWORD)] = &&op_store32,
+        [VM_SLOT(VM_STORE, VM_QWORD)] = &&op_store64,
+        [VM_SLOT(VM_MEMCPY, 0)] = &&op_block,
+        [VM_SLOT(VM_MEMSET, 0)] = &&op_block,
+        [VM_SLOT(VM_MEMCMP, 0)] = &&op_block,
+        [VM_SLOT(VM_FINDBYTE, 0)] = &&op_block,
+        [VM_SLOT(VM_VADD, 0) ... VM_SLOT(VM_VEXTRACT, 15)] = &&op_vector, // checks its shape
+    };
+    #pragma GCC diagnostic pop
+    qword rip = base, flags = ctx->flags;
+    char * instr;
+    if (!size)
+        return VM_OK;
+    VM_VNEXT();
+
+op_halt:
+    goto leave;
+op_add_val:
+    *VM_R1 += VM_IMM(3);
+    VM_VSTEP();
+op_add_reg:
+    *VM_R1 += *VM_R2;
+    VM_VSTEP();
+op_sub_val:
+    *VM_R1 -= VM_IMM(3);
+    VM_VSTEP();
+op_sub_reg:
+    *VM_R1 -= *VM_R2;
+    VM_VSTEP();
+op_mul_val:
+    *VM_R1 *= VM_IMM(3);
+    VM_VSTEP();
+op_mul_reg:
+    *VM_R1 *= *VM_R2;
+    VM_VSTEP();
+op_div_val: {
+    qword *reg = VM_R1, value = VM_IMM(3);
+    ctx->rdx = *reg % value;
+    *reg /= value;
+    VM_VSTEP();
+}
+op_div_reg: {
+    qword *reg1 = VM_R1, *reg2 = VM_R2;
+    ctx->rdx = *reg1 % *reg2;
+    *reg1 /= *reg2;
+    VM_VSTEP();
+}
+op_xor_val:
+    *VM_R1 ^= VM_IMM(3);
+    VM_VSTEP();
+op_xor_reg:
+    *VM_R1 ^= *VM_R2;
+    VM_VSTEP();
+op_shl_val:
+    *VM_R1 <<= VM_IMM(3);
+    VM_VSTEP();
+op_shl_reg:
+    *VM_R1 <<= *VM_R2;
+    VM_VSTEP();
+op_shr_val:
+    *VM_R1 >>= VM_IMM(3);
+    VM_VSTEP();
+op_shr_reg:
+    *VM_R1 >>= *VM_R2;
+    VM_VSTEP();
+op_mov_val:
+    *VM_R1 = VM_IMM(3);
+    VM_VSTEP();
+op_mov_reg:
+    *VM_R1 = *VM_R2;
+    VM_VSTEP();
+op_mov_vmem2reg:
+    *VM_R1 = *(qword*)((char*)ctx->data_base + VM_IMM(3));
+    VM_VSTEP();
+op_mov_reg2vmem:
+    *(qword*)((char*)ctx->data_base + VM_IMM(3)) = *VM_R1;
+    VM_VSTEP();
+op_lea_val:
+    *VM_R1 = rip + (dword)VM_IMM(3);
+    VM_VSTEP();
+op_lea_reg:
+    *VM_R1 = rip + (dword)*VM_R2;
+    VM_VSTEP();
+op_cmp_val:
+    flags = vm_cmpflags(*VM_R1, VM_IMM(3));
+    VM_VSTEP();
+op_cmp_reg:
+    flags = vm_cmpflags(*VM_R1, *VM_R2);
+    VM_VSTEP();
+op_push_val:
+    vm_push(ctx, VM_IMM(2));
+    VM_VSTEP_CHECKED();
+op_push_reg:
+    vm_push(ctx, *VM_R1);
+    VM_VSTEP_CHECKED();
+op_pop: {
+    dword value = (dword) vm_pop(ctx);
+    if (!ctx->error)
+        memcpy(VM_R1, &value, sizeof(value)); // low dword only
+    VM_VSTEP_CHECKED();
+}
+op_call:
+    VM_SYNC();
+    vm_callnative(ctx, VM_IMM(3), GETFIRST(instr[2]));
+    VM_VSTEP_CHECKED();
+op_call_import:
+    VM_SYNC();
+    vm_callimport(ctx, VM_IMM(3), GETFIRST(instr[2]));
+    VM_VSTEP_CHECKED();
+op_ret: {
+    qword offset = ctx->rsp ? vm_pop(ctx) : 0;
+    if (!offset) {
+        rip += size; // 0 kills us
+        goto leave;
+    }
+    VM_VJUMP((qword)(dword)offset);
+}
+op_jmp_val:
+    VM_VBRANCH(1);
+op_jmp_reg:
+    VM_VJUMP(*VM_R1);
+op_jz:
+    VM_VBRANCH(flags == 0);
+op_jnz:
+    VM_VBRANCH(flags != 0);
+op_je:
+    VM_VBRANCH(flags & VM_FLAG_EQUALS);
+op_jne:
+    VM_VBRANCH(!(flags & VM_FLAG_EQUALS));
+op_jle:
+    VM_VBRANCH((flags & VM_FLAG_EQUALS) || (flags & VM_FLAG_LESSER));
+op_jge:
+    VM_VBRANCH((flags & VM_FLAG_EQUALS) || (flags & VM_FLAG_GREATER));
+op_callsub:
+    if (!vm_callsub(ctx, rip + GETFIRST(instr[0])))
+        goto leave;
+    VM_VBRANCH(1);
+op_retsub: // only verified call sites push frames
+    if (!ctx->call_depth) {
+        rip += size;
+        goto leave;
+    }
+    rip = ctx->calls[--ctx->call_depth];
+    VM_VNEXT();
+op_load8:
+    VM_HEAPLOAD(VM_BYTE);
+    VM_VSTEP();
+op_load16:
+    VM_HEAPLOAD(VM_WORD);
+    VM_VSTEP();
+op_load32:
+    VM_HEAPLOAD(VM_DWORD);
+    VM_VSTEP();
+op_load64:
+    VM_HEAPLOAD(VM_QWORD);
+    VM_VSTEP();
+op_store8:
+    VM_HEAPSTORE(VM_BYTE);
+    VM_VSTEP();
+op_store16:
+    VM_HEAPSTORE(VM_WORD);
+    VM_VSTEP();
+op_store32:
+    VM_HEAPSTORE(VM_DWORD);
+    VM_VSTEP();
+op_store64:
+    VM_HEAPSTORE(VM_QWORD);
+    VM_VSTEP();
+op_block: {
+    qword block_flags = flags;
+    vm_block(ctx, instr[1], GETFIRST(instr[2]), GETSECOND(instr[2]), GETFIRST(instr[3]), &block_flags);
+    flags = block_flags;
+    VM_VSTEP_CHECKED();
+}
+op_vector:
+    vm_vector(ctx, instr);
+    VM_VSTEP_CHECKED();
+heap_fault:
+    vm_fault(ctx, VM_BAD_ADDRESS);
+    goto leave;
+leave:
+    VM_SYNC();
+    return (int) ctx->error;
+#else
+    while (ctx->rip >= base && ctx->rip < base + size && !ctx->error) {
+        if (!starts[ctx->rip - base])
+            vm_fault(ctx, VM_BAD_TARGET);
+        else
+#if VM_PROFILE
+            vm_profeval(ctx, (char*) ctx->rip);
+#else
+            vm_eval(ctx, (char*) ctx->rip);
+#endif
+    }
+    return (int) ctx->error;
+#endif
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,406 @@
+#include "cvm.h"
+#include <array>
+#include <utility>
+
+/*
+ Compile-time specialized execution (C++17)
+
+ Bytecode that is fixed at build time doesn't need decoding at run time.
+ vm_compiled<code> takes a constexpr char array and turns every instruction
+ into its own function, specialized on its offset: the opcode, variant,
+ registers and immediates are read from the array while compiling, so each
+ one is a few constant-offset loads and stores on ctx->regs. Straight-line
+ code and forward branches call the next instruction's function directly,
+ which the compiler inlines into one body per block. A backward branch
+ returns to a loop around its target's function, so a loop runs as a plain
+ C++ loop, and only branches to other loops go through a table indexed by
+ code offset. VM_CALLSUB chains into its subroutine like a jump and
+ VM_RETSUB goes back through the table.
+
+   static constexpr char code[] = { ... };
+   vm_compiled<code>::exec(ctx); // like vm_exec(ctx, code, sizeof(code))
+
+ Results, faults and the rip left in the context match vm_exec. Whatever
+ can't be resolved while compiling runs through vm_eval at run time:
+ instructions with rip or flags as a register operand or operands past the
+ end of the code, RET and JMP reg targets that aren't instruction starts.
+ Code that jumps below its start is finished by vm_resume, as in vm_exec.
+ Immediates are read little-endian, as vm_eval reads them on x86-64.
+
+ Every instruction becomes a template instantiation, so compile time and
+ code size grow with the program; VM_COMPILED_CHAIN bounds how many
+ instructions are chained into one function.
+*/
+
+#ifndef CVM_HPP
+#define CVM_HPP
+
+#ifndef VM_COMPILED_CHAIN
+#define VM_COMPILED_CHAIN 256 // chained code never crosses a multiple of this offset
+#endif
+
+// One instruction as vm_eval would see it, decoded at compile time
+struct vm_constinsn {
+    qword len;
+    int op, variant; // op is VM_OPCOUNT for bytes vm_eval ignores
+    int r1, r2, r3, r4; // nibbles of bytes 2 and 3
+    qword imm2, imm3; // qwords at +2 (jumps, PUSH val) and +3
+    dword disp; // heap displacement at +4
+    int slow; // run it through vm_eval
+    int branch; // 1: static branch to imm2, 2: rip only known at run time
+};
+
+template <const auto & Code>
+struct vm_compiled {
+    static constexpr qword size = sizeof(Code);
+    typedef qword (* entry)(struct vm_context * ctx, qword pc);
+
+    static constexpr int byte(qword at) {
+        return (unsigned char) Code[at];
+    }
+
+    static constexpr qword imm(qword at, int bytes) {
+        uint64_t value = 0;
+        for (int i = bytes - 1; i >= 0; i--)
+            value = value << 8 | (uint64_t) byte(at + i);
+        return (qword) value;
+    }
+
+    static constexpr int issysreg(int reg) {
+        return reg == 12 || reg == 13;
+    }
+
+    static constexpr struct vm_constinsn decode(qword pc) {
+        struct vm_constinsn in = {0, VM_OPCOUNT, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0};
+        if (pc < 0 || pc + 2 > size)
+            return in;
+        in.len = GETFIRST(byte(pc));
+        in.variant = GETSECOND(byte(pc));
+        in.op = byte(pc + 1) < VM_OPCOUNT ? byte(pc + 1) : VM_OPCOUNT;
+        qword need = 2; // bytes vm_eval reads
+        int regs = 0; // register operands: 1 r1, 2 r1 and r2, 3 heap, 4 block
+        int scalar = 0; // a vector opcode's scalar operands: 1 r1, 2 r2, 3 heap
+        switch (in.op) {
+        case VM_ADD: case VM_SUB: case VM_MUL: case VM_DIV: case VM_XOR:
+        case VM_SHL: case VM_SHR: case VM_CMP: case VM_LEA:
+            if (in.variant == VM_VAL2REG)
+                need = 11, regs = 1;
+            else if (in.variant == VM_REG2REG)
+                need = 3, regs = 2;
+            else
+                in.op = VM_OPCOUNT;
+            break;
+        case VM_MOV:
+            if (in.variant == VM_REG2REG)
+                need = 3, regs = 2;
+            else if (in.variant == VM_VAL2REG || (in.variant >= VM_REG2MEM && in.variant <= VM_REG2VMEM
+                                                   && in.variant != VM_MEM2MEM))
+                need = 11, regs = 1;
+            break;
+        case VM_CALL:
+            need = 11;
+            break;
+        case VM_RET:
+            in.branch = 2;
+            break;
+        case VM_PUSH:
+            if (in.variant == VM_VAL2REG)
+                need = 10;
+            else if (in.variant == VM_REG2REG)
+                need = 3, regs = 1;
+            break;
+        case VM_POP:
+            need = 3, regs = 1;
+            break;
+        case VM_JMP:
+            if (in.variant == VM_VAL2REG)
+                need = 10, in.branch = 1;
+            else if (in.variant == VM_REG2REG)
+                need = 3, regs = 1, in.branch = 2;
+            break;
+        case VM_JZ: case VM_JNZ: case VM_JE: case VM_JNE: case VM_JLE: case VM_JGE:
+            need = 10, in.branch = 1;
+            break;
+        case VM_CALLSUB:
+            if (in.variant == VM_VAL2REG)
+                need = 10, in.branch = 1;
+            else
+                in.op = VM_OPCOUNT;
+            break;
+        case VM_RETSUB:
+            in.branch = 2;
+            break;
+        case VM_LOAD: case VM_STORE:
+            if (in.variant > VM_QWORD)
+                in.op = VM_OPCOUNT;
+            else
+                need = 8, regs = 3;
+            break;
+        case VM_MEMCPY: case VM_MEMSET: case VM_MEMCMP: case VM_FINDBYTE:
+            if (in.variant)
+                in.op = VM_OPCOUNT;
+            else
+                need = 4, regs = 4;
+            break;
+        case VM_VADD: case VM_VSUB: case VM_VXOR: case VM_VAND: case VM_VOR:
+        case VM_VSHL: case VM_VSHR: case VM_VSHUF: case VM_VCMPEQ: case VM_VCMPGT:
+        case VM_VLOAD: case VM_VSTORE: case VM_VBCAST: case VM_VMOVMSK: case VM_VEXTRACT:
+            if (in.variant > ((int) VM_V256 | VM_QWORD) || (in.op == VM_VSHUF && (in.variant & 3) != VM_BYTE))
+                in.op = VM_OPCOUNT;
+            else
+                need = VM_VECTOR_SIZE(in.op);
+            scalar = in.op == VM_VLOAD || in.op == VM_VSTORE ? 3
+                : in.op == VM_VMOVMSK || in.op == VM_VEXTRACT ? 1 : in.op == VM_VBCAST ? 2 : 0;
+            break;
+        default:
+            in.op = VM_OPCOUNT;
+        }
+        if (!in.len || pc + need > size)
+            return in;
+        if (need > 2) {
+            in.r1 = GETFIRST(byte(pc + 2));
+            in.r2 = GETSECOND(byte(pc + 2));
+        }
+        if (need > 3) {
+            in.r3 = GETFIRST(byte(pc + 3));
+            in.r4 = GETSECOND(byte(pc + 3));
+        }
+        if (need >= 10)
+            in.imm2 = imm(pc + 2, 8);
+        if (need >= 11)
+            in.imm3 = imm(pc + 3, 8);
+        if (need == 8)
+            in.disp = (dword) imm(pc + 4, 4);
+        if ((regs && issysreg(in.r1)) || (regs >= 2 && issysreg(in.r2)) || (regs >= 3 && issysreg(in.r3))
+            || (scalar == 1 && issysreg(in.r1)) || (scalar >= 2 && issysreg(in.r2))
+            || (scalar == 3 && in.r4 && issysreg(in.r3)))
+            return in;
+        in.slow = 0;
+        return in;
+    }
+
+    // Where a static branch at pc goes when taken
+    static constexpr qword target(qword pc) {
+        return pc + (qword)(dword) decode(pc).imm2;
+    }
+
+    // Offsets that get a table entry: everything reachable from 0 through
+    // fallthrough and static branches, and the starts of chains
+    static constexpr std::array<char, size> marks() {
+        std::array<char, size> seen{}, mark{};
+        std::array<qword, size> work{};
+        qword count = 0;
+        work[count++] = 0;
+        seen[0] = 1;
+        while (count) {
+            qword pc = work[--count];
+            struct vm_constinsn in = decode(pc);
+            qword next[2] = {pc + in.len, in.branch == 1 ? target(pc) : -1};
+            mark[pc] = 1;
+            for (qword to : next) {
+                if (to >= 0 && to < size && !seen[to] && in.len) {
+                    seen[to] = 1;
+                    work[count++] = to;
+                }
+            }
+        }
+        return mark;
+    }
+
+    static constexpr std::array<char, size> marked = marks();
+
+    // vm_eval for one instruction, at an offset that has no function
+    static qword interpret(struct vm_context * ctx, qword pc) {
+        ctx->rip = (qword) Code + pc;
+        vm_eval(ctx, (char*) Code + pc);
+        return ctx->rip - (qword) Code;
+    }
+
+    // Runs on into the instruction at `to` while that stays in the chain,
+    // else returns it to the loop or table
+    template <qword Pc, qword To>
+    static qword follow(struct vm_context * ctx) {
+        if constexpr (To > Pc && To < size && Pc / VM_COMPILED_CHAIN == To / VM_COMPILED_CHAIN)
+            return step<To>(ctx);
+        else
+            return To;
+    }
+
+    template <qword Pc>
+    static qword step(struct vm_context * ctx) {
+        constexpr struct vm_constinsn in = decode(Pc);
+        constexpr qword next = Pc + in.len;
+        qword * regs = ctx->regs;
+        if constexpr (in.slow) {
+            return interpret(ctx, Pc);
+        } else if constexpr (in.op == VM_ADD || in.op == VM_SUB || in.op == VM_MUL || in.op == VM_XOR
+                             || in.op == VM_SHL || in.op == VM_SHR) {
+            // Wrapping arithmetic and shift counts mod 64, as the interpreters
+            // get from x86-64: the compiler sees constants here and would
+            // otherwise fold overflow and long shifts its own way
+            uint64_t a = (uint64_t) regs[in.r1], b = (uint64_t)(in.variant == VM_VAL2REG ? in.imm3 : regs[in.r2]);
+            if constexpr (in.op == VM_ADD)
+                regs[in.r1] = (qword)(a + b);
+            else if constexpr (in.op == VM_SUB)
+                regs[in.r1] = (qword)(a - b);
+            else if constexpr (in.op == VM_MUL)
+                regs[in.r1] = (qword)(a * b);
+            else if constexpr (in.op == VM_XOR)
+                regs[in.r1] = (qword)(a ^ b);
+            else if constexpr (in.op == VM_SHL)
+                regs[in.r1] = (qword)(a << (b & 63));
+            else
+                regs[in.r1] = regs[in.r1] >> (b & 63);
+        } else if constexpr (in.op == VM_DIV) {
+            qword value = in.variant == VM_VAL2REG ? in.imm3 : regs[in.r2];
+            regs[3] = regs[in.r1] % value;
+            regs[in.r1] /= value;
+        } else if constexpr (in.op == VM_CMP) {
+            ctx->flags = vm_cmpflags(regs[in.r1], in.variant == VM_VAL2REG ? in.imm3 : regs[in.r2]);
+        } else if constexpr (in.op == VM_MOV) {
+            if constexpr (in.variant == VM_VAL2REG)
+                regs[in.r1] = in.imm3;
+            else if constexpr (in.variant == VM_REG2REG)
+                regs[in.r1] = regs[in.r2];
+            else if constexpr (in.variant == VM_MEM2REG)
+                regs[in.r1] = *(qword*) in.imm3;
+            else if constexpr (in.variant == VM_REG2MEM)
+                *(qword*) in.imm3 = regs[in.r1];
+            else if constexpr (in.variant == VM_VMEM2REG)
+                regs[in.r1] = *(qword*)(ctx->data_base + in.imm3);
+            else if constexpr (in.variant == VM_REG2VMEM)
+                *(qword*)(ctx->data_base + in.imm3) = regs[in.r1];
+        } else if constexpr (in.op == VM_LEA) {
+            if constexpr (in.variant == VM_VAL2REG)
+                regs[in.r1] = (qword) Code + Pc + (dword) in.imm3;
+            else if constexpr (in.variant == VM_REG2REG)
+                regs[in.r1] = (qword) Code + Pc + (dword) regs[in.r2];
+        } else if constexpr (in.op == VM_CALL) {
+            ctx->rip = (qword) Code + Pc;
+            if constexpr (in.variant == VM_IMPORT)
+                vm_callimport(ctx, in.imm3, in.r1);
+            else
+                vm_callnative(ctx, in.imm3, in.r1);
+            if (ctx->error)
+                return Pc;
+        } else if constexpr (in.op == VM_PUSH) {
+            if constexpr (in.variant == VM_VAL2REG || in.variant == VM_REG2REG) {
+                vm_push(ctx, in.variant == VM_VAL2REG ? in.imm2 : regs[in.r1]);
+                if (ctx->error)
+                    return Pc;
+            }
+        } else if constexpr (in.op == VM_POP) {
+            qword value = vm_pop(ctx);
+            if (ctx->error)
+                return Pc;
+            // vm_eval stores the low dword only; a dword store into the
+            // qword would break aliasing rules once steps are inlined
+            regs[in.r1] = (qword)(((uint64_t) regs[in.r1] & 0xffffffff00000000ull) | (uint32_t) value);
+        } else if constexpr (in.op == VM_RET) {
+            qword offset = ctx->rsp ? vm_pop(ctx) : 0;
+            return Pc + (offset ? (qword)(dword) offset : size);
+        } else if constexpr (in.op == VM_JMP && in.variant == VM_REG2REG) {
+            return Pc + regs[in.r1];
+        } else if constexpr (in.op == VM_CALLSUB) {
+            if (!vm_callsub(ctx, (qword) Code + next))
+                return Pc;
+            return follow<Pc, target(Pc)>(ctx);
+        } else if constexpr (in.op == VM_RETSUB) {
+            return ctx->call_depth ? ctx->calls[--ctx->call_depth] - (qword) Code : Pc + size;
+        } else if constexpr (in.branch == 1) {
+            qword flags = ctx->flags;
+            bool taken = in.op == VM_JMP
+                || (in.op == VM_JZ && flags == 0)
+                || (in.op == VM_JNZ && flags != 0)
+                || (in.op == VM_JE && (flags & VM_FLAG_EQUALS))
+                || (in.op == VM_JNE && !(flags & VM_FLAG_EQUALS))
+                || (in.op == VM_JLE && (flags & (VM_FLAG_EQUALS | VM_FLAG_LESSER)))
+                || (in.op == VM_JGE && (flags & (VM_FLAG_EQUALS | VM_FLAG_GREATER)));
+            if (taken)
+                return follow<Pc, target(Pc)>(ctx);
+        } else if constexpr (in.op == VM_LOAD || in.op == VM_STORE) {
+            qword at = (qword)((uint64_t) regs[in.r2] + (uint64_t) regs[in.r3] * in.r4 + (uint64_t) in.disp);
+            if (!VM_INHEAP(ctx, at, 1 << in.variant)) {
+                vm_fault(ctx, VM_BAD_ADDRESS);
+                return Pc;
+            }
+            if constexpr (in.op == VM_LOAD)
+                regs[in.r1] = vm_heapload(ctx->heap + at, in.variant);
+            else
+                vm_heapstore(ctx->heap + at, regs[in.r1], in.variant);
+        } else if constexpr (in.op == VM_MEMCPY || in.op == VM_MEMSET || in.op == VM_MEMCMP
+                             || in.op == VM_FINDBYTE) {
+            if (!vm_block(ctx, in.op, in.r1, in.r2, in.r3, &ctx->flags))
+                return Pc;
+        } else if constexpr (in.op >= VM_VADD && in.op <= VM_VEXTRACT) {
+            vm_vector(ctx, (const char*) Code + Pc);
+            if (ctx->error)
+                return Pc;
+        }
+        if constexpr (!in.slow && in.branch != 2)
+            return follow<Pc, next>(ctx);
+    }
+
+    // Table entry for an offset: loops back into its own code in place
+    template <qword Pc>
+    static qword enter(struct vm_context * ctx, qword) {
+        qword pc;
+        do
+            pc = step<Pc>(ctx);
+        while (pc == Pc && !ctx->error);
+        return pc;
+    }
+
+    template <qword Pc>
+    static constexpr entry entryof() {
+        if constexpr (marked[Pc])
+            return &enter<Pc>;
+        else
+            return &interpret;
+    }
+
+    template <std::size_t... Pc>
+    static constexpr std::array<entry, size> entries(std::index_sequence<Pc...>) {
+        return {{entryof<(qword) Pc>()...}};
+    }
+
+    static constexpr std::array<entry, size> table = entries(std::make_index_sequence<size>());
+
+    // Runs the code from its start, VMEM operands address `data`. Returns
+    // enum vm_error, also left in ctx->error.
+    static int execdata(struct vm_context * ctx, char * data) {
+        qword pc = 0;
+        vm_load(ctx, Code, size, data);
+        while ((uint64_t) pc < (uint64_t) size && !ctx->error)
+            pc = table[pc](ctx, pc);
+        ctx->rip = (qword) Code + pc;
+        if (!ctx->error && ctx->rip < ctx->code_base + ctx->code_size) { // below the code
+            qword fuel = INT64_MAX;
+            while (vm_resume(ctx, &fuel) == VM_WAITING)
+                ;
+        }
+        vm_yielded = 0;
+        return (int) ctx->error;
+    }
+
+    // VMEM operands address the code, as with vm_exec
+    static int exec(struct vm_context * ctx) {
+        return execdata(ctx, (char*) Code);
+    }
+
+    // vm_call for the code: arguments in rax, rbx, ..., returns rax. VMEM
+    // operands address `data`, by default the code like exec
+    static qword call(const qword * args, int nargs, char * data = (char*) Code) {
+        struct vm_context * ctx = vm_acquirectx();
+        qword result = 0;
+        if (ctx) {
+            vm_loadargs(ctx, args, nargs);
+            if (!ctx->error && execdata(ctx, data) == VM_OK)
+                result = ctx->rax;
+            vm_recyclectx(ctx);
+        }
+        return result;
+    }
+};
+
+#endif
@@ -0,0 +1,272 @@
+#include "cvm.h"
+
+/*
+ Batched execution of one program over many independent register files
+
+ vm_batch_exec runs `lanes` copies of a program in lockstep over a
+ structure-of-arrays register file (rax[lanes], rbx[lanes], ...), so every
+ dispatch applies an instruction to all lanes at once with AVX2 or SSE2
+ kernels where the host supports them. Lanes stay together while they branch
+ the same way. When they diverge, or reach an instruction with side effects
+ (stack, calls, stores to memory, register jumps), each lane finishes on its
+ own in vm_eval from where it stopped. The result equals running vm_exec
+ once per lane.
+*/
+
+#ifndef CVM_BATCH_H
+#define CVM_BATCH_H
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VM_BATCH_WIDTH 4
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VM_BATCH_WIDTH 2
+#else
+#define VM_BATCH_WIDTH 1
+#endif
+
+#if defined(__AVX2__)
+#define VM_BATCH_KERNEL(name, vop, sop) \
+    static void name(qword *d, const qword *s, qword imm, qword n) { \
+        qword i = 0; \
+        __m256i k = _mm256_set1_epi64x(imm); \
+        for (; i + 4 <= n; i += 4) \
+            _mm256_storeu_si256((__m256i*)(d + i), vop(_mm256_loadu_si256((__m256i*)(d + i)), \
+                s ? _mm256_loadu_si256((const __m256i*)(s + i)) : k)); \
+        for (; i < n; i++) \
+            d[i] = d[i] sop (s ? s[i] : imm); \
+    }
+#elif defined(__SSE2__)
+#define VM_BATCH_KERNEL(name, vop, sop) \
+    static void name(qword *d, const qword *s, qword imm, qword n) { \
+        qword i = 0; \
+        __m128i k = _mm_set1_epi64x(imm); \
+        for (; i + 2 <= n; i += 2) \
+            _mm_storeu_si128((__m128i*)(d + i), vop(_mm_loadu_si128((__m128i*)(d + i)), \
+                s ? _mm_loadu_si128((const __m128i*)(s + i)) : k)); \
+        for (; i < n; i++) \
+            d[i] = d[i] sop (s ? s[i] : imm); \
+    }
+#else
+#define VM_BATCH_KERNEL(name, vop, sop) \
+    static void name(qword *d, const qword *s, qword imm, qword n) { \
+        for (qword i = 0; i < n; i++) \
+            d[i] = d[i] sop (s ? s[i] : imm); \
+    }
+#endif
+
+// d[i] op= s[i], or op= imm when s is NULL
+#if defined(__AVX2__)
+VM_BATCH_KERNEL(vm_batch_add, _mm256_add_epi64, +)
+VM_BATCH_KERNEL(vm_batch_sub, _mm256_sub_epi64, -)
+VM_BATCH_KERNEL(vm_batch_xor, _mm256_xor_si256, ^)
+#else
+VM_BATCH_KERNEL(vm_batch_add, _mm_add_epi64, +)
+VM_BATCH_KERNEL(vm_batch_sub, _mm_sub_epi64, -)
+VM_BATCH_KERNEL(vm_batch_xor, _mm_xor_si128, ^)
+#endif
+
+static void vm_batch_mov(qword *d, const qword *s, qword imm, qword n) {
+    if (s)
+        memmove(d, s, n * sizeof(qword));
+    else
+        for (qword i = 0; i < n; i++)
+            d[i] = imm;
+}
+
+// No 64-bit multiply or arithmetic shift below AVX-512, the compiler
+// vectorizes what it can
+static void vm_batch_mul(qword *d, const qword *s, qword imm, qword n) {
+    for (qword i = 0; i < n; i++)
+        d[i] *= s ? s[i] : imm;
+}
+
+static void vm_batch_shr(qword *d, const qword *s, qword imm, qword n) {
+    for (qword i = 0; i < n; i++)
+        d[i] >>= (s ? s[i] : imm) & 63;
+}
+
+static void vm_batch_shl(qword *d, const qword *s, qword imm, qword n) {
+    qword i = 0;
+#if defined(__AVX2__)
+    __m256i mask = _mm256_set1_epi64x(63), k = _mm256_set1_epi64x(imm & 63);
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_si256((__m256i*)(d + i), _mm256_sllv_epi64(_mm256_loadu_si256((__m256i*)(d + i)),
+            s ? _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(s + i)), mask) : k));
+#endif
+    for (; i < n; i++)
+        d[i] = (qword)((uint64_t) d[i] << ((s ? s[i] : imm) & 63));
+}
+
+// flags[i] = vm_cmpflags(a[i], b[i] or imm)
+static void vm_batch_cmp(qword *flags, const qword *a, const qword *b, qword imm, qword n) {
+    qword i = 0;
+#if defined(__AVX2__)
+    __m256i k = _mm256_set1_epi64x(imm), eq = _mm256_set1_epi64x(VM_FLAG_EQUALS),
+            gt = _mm256_set1_epi64x(VM_FLAG_GREATER), lt = _mm256_set1_epi64x(VM_FLAG_LESSER);
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i)),
+                y = b ? _mm256_loadu_si256((const __m256i*)(b + i)) : k;
+        __m256i f = _mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi64(x, y), eq),
+                    _mm256_or_si256(_mm256_and_si256(_mm256_cmpgt_epi64(x, y), gt),
+                                    _mm256_and_si256(_mm256_cmpgt_epi64(y, x), lt)));
+        _mm256_storeu_si256((__m256i*)(flags + i), f);
+    }
+#endif
+    for (; i < n; i++)
+        flags[i] = vm_cmpflags(a[i], b ? b[i] : imm);
+}
+
+static int vm_batch_taken(int handler, qword flags) {
+    switch (handler) {
+    case VM_H_JZ: return flags == 0;
+    case VM_H_JNZ: return flags != 0;
+    case VM_H_JE: return (flags & VM_FLAG_EQUALS) != 0;
+    case VM_H_JNE: return !(flags & VM_FLAG_EQUALS);
+    case VM_H_JLE: return (flags & (VM_FLAG_EQUALS | VM_FLAG_LESSER)) != 0;
+    case VM_H_JGE: return (flags & (VM_FLAG_EQUALS | VM_FLAG_GREATER)) != 0;
+    }
+    return 0;
+}
+
+// Runs one lane alone in vm_eval from a code offset, returns its error
+static qword vm_batch_scalar(struct vm_decoded *dec, qword *soa, qword stride, qword lane,
+                             qword offset, qword *out) {
+    struct vm_context ctx;
+    vm_initctx(&ctx, 0, 0);
+    for (int r = 0; r < 16; r++)
+        ((qword*)&ctx)[r] = soa[r * stride + lane];
+    ctx.code_base = (qword) dec->code;
+    ctx.data_base = ctx.code_base;
+    ctx.code_size = dec->code_size;
+    ctx.rip = ctx.code_base + offset;
+    while (ctx.rip >= ctx.code_base && ctx.rip < ctx.code_base + ctx.code_size && !ctx.error)
+        vm_eval(&ctx, (char*) ctx.rip);
+    memcpy(out, &ctx, 16 * sizeof(qword));
+    vm_finictx(&ctx);
+    return ctx.error;
+}
+
+// regs holds one register file (rax .. rbp, like vm_context) per lane and
+// receives the final registers. Returns how many lanes stopped on an error.
+static int vm_batch_exec(char *code, int size, qword (*regs)[16], int lanes) {
+    qword stride = (lanes + VM_BATCH_WIDTH - 1) / VM_BATCH_WIDTH * VM_BATCH_WIDTH, offset = 0;
+    qword *soa, base = (qword) code, *taken;
+    struct vm_decoded *dec;
+    int faults = 0, together = 1;
+    if (lanes <= 0)
+        return 0;
+    dec = VM_PROFILE ? 0 : vm_predecode(code, size);
+    soa = (qword*) VM_MALLOC((16 * stride + lanes) * sizeof(qword));
+    if (!dec || !soa) {
+        VM_FREE(soa);
+        vm_destroydecoded(dec);
+        // profiling, or no memory for the batch: run the lanes one by one
+        for (int lane = 0; lane < lanes; lane++) {
+            struct vm_context ctx;
+            vm_initctx(&ctx, 0, 0);
+            memcpy(&ctx, regs[lane], 16 * sizeof(qword));
+            faults += vm_exec(&ctx, code, size) != VM_OK;
+            memcpy(regs[lane], &ctx, 16 * sizeof(qword));
+            vm_finictx(&ctx);
+        }
+        return faults;
+    }
+    taken = soa + 16 * stride;
+    for (int r = 0; r < 16; r++)
+        for (int lane = 0; lane < lanes; lane++)
+            soa[r * stride + lane] = regs[lane][r];
+
+    int32_t pc = size ? vm_decode_at(dec, 0) : -1;
+    while (pc >= 0 && together) {
+        struct vm_insn *insn = &dec->insns[pc];
+        qword *d = soa + insn->r1 * stride, *s = soa + insn->r2 * stride;
+        offset = insn->offset;
+        switch (insn->handler) {
+        case VM_H_NOP: break;
+        case VM_H_ADD_VAL: vm_batch_add(d, 0, insn->imm, lanes); break;
+        case VM_H_ADD_REG: vm_batch_add(d, s, 0, lanes); break;
+        case VM_H_SUB_VAL: vm_batch_sub(d, 0, insn->imm, lanes); break;
+        case VM_H_SUB_REG: vm_batch_sub(d, s, 0, lanes); break;
+        case VM_H_XOR_VAL: vm_batch_xor(d, 0, insn->imm, lanes); break;
+        case VM_H_XOR_REG: vm_batch_xor(d, s, 0, lanes); break;
+        case VM_H_MUL_VAL: vm_batch_mul(d, 0, insn->imm, lanes); break;
+        case VM_H_MUL_REG: vm_batch_mul(d, s, 0, lanes); break;
+        case VM_H_SHL_VAL: vm_batch_shl(d, 0, insn->imm, lanes); break;
+        case VM_H_SHL_REG: vm_batch_shl(d, s, 0, lanes); break;
+        case VM_H_SHR_VAL: vm_batch_shr(d, 0, insn->imm, lanes); break;
+        case VM_H_SHR_REG: vm_batch_shr(d, s, 0, lanes); break;
+        case VM_H_MOV_VAL: vm_batch_mov(d, 0, insn->imm, lanes); break;
+        case VM_H_MOV_REG: vm_batch_mov(d, s, 0, lanes); break;
+        case VM_H_MOV_MEM2REG: vm_batch_mov(d, 0, *(qword*) insn->imm, lanes); break;
+        case VM_H_MOV_VMEM2REG: vm_batch_mov(d, 0, *(qword*)(base + insn->imm), lanes); break;
+        case VM_H_LEA_VAL: vm_batch_mov(d, 0, base + insn->offset + (dword) insn->imm, lanes); break;
+        case VM_H_LEA_REG:
+            for (int lane = 0; lane < lanes; lane++)
+                d[lane] = base + insn->offset + (dword) s[lane];
+            break;
+        case VM_H_CMP_VAL: vm_batch_cmp(soa + 13 * stride, d, 0, insn->imm, lanes); break;
+        case VM_H_CMP_REG: vm_batch_cmp(soa + 13 * stride, d, s, 0, lanes); break;
+        case VM_H_DIV_VAL:
+        case VM_H_DIV_REG:
+            for (int lane = 0; lane < lanes; lane++) {
+                qword *reg1 = &d[lane], *reg2 = insn->handler == VM_H_DIV_REG ? &s[lane] : &insn->imm;
+                soa[3 * stride + lane] = *reg1 % *reg2;
+                *reg1 /= *reg2;
+            }
+            break;
+        case VM_H_JMP_VAL:
+        case VM_H_GOTO:
+            pc = insn->target;
+            continue;
+        case VM_H_EXIT:
+            offset = insn->imm;
+            pc = -1;
+            continue;
+        case VM_H_JZ: case VM_H_JNZ: case VM_H_JE:
+        case VM_H_JNE: case VM_H_JLE: case VM_H_JGE: {
+            qword *flags = soa + 13 * stride, all = 1, any = 0;
+            for (int lane = 0; lane < lanes; lane++) {
+                taken[lane] = vm_batch_taken(insn->handler, flags[lane]);
+                all &= taken[lane];
+                any |= taken[lane];
+            }
+            if (all) {
+                pc = insn->target;
+                continue;
+            }
+            if (any) {
+                // lanes diverge, each continues alone from its own side
+                for (int lane = 0; lane < lanes; lane++)
+                    faults += vm_batch_scalar(dec, soa, stride, lane, taken[lane]
+                        ? insn->offset + (qword)(dword) insn->imm : insn->offset + insn->size,
+                        regs[lane]) != VM_OK;
+                together = 0;
+                continue;
+            }
+            break;
+        }
+        default:
+            // side effects or data-dependent control flow
+            for (int lane = 0; lane < lanes; lane++)
+                faults += vm_batch_scalar(dec, soa, stride, lane, insn->offset, regs[lane]) != VM_OK;
+            together = 0;
+            continue;
+        }
+        pc++;
+    }
+    if (together) {
+        // finished in lockstep
+        for (int lane = 0; lane < lanes; lane++) {
+            for (int r = 0; r < 16; r++)
+                regs[lane][r] = soa[r * stride + lane];
+            regs[lane][12] = base + offset;
+        }
+    }
+    VM_FREE(soa);
+    vm_destroydecoded(dec);
+    return faults;
+}
+
+#endif
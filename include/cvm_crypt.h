@@ -0,0 +1,274 @@
+#include "cvm.h"
+
+/*
+ Encrypted bytecode
+
+ vm_encrypt turns plaintext code into ciphertext with a 128-bit key; the
+ plaintext can then be dropped. vm_makeencrypted wraps the ciphertext for
+ vm_execencrypted, which decrypts a basic block the first time execution
+ enters it and keeps it in a small LRU cache keyed by the block's start
+ offset. A block runs from its entry to the first jump, RET, VM_CALLSUB or
+ VM_RETSUB, or VM_CRYPT_BLOCK bytes. Evicted blocks are wiped, so at most `cache_blocks`
+ blocks are in plaintext at any time, and a hot loop runs from the cache
+ without decrypting again.
+
+ The cipher is a keystream XOR'd over the code, with one 64-bit keystream
+ word per 8 bytes of code, so any block can be decrypted on its own. The
+ default VM_KEYSTREAM is a keyed mixing function: it hides the code from a
+ casual look but is not a vetted cipher. Define VM_KEYSTREAM(key, counter)
+ before including this header to plug in a real one (AES-CTR, ChaCha20).
+
+ Blocks run through vm_eval, with rip translated between the cache and the
+ ciphertext, so relative jumps and RET land where they would in plaintext,
+ and LEA and VM_CALLSUB frames hold addresses inside the ciphertext (other
+ reads of rip see the cache). VMEM operands address the
+ data segment passed to vm_execencrypted. vm_yield has no effect. The cache
+ is part of the vm_encrypted object, so a thread needs its own to run it.
+*/
+
+#ifndef CVM_CRYPT_H
+#define CVM_CRYPT_H
+
+#ifndef VM_CRYPT_BLOCK
+#define VM_CRYPT_BLOCK 256 // longest block, longer straight-line code is split
+#endif
+
+#ifndef VM_KEYSTREAM
+#define VM_KEYSTREAM vm_keystream
+#endif
+
+#define VM_CRYPT_PAD 16 // zeroes after a block, for a truncated last instruction
+
+// Keystream word for code bytes counter * 8 .. counter * 8 + 7
+static uint64_t vm_keystream(const uint64_t key[2], uint64_t counter) {
+    uint64_t z = key[0] + (counter + 1) * 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z ^= key[1];
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// XORs the keystream over `size` bytes that sit at code offset `offset`, so
+// it both encrypts and decrypts. `in` and `out` may be the same.
+static void vm_cryptbytes(const uint64_t key[2], qword offset, const char * in, char * out, qword size) {
+    for (qword i = 0; i < size;) {
+        uint64_t word = VM_KEYSTREAM(key, (uint64_t)(offset + i) / 8);
+        for (int shift = (offset + i) % 8 * 8; shift < 64 && i < size; shift += 8, i++)
+            out[i] = (char)(in[i] ^ (char)(word >> shift));
+    }
+}
+
+static void vm_encrypt(const uint64_t key[2], const char * code, char * out, qword size) {
+    vm_cryptbytes(key, 0, code, out, size);
+}
+
+// Clears memory that held plaintext, in a way the compiler can't drop
+static void vm_wipe(void * memory, qword size) {
+    volatile char * p = (volatile char *) memory;
+    while (size--)
+        *p++ = 0;
+}
+
+struct vm_cryptstats {
+    qword hits; // block entries served from the cache
+    qword misses; // block entries that decrypted
+    qword evictions;
+    qword decrypted; // bytes decrypted
+    qword decrypt_ns; // time spent decrypting
+};
+
+struct vm_cryptblock {
+    qword start, size; // code offset of the entry, bytes of whole instructions
+    qword last_used; // enc->clock at the latest entry
+    int32_t chain; // next block in the same hash bucket
+    int32_t exits[2]; // slots last entered after falling through / jumping, a hint
+    char code[VM_CRYPT_BLOCK + VM_CRYPT_PAD];
+};
+
+struct vm_encrypted {
+    const char * code; // ciphertext, not owned
+    qword code_size;
+    uint64_t key[2];
+    struct vm_cryptblock * blocks;
+    int32_t * buckets; // block index per hash bucket, -1 if empty
+    int32_t count, used; // cache capacity, blocks filled
+    int32_t mask; // buckets - 1
+    qword clock; // block entries so far
+    struct vm_cryptstats stats;
+};
+
+static void vm_destroyencrypted(struct vm_encrypted * enc) {
+    if (enc) {
+        if (enc->blocks)
+            vm_wipe(enc->blocks, (qword) enc->count * sizeof(struct vm_cryptblock));
+        vm_wipe(enc->key, sizeof(enc->key));
+        VM_FREE(enc->blocks);
+        VM_FREE(enc->buckets);
+        VM_FREE(enc);
+    }
+}
+
+// Wraps ciphertext from vm_encrypt without copying it. The key is copied.
+// cache_blocks bounds how many blocks are decrypted at once.
+static struct vm_encrypted * vm_makeencrypted(const char * code, qword size, const uint64_t key[2], int cache_blocks) {
+    struct vm_encrypted * enc = ALLOCSTRUCT(vm_encrypted);
+    int32_t buckets = 1;
+    if (!enc)
+        return 0;
+    memset(enc, 0, sizeof(struct vm_encrypted));
+    if (cache_blocks < 1)
+        cache_blocks = 1;
+    while (buckets < cache_blocks * 2)
+        buckets *= 2;
+    enc->code = code;
+    enc->code_size = size;
+    enc->key[0] = key[0];
+    enc->key[1] = key[1];
+    enc->count = cache_blocks;
+    enc->mask = buckets - 1;
+    enc->blocks = (struct vm_cryptblock*) VM_CALLOC(cache_blocks, sizeof(struct vm_cryptblock));
+    enc->buckets = (int32_t*) VM_MALLOC(buckets * sizeof(int32_t));
+    if (!enc->blocks || !enc->buckets) {
+        vm_destroyencrypted(enc);
+        return 0;
+    }
+    memset(enc->buckets, 0xff, buckets * sizeof(int32_t));
+    return enc;
+}
+
+static int32_t vm_cryptbucket(const struct vm_encrypted * enc, qword start) {
+    return (int32_t)(((uint64_t) start * 0x9e3779b97f4a7c15ull) >> 40) & enc->mask;
+}
+
+// Takes the least recently used block out of the cache and wipes it
+static int32_t vm_cryptevict(struct vm_encrypted * enc) {
+    int32_t i = 0;
+    for (int32_t j = 1; j < enc->count; j++)
+        if (enc->blocks[j].last_used < enc->blocks[i].last_used)
+            i = j;
+    struct vm_cryptblock * b = &enc->blocks[i];
+    int32_t * link = &enc->buckets[vm_cryptbucket(enc, b->start)];
+    while (*link != i)
+        link = &enc->blocks[*link].chain;
+    *link = b->chain;
+    vm_wipe(b->code, b->size);
+    enc->stats.evictions++;
+    return i;
+}
+
+// Whether an instruction can move rip anywhere but the next instruction
+static int vm_endsblock(const char * instr) {
+    switch (instr[1]) {
+    case VM_RET: case VM_JMP: case VM_CALLSUB: case VM_RETSUB:
+    case VM_JZ: case VM_JNZ: case VM_JE: case VM_JNE:
+    case VM_JG: case VM_JL: case VM_JLE: case VM_JGE:
+        return 1;
+    }
+    return 0;
+}
+
+// Decrypts the block entered at `start` into slot i, one instruction at a
+// time since only the plaintext says where each one ends
+static void vm_cryptfill(struct vm_encrypted * enc, int32_t i, qword start) {
+    struct vm_cryptblock * b = &enc->blocks[i];
+    qword now = vm_now(), size = 0, left = enc->code_size - start;
+    while (size < left) {
+        vm_cryptbytes(enc->key, start + size, enc->code + start + size, b->code + size, 1);
+        qword len = GETFIRST(b->code[size]), whole = len && len <= left - size;
+        if (!whole) // a zero length or the code's end: take what's left of 16 bytes and stop
+            len = left - size < VM_CRYPT_PAD ? left - size : VM_CRYPT_PAD;
+        if (size && size + len > VM_CRYPT_BLOCK)
+            break;
+        vm_cryptbytes(enc->key, start + size + 1, enc->code + start + size + 1, b->code + size + 1, len - 1);
+        size += len;
+        if (!whole || vm_endsblock(b->code + size - len))
+            break;
+    }
+    memset(b->code + size, 0, VM_CRYPT_PAD);
+    b->start = start;
+    b->size = size;
+    b->exits[0] = b->exits[1] = -1;
+    enc->stats.misses++;
+    enc->stats.decrypted += size;
+    enc->stats.decrypt_ns += vm_now() - now;
+}
+
+// Slot of the cached block entered at `start`, decrypting it on a miss.
+// `hint` is a slot that probably holds it, or -1.
+static int32_t vm_cryptblock(struct vm_encrypted * enc, qword start, int32_t hint) {
+    int32_t * bucket, i = hint;
+    if (i < 0 || enc->blocks[i].start != start) {
+        bucket = &enc->buckets[vm_cryptbucket(enc, start)];
+        for (i = *bucket; i >= 0 && enc->blocks[i].start != start; i = enc->blocks[i].chain)
+            ;
+        if (i < 0) {
+            i = enc->used < enc->count ? enc->used++ : vm_cryptevict(enc);
+            vm_cryptfill(enc, i, start);
+            enc->blocks[i].chain = *bucket;
+            *bucket = i;
+            enc->blocks[i].last_used = ++enc->clock;
+            return i;
+        }
+    }
+    enc->stats.hits++;
+    enc->blocks[i].last_used = ++enc->clock;
+    return i;
+}
+
+// Wipes every cached block, e.g. after a run, keeping the statistics
+static void vm_cryptflush(struct vm_encrypted * enc) {
+    for (int32_t i = 0; i < enc->used; i++) {
+        vm_wipe(enc->blocks[i].code, enc->blocks[i].size);
+        enc->blocks[i].start = -1; // stale exit hints must not match
+    }
+    memset(enc->buckets, 0xff, (enc->mask + 1) * sizeof(int32_t));
+    enc->used = 0;
+}
+
+// Runs the encrypted code from offset 0, VMEM operands address `data`.
+// Returns enum vm_error, also left in ctx->error.
+static int vm_execencrypted(struct vm_context * ctx, struct vm_encrypted * enc, char * data) {
+    qword base = (qword) enc->code, pc = 0;
+    int32_t hint = -1, * exit = &hint;
+    vm_load(ctx, enc->code, enc->code_size, data);
+    while ((uint64_t) pc < (uint64_t) enc->code_size && !ctx->error) {
+        int32_t i = vm_cryptblock(enc, pc, *exit);
+        struct vm_cryptblock * b = &enc->blocks[i];
+        qword code = (qword) b->code, size = b->size, at = 0, next = 0;
+        *exit = i;
+        // rip points into the cache while the block runs, and back into
+        // the ciphertext when it leaves, so jumps resolve as in plaintext.
+        // A jump into the middle of the block starts a new one there, which
+        // keeps instruction boundaries as the plaintext has them.
+        ctx->rip = code;
+        while ((uint64_t) at < (uint64_t) size && (at == next || !at) && !ctx->error) {
+            char * instr = b->code + at;
+            qword depth = ctx->call_depth;
+            next = at + GETFIRST(instr[0]);
+            vm_eval(ctx, instr);
+            if (instr[1] == VM_LEA && GETFIRST(instr[2]) != 12)
+                ctx->regs[GETFIRST(instr[2])] += base + b->start - code;
+            else if (ctx->call_depth > depth) // VM_CALLSUB pushed a cache address
+                ctx->calls[depth] += base + b->start - code;
+            else if (ctx->call_depth < depth) // VM_RETSUB went back into the ciphertext
+                ctx->rip += code - base - b->start;
+            at = ctx->rip - code;
+        }
+        pc = b->start + at;
+        ctx->rip = base + pc;
+        exit = &b->exits[at != size]; // blocks mostly leave to one or two others
+    }
+    vm_yielded = 0;
+    return (int) ctx->error;
+}
+
+static void vm_cryptreport(const struct vm_encrypted * enc, FILE * out) {
+    const struct vm_cryptstats * s = &enc->stats;
+    qword entries = s->hits + s->misses;
+    fprintf(out, "blocks entered %lld, hit rate %.2f%%, %lld decrypted (%lld bytes, %.1f ns/byte), %lld evicted\n",
+            (long long) entries, entries ? 100.0 * s->hits / entries : 0.0, (long long) s->misses,
+            (long long) s->decrypted, s->decrypted ? (double) s->decrypt_ns / s->decrypted : 0.0,
+            (long long) s->evictions);
+}
+
+#endif
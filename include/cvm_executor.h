@@ -0,0 +1,268 @@
+#include "cvm.h"
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ Multithreaded executor for many independent VM jobs (POSIX threads)
+
+ Jobs are caller-owned vm_job structs: code, initial registers and an
+ optional completion callback. Each worker keeps its own deque, takes new
+ work from the bottom and steals from the top of the others when it runs
+ dry. Workers run jobs in pooled contexts (vm_acquirectx) with their own
+ decode cache, so a warm executor doesn't allocate per job.
+
+ Thread safety: workers only read a job's code, unless the bytecode stores
+ into it (VM_REG2VMEM, or VM_REG2MEM aimed at the code). Jobs that can do
+ that while sharing a buffer with other jobs must set VM_JOB_PRIVATE, which
+ runs them on a per-worker copy. Native functions called with VM_CALL run on
+ worker threads and must be thread-safe themselves.
+*/
+
+#ifndef CVM_EXECUTOR_H
+#define CVM_EXECUTOR_H
+
+enum vm_job_flags {
+    VM_JOB_PRIVATE = 1 // run on a private copy of the code
+};
+
+struct vm_job {
+    char * code;
+    int size, flags;
+    qword regs[16]; // initial registers (rax .. rbp), final registers after the job
+    qword error;
+    void (*done)(struct vm_job * job, void * arg); // called on the worker, may be NULL
+    void * arg;
+    int finished;
+};
+
+struct vm_worker {
+    struct vm_executor * ex;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct vm_job ** jobs; // ring buffer, owner works at tail, thieves at head
+    qword head, tail, capacity;
+    char * scratch; // private code copies
+    qword scratch_size;
+};
+
+struct vm_executor {
+    struct vm_worker * workers;
+    int count, stop;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    qword queued, idle, running; // queued and idle are atomic, running is under lock
+    unsigned next;
+};
+
+static VM_THREAD_LOCAL struct vm_worker * vm_worker_self;
+
+static int vm_deque_push(struct vm_worker * w, struct vm_job * job) {
+    pthread_mutex_lock(&w->lock);
+    if (w->tail - w->head == w->capacity) {
+        qword capacity = w->capacity ? w->capacity * 2 : 64;
+        struct vm_job ** jobs = (struct vm_job **) VM_MALLOC(capacity * sizeof(struct vm_job *));
+        if (!jobs) {
+            pthread_mutex_unlock(&w->lock);
+            return 0;
+        }
+        for (qword i = w->head; i < w->tail; i++)
+            jobs[i - w->head] = w->jobs[i % w->capacity];
+        VM_FREE(w->jobs);
+        w->jobs = jobs;
+        w->tail -= w->head;
+        w->head = 0;
+        w->capacity = capacity;
+    }
+    w->jobs[w->tail++ % w->capacity] = job;
+    pthread_mutex_unlock(&w->lock);
+    return 1;
+}
+
+// Newest job for the owner, oldest for a thief
+static struct vm_job * vm_deque_take(struct vm_worker * w, int steal) {
+    struct vm_job * job = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->head != w->tail)
+        job = steal ? w->jobs[w->head++ % w->capacity] : w->jobs[--w->tail % w->capacity];
+    pthread_mutex_unlock(&w->lock);
+    return job;
+}
+
+static struct vm_job * vm_executor_find(struct vm_executor * ex, struct vm_worker * self) {
+    struct vm_job * job = vm_deque_take(self, 0);
+    int at = (int)(self - ex->workers);
+    for (int i = 1; !job && i < ex->count; i++)
+        job = vm_deque_take(&ex->workers[(at + i) % ex->count], 1);
+    if (job)
+        __atomic_sub_fetch(&ex->queued, 1, __ATOMIC_SEQ_CST);
+    return job;
+}
+
+static void vm_executor_run(struct vm_worker * self, struct vm_job * job) {
+    struct vm_executor * ex = self->ex;
+    struct vm_context * ctx = vm_acquirectx();
+    char * code = job->code;
+    if (!ctx) {
+        job->error = VM_OUT_OF_MEMORY;
+    } else {
+        if ((job->flags & VM_JOB_PRIVATE) && job->size > 0) {
+            if (self->scratch_size < (qword) job->size) {
+                VM_FREE(self->scratch);
+                self->scratch = (char *) VM_MALLOC(job->size);
+                self->scratch_size = self->scratch ? job->size : 0;
+            }
+            code = self->scratch;
+            if (code)
+                memcpy(code, job->code, job->size);
+        }
+        if (code || job->size <= 0) {
+            memcpy(ctx, job->regs, sizeof(job->regs));
+            job->error = vm_exec(ctx, code, job->size);
+            memcpy(job->regs, ctx, sizeof(job->regs));
+            job->regs[12] += job->code - code; // rip relative to the caller's buffer
+        } else {
+            job->error = VM_OUT_OF_MEMORY;
+        }
+        vm_recyclectx(ctx);
+    }
+    if (job->done)
+        job->done(job, job->arg);
+    pthread_mutex_lock(&ex->lock);
+    job->finished = 1;
+    ex->running--;
+    pthread_cond_broadcast(&ex->done);
+    pthread_mutex_unlock(&ex->lock);
+}
+
+static void * vm_executor_main(void * arg) {
+    struct vm_worker * self = (struct vm_worker *) arg;
+    struct vm_executor * ex = self->ex;
+    vm_worker_self = self;
+    pthread_mutex_lock(&ex->lock); // wait until vm_makeexecutor settled ex->count
+    pthread_mutex_unlock(&ex->lock);
+    for (;;) {
+        struct vm_job * job = vm_executor_find(ex, self);
+        if (job) {
+            vm_executor_run(self, job);
+            continue;
+        }
+        pthread_mutex_lock(&ex->lock);
+        __atomic_add_fetch(&ex->idle, 1, __ATOMIC_SEQ_CST);
+        while (!__atomic_load_n(&ex->queued, __ATOMIC_SEQ_CST) && !ex->stop)
+            pthread_cond_wait(&ex->work, &ex->lock);
+        __atomic_sub_fetch(&ex->idle, 1, __ATOMIC_SEQ_CST);
+        if (ex->stop && !__atomic_load_n(&ex->queued, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_unlock(&ex->lock);
+            break;
+        }
+        pthread_mutex_unlock(&ex->lock);
+    }
+    vm_drainpool();
+    vm_flushdecoded();
+    VM_FREE(self->scratch);
+    vm_worker_self = 0;
+    return 0;
+}
+
+static void vm_destroyexecutor(struct vm_executor * ex);
+
+// Starts `threads` workers, one per online CPU when threads <= 0
+static struct vm_executor * vm_makeexecutor(int threads) {
+    struct vm_executor * ex = ALLOCSTRUCT(vm_executor);
+    if (!ex)
+        return 0;
+    memset(ex, 0, sizeof(struct vm_executor));
+    if (threads <= 0)
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    ex->workers = (struct vm_worker *) VM_CALLOC(threads, sizeof(struct vm_worker));
+    if (!ex->workers) {
+        VM_FREE(ex);
+        return 0;
+    }
+    pthread_mutex_init(&ex->lock, 0);
+    pthread_cond_init(&ex->work, 0);
+    pthread_cond_init(&ex->done, 0);
+    for (int i = 0; i < threads; i++) {
+        ex->workers[i].ex = ex;
+        pthread_mutex_init(&ex->workers[i].lock, 0);
+    }
+    pthread_mutex_lock(&ex->lock);
+    for (; ex->count < threads; ex->count++)
+        if (pthread_create(&ex->workers[ex->count].thread, 0, vm_executor_main, &ex->workers[ex->count]))
+            break;
+    pthread_mutex_unlock(&ex->lock);
+    for (int i = ex->count; i < threads; i++)
+        pthread_mutex_destroy(&ex->workers[i].lock);
+    if (!ex->count) {
+        vm_destroyexecutor(ex);
+        return 0;
+    }
+    return ex;
+}
+
+// Queues a job, returns 0 if it couldn't be queued. The job must stay alive
+// until vm_wait or vm_waitall returns, even when it has a callback.
+static int vm_submit(struct vm_executor * ex, struct vm_job * job) {
+    struct vm_worker * w = vm_worker_self && vm_worker_self->ex == ex
+        ? vm_worker_self : &ex->workers[__atomic_fetch_add(&ex->next, 1, __ATOMIC_RELAXED) % ex->count];
+    job->finished = 0;
+    job->error = VM_OK;
+    pthread_mutex_lock(&ex->lock);
+    ex->running++;
+    pthread_mutex_unlock(&ex->lock);
+    if (!vm_deque_push(w, job)) {
+        pthread_mutex_lock(&ex->lock);
+        ex->running--;
+        pthread_mutex_unlock(&ex->lock);
+        return 0;
+    }
+    __atomic_add_fetch(&ex->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ex->idle, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&ex->lock);
+        pthread_cond_signal(&ex->work);
+        pthread_mutex_unlock(&ex->lock);
+    }
+    return 1;
+}
+
+// Blocks until the job finished and returns its rax
+static qword vm_wait(struct vm_executor * ex, struct vm_job * job) {
+    pthread_mutex_lock(&ex->lock);
+    while (!job->finished)
+        pthread_cond_wait(&ex->done, &ex->lock);
+    pthread_mutex_unlock(&ex->lock);
+    return job->regs[0];
+}
+
+static void vm_waitall(struct vm_executor * ex) {
+    pthread_mutex_lock(&ex->lock);
+    while (ex->running)
+        pthread_cond_wait(&ex->done, &ex->lock);
+    pthread_mutex_unlock(&ex->lock);
+}
+
+// Finishes queued jobs, then stops the workers
+static void vm_destroyexecutor(struct vm_executor * ex) {
+    if (!ex)
+        return;
+    vm_waitall(ex);
+    pthread_mutex_lock(&ex->lock);
+    ex->stop = 1;
+    pthread_cond_broadcast(&ex->work);
+    pthread_mutex_unlock(&ex->lock);
+    for (int i = 0; i < ex->count; i++)
+        pthread_join(ex->workers[i].thread, 0);
+    for (int i = 0; i < ex->count; i++) {
+        pthread_mutex_destroy(&ex->workers[i].lock);
+        VM_FREE(ex->workers[i].jobs);
+    }
+    pthread_cond_destroy(&ex->work);
+    pthread_cond_destroy(&ex->done);
+    pthread_mutex_destroy(&ex->lock);
+    VM_FREE(ex->workers);
+    VM_FREE(ex);
+}
+
+#endif
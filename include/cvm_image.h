@@ -0,0 +1,326 @@
+#include "cvm.h"
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ Bytecode images (POSIX)
+
+ An image file holds a program outside the host binary:
+
+   header | code | imports | branch targets | strings | data (page aligned)
+
+ Native functions are imported by name and called with the VM_IMPORT variant
+ of VM_CALL, whose immediate is an index into the import table, so images
+ contain no absolute addresses. vm_loadimage maps the file, resolves the
+ imports and runs the code straight from the mapping. The data section is
+ mapped copy-on-write, so loading copies nothing. Images are little-endian.
+
+ The branch target table lists every static jump target plus any extra entry
+ points given to vm_writeimage. The loader checks them against the code and,
+ with VM_PREDECODE, decodes them up front.
+*/
+
+#ifndef CVM_IMAGE_H
+#define CVM_IMAGE_H
+
+#define VM_IMAGE_MAGIC "CVMI"
+#define VM_IMAGE_VERSION 1
+#define VM_IMAGE_ALIGN 4096 // data section alignment, so it can be remapped writable
+
+struct vm_image_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t code_offset, code_size;
+    uint64_t imports_offset, import_count; // struct vm_image_import
+    uint64_t targets_offset, target_count; // uint32_t code offsets, ascending
+    uint64_t strings_offset, strings_size;
+    uint64_t data_offset, data_size;
+};
+
+struct vm_image_import {
+    uint64_t name; // offset into the string section
+    uint64_t signature; // offset of its vm_makenative signature, VM_IMAGE_UNTYPED if none
+};
+
+#define VM_IMAGE_UNTYPED UINT64_MAX
+
+struct vm_image {
+    struct vm_program program;
+    const struct vm_image_header * header;
+    void * map;
+    qword map_size;
+    struct vm_native * imports; // resolved functions, indexed like the import table
+    qword import_count;
+    const uint32_t * targets;
+    qword target_count;
+};
+
+// Returns the address of a named native function, or NULL
+typedef void * (* vm_resolver)(const char * name, void * user);
+
+static int vm_image_range(uint64_t offset, uint64_t size, uint64_t total) {
+    return offset <= total && size <= total - offset;
+}
+
+static int vm_image_cmp32(const void * a, const void * b) {
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static int vm_image_put(FILE * f, const void * p, qword size, qword * at) {
+    *at += size;
+    return !size || fwrite(p, 1, size, f) == (size_t) size;
+}
+
+// Writes an image. `imports` names the native functions VM_IMPORT calls refer
+// to, `signatures` (may be NULL, as may each entry) gives their vm_makenative
+// signatures. `entries` (may be NULL) lists code offsets reached through JMP
+// reg or RET. Returns 1 on success.
+static int vm_writeimage(const char * path, const char * code, qword code_size, const char * data, qword data_size,
+                         const char * const * imports, const char * const * signatures, qword import_count,
+                         const uint32_t * entries, qword entry_count) {
+    struct vm_image_header h;
+    struct vm_decoded * dec = vm_predecode((char*) code, code_size);
+    uint32_t * targets;
+    qword ntargets = 0, at = 0, strings = 0;
+    int ok = 1;
+    FILE * f;
+    if (!dec)
+        return 0;
+    for (qword i = 0; i < entry_count; i++)
+        if (entries[i] < code_size && vm_decode_at(dec, entries[i]) < 0)
+            ok = 0;
+    targets = (uint32_t*) VM_MALLOC((dec->count + entry_count + 1) * sizeof(uint32_t));
+    if (!ok || !targets) {
+        VM_FREE(targets);
+        vm_destroydecoded(dec);
+        return 0;
+    }
+    targets[ntargets++] = 0;
+    for (int32_t i = 0; i < dec->count; i++)
+        if ((dec->insns[i].flags & VM_INSN_BRANCH) && dec->insns[i].target >= 0
+            && dec->insns[dec->insns[i].target].handler != VM_H_EXIT)
+            targets[ntargets++] = dec->insns[dec->insns[i].target].offset;
+    for (qword i = 0; i < entry_count; i++)
+        if (entries[i] < code_size)
+            targets[ntargets++] = entries[i];
+    vm_destroydecoded(dec);
+    qsort(targets, ntargets, sizeof(uint32_t), vm_image_cmp32);
+    qword unique = 0;
+    for (qword i = 0; i < ntargets; i++)
+        if (!unique || targets[unique - 1] != targets[i])
+            targets[unique++] = targets[i];
+    ntargets = unique;
+
+    for (qword i = 0; i < import_count; i++)
+        strings += strlen(imports[i]) + 1 + (signatures && signatures[i] ? strlen(signatures[i]) + 1 : 0);
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, VM_IMAGE_MAGIC, 4);
+    h.version = VM_IMAGE_VERSION;
+    h.code_offset = sizeof(h);
+    h.code_size = code_size;
+    h.imports_offset = (h.code_offset + code_size + 7) & ~(uint64_t) 7;
+    h.import_count = import_count;
+    h.targets_offset = h.imports_offset + import_count * sizeof(struct vm_image_import);
+    h.target_count = ntargets;
+    h.strings_offset = h.targets_offset + ntargets * sizeof(uint32_t);
+    h.strings_size = strings;
+    h.data_offset = (h.strings_offset + strings + VM_IMAGE_ALIGN - 1) & ~(uint64_t)(VM_IMAGE_ALIGN - 1);
+    h.data_size = data_size;
+
+    f = fopen(path, "wb");
+    if (!f) {
+        VM_FREE(targets);
+        return 0;
+    }
+    static const char zeros[VM_IMAGE_ALIGN] = {0};
+    ok = vm_image_put(f, &h, sizeof(h), &at) && vm_image_put(f, code, code_size, &at)
+        && vm_image_put(f, zeros, h.imports_offset - at, &at);
+    strings = 0;
+    for (qword i = 0; ok && i < import_count; i++) {
+        struct vm_image_import import = { strings, VM_IMAGE_UNTYPED };
+        strings += strlen(imports[i]) + 1;
+        if (signatures && signatures[i]) {
+            import.signature = strings;
+            strings += strlen(signatures[i]) + 1;
+        }
+        ok = vm_image_put(f, &import, sizeof(import), &at);
+    }
+    ok = ok && vm_image_put(f, targets, ntargets * sizeof(uint32_t), &at);
+    for (qword i = 0; ok && i < import_count; i++) {
+        ok = vm_image_put(f, imports[i], strlen(imports[i]) + 1, &at);
+        if (ok && signatures && signatures[i])
+            ok = vm_image_put(f, signatures[i], strlen(signatures[i]) + 1, &at);
+    }
+    ok = ok && vm_image_put(f, zeros, h.data_offset - at, &at);
+    if (data)
+        ok = ok && vm_image_put(f, data, data_size, &at);
+    else
+        for (qword left = data_size; ok && left; left -= left < VM_IMAGE_ALIGN ? left : VM_IMAGE_ALIGN)
+            ok = vm_image_put(f, zeros, left < VM_IMAGE_ALIGN ? left : VM_IMAGE_ALIGN, &at);
+    VM_FREE(targets);
+    return fclose(f) == 0 && ok;
+}
+
+static void * vm_image_dlsym(const char * name, void * user) {
+    return dlsym(user, name);
+}
+
+// Images may only reach native code through imports: no absolute calls or
+// MEM operands, and every import index must exist
+static int vm_image_check(struct vm_image * image) {
+    struct vm_decoded * dec = vm_predecode((char*) image->program.code, image->program.code_size);
+    int ok = dec != 0;
+    for (qword i = 0; ok && i < image->target_count; i++)
+        ok = image->targets[i] < image->program.code_size
+            && (!i || image->targets[i] > image->targets[i - 1])
+            && vm_decode_at(dec, image->targets[i]) >= 0;
+    for (int32_t i = 0; ok && dec && i < dec->count; i++) {
+        struct vm_insn * insn = &dec->insns[i];
+        if (insn->handler == VM_H_EXIT || insn->handler == VM_H_GOTO)
+            continue;
+        if (insn->op == VM_CALL)
+            ok = insn->variant == VM_IMPORT && (uint64_t) insn->imm < (uint64_t) image->import_count;
+        else if (insn->op == VM_MOV)
+            ok = insn->variant != VM_MEM2REG && insn->variant != VM_REG2MEM;
+    }
+    vm_destroydecoded(dec);
+    return ok;
+}
+
+static void vm_unloadimage(struct vm_image * image) {
+    if (image) {
+        if (image->map)
+            munmap(image->map, image->map_size);
+        if (image->program.owned)
+            VM_FREE(image->program.data);
+        VM_FREE(image->imports);
+        VM_FREE(image);
+    }
+}
+
+// Maps an image and resolves its imports through `resolve`, or dlsym on the
+// host process if it is NULL (host functions need -rdynamic). Returns NULL if
+// the file is malformed, an import is missing or the code fails vm_image_check.
+static struct vm_image * vm_loadimage(const char * path, vm_resolver resolve, void * user) {
+    struct vm_image * image;
+    const struct vm_image_header * h;
+    const struct vm_image_import * imports;
+    const char * strings;
+    struct stat st;
+    long page = sysconf(_SC_PAGESIZE);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    image = (struct vm_image*) VM_CALLOC(1, sizeof(struct vm_image));
+    if (!image || fstat(fd, &st) || (uint64_t) st.st_size < sizeof(struct vm_image_header)) {
+        close(fd);
+        VM_FREE(image);
+        return 0;
+    }
+    image->map_size = st.st_size;
+    image->map = mmap(0, image->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image->map == MAP_FAILED) {
+        image->map = 0;
+        vm_unloadimage(image);
+        return 0;
+    }
+    h = image->header = (const struct vm_image_header*) image->map;
+    if (memcmp(h->magic, VM_IMAGE_MAGIC, 4) || h->version != VM_IMAGE_VERSION
+        || !vm_image_range(h->code_offset, h->code_size, image->map_size) || h->code_size > 0x7fffffff
+        || h->import_count > image->map_size || h->imports_offset % 8
+        || !vm_image_range(h->imports_offset, h->import_count * sizeof(struct vm_image_import), image->map_size)
+        || h->target_count > image->map_size || h->targets_offset % 4
+        || !vm_image_range(h->targets_offset, h->target_count * sizeof(uint32_t), image->map_size)
+        || !vm_image_range(h->strings_offset, h->strings_size, image->map_size)
+        || !vm_image_range(h->data_offset, h->data_size, image->map_size)) {
+        vm_unloadimage(image);
+        return 0;
+    }
+    image->program.code = (const char*) image->map + h->code_offset;
+    image->program.code_size = h->code_size;
+    image->targets = (const uint32_t*)((const char*) image->map + h->targets_offset);
+    image->target_count = h->target_count;
+
+    // data pages become private copies only once they are written
+    image->program.data_size = h->data_size;
+    if (h->data_size && page > 0 && h->data_offset % page == 0
+        && !mprotect((char*) image->map + h->data_offset, h->data_size, PROT_READ | PROT_WRITE)) {
+        image->program.data = (char*) image->map + h->data_offset;
+    } else if (h->data_size) {
+        image->program.data = (char*) VM_MALLOC(h->data_size);
+        image->program.owned = 1;
+        if (!image->program.data) {
+            vm_unloadimage(image);
+            return 0;
+        }
+        memcpy(image->program.data, (const char*) image->map + h->data_offset, h->data_size);
+    }
+
+    imports = (const struct vm_image_import*)((const char*) image->map + h->imports_offset);
+    strings = (const char*) image->map + h->strings_offset;
+    image->imports = (struct vm_native*) VM_CALLOC(h->import_count + 1, sizeof(struct vm_native));
+    if (!image->imports) {
+        vm_unloadimage(image);
+        return 0;
+    }
+    void * self = 0;
+    if (!resolve) {
+        resolve = vm_image_dlsym;
+        user = self = dlopen(0, RTLD_LAZY);
+    }
+    for (; image->import_count < h->import_count; image->import_count++) {
+        const struct vm_image_import * import = &imports[image->import_count];
+        void * target;
+        const char * signature = 0;
+        if (import->signature != VM_IMAGE_UNTYPED) {
+            if (import->signature >= h->strings_size
+                || !memchr(strings + import->signature, 0, h->strings_size - import->signature))
+                break;
+            signature = strings + import->signature;
+        }
+        if (import->name >= h->strings_size
+            || !memchr(strings + import->name, 0, h->strings_size - import->name)
+            || !(target = resolve(strings + import->name, user))
+            || !vm_makenative(&image->imports[image->import_count], target, signature))
+            break;
+    }
+    if (self)
+        dlclose(self);
+    image->program.imports = image->imports;
+    image->program.import_count = image->import_count;
+    if (image->import_count < h->import_count || !vm_image_check(image)) {
+        vm_unloadimage(image);
+        return 0;
+    }
+#if VM_PREDECODE
+    struct vm_decoded * dec = vm_getdecoded((char*) image->program.code, image->program.code_size);
+    for (qword i = 0; dec && i < image->target_count; i++)
+        vm_decode_at(dec, image->targets[i]);
+#endif
+    return image;
+}
+
+// Runs an image in a context with its registers already set up
+static int vm_execimage(struct vm_context * ctx, struct vm_image * image) {
+    return vm_execprogram(ctx, &image->program);
+}
+
+// vm_call for images
+static qword vm_callimage(struct vm_image * image, const qword * args, int nargs) {
+    struct vm_context * ctx = vm_acquirectx();
+    qword result = 0;
+    if (ctx) {
+        vm_loadargs(ctx, args, nargs);
+        if (!ctx->error && vm_execimage(ctx, image) == VM_OK)
+            result = ctx->rax;
+        vm_recyclectx(ctx);
+    }
+    return result;
+}
+
+#endif
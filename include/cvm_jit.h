@@ -0,0 +1,450 @@
+#include "cvm.h"
+
+/*
+ x86-64 JIT for CVM bytecode (Linux)
+
+ vm_jit_compile translates the statically reachable part of a program into
+ native code in an mmap'd region. VM registers rax..r9 live in the host's
+ callee-saved rbx, rbp, r12..r15 while native code runs, the rest stay in the
+ context. Instructions the JIT doesn't translate (stack ops, calls, returns,
+ register jumps, stores through absolute pointers, operands naming rip or
+ flags) leave native code through a side exit and are run by vm_eval, then
+ execution re-enters native code at the next instruction.
+
+ On other targets vm_jit_exec is vm_exec.
+*/
+
+#ifndef CVM_JIT_H
+#define CVM_JIT_H
+
+#if defined(__x86_64__) && defined(__linux__)
+#define CVM_JIT 1
+#else
+#define CVM_JIT 0
+#endif
+
+#ifndef VM_JIT_CACHE
+#define VM_JIT_CACHE 8 // entries in the per-thread JIT cache
+#endif
+
+#if CVM_JIT
+#include <sys/mman.h>
+
+typedef qword (*vm_jit_enter_t)(struct vm_context *ctx, void *at);
+
+struct vm_jit {
+    struct vm_decoded *dec;  // unfused records the native code was built from
+    unsigned char *mem;      // mapped native code
+    size_t mem_size;
+    void **entry;            // record index -> native address, NULL if interpreted
+    vm_jit_enter_t enter;    // loads host registers and jumps to an entry
+    int stale;               // the code stored into itself, don't reuse
+    int refs, orphan;        // runs in flight, evicted while running
+};
+
+// Host registers holding VM rax, rbx, rcx, rdx, r8, r9
+static const int vm_jit_host[6] = { 3, 5, 12, 13, 14, 15 };
+
+enum { VM_JIT_RAX = 0, VM_JIT_RCX = 1, VM_JIT_RDX = 2, VM_JIT_RSI = 6, VM_JIT_R8 = 8 };
+
+static void vm_jit_byte(unsigned char **p, int x) {
+    *(*p)++ = (unsigned char) x;
+}
+
+static void vm_jit_u32(unsigned char **p, uint32_t x) {
+    memcpy(*p, &x, 4);
+    *p += 4;
+}
+
+static void vm_jit_u64(unsigned char **p, qword x) {
+    memcpy(*p, &x, 8);
+    *p += 8;
+}
+
+// REX.W op reg, rm with register operands (host register numbers)
+static void vm_jit_rr(unsigned char **p, int op, int reg, int rm) {
+    vm_jit_byte(p, 0x48 | (reg >> 3) << 2 | (rm >> 3));
+    if (op > 0xff)
+        vm_jit_byte(p, op >> 8);
+    vm_jit_byte(p, op & 0xff);
+    vm_jit_byte(p, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// REX.W op reg, [rdi + disp], rdi holds the context
+static void vm_jit_rm(unsigned char **p, int op, int reg, int disp) {
+    vm_jit_byte(p, 0x48 | (reg >> 3) << 2);
+    vm_jit_byte(p, op);
+    if (disp < 128) {
+        vm_jit_byte(p, 0x40 | (reg & 7) << 3 | 7);
+        vm_jit_byte(p, disp);
+    } else {
+        vm_jit_byte(p, 0x80 | (reg & 7) << 3 | 7);
+        vm_jit_u32(p, disp);
+    }
+}
+
+static void vm_jit_load(unsigned char **p, int host, int vmreg) {
+    if (vmreg < 6)
+        vm_jit_rr(p, 0x8b, host, vm_jit_host[vmreg]);
+    else
+        vm_jit_rm(p, 0x8b, host, vmreg * (int) sizeof(qword));
+}
+
+static void vm_jit_store(unsigned char **p, int vmreg, int host) {
+    if (vmreg < 6)
+        vm_jit_rr(p, 0x8b, vm_jit_host[vmreg], host);
+    else
+        vm_jit_rm(p, 0x89, host, vmreg * (int) sizeof(qword));
+}
+
+static void vm_jit_movimm(unsigned char **p, int host, qword value) {
+    vm_jit_byte(p, 0x48 | (host >> 3));
+    vm_jit_byte(p, 0xb8 + (host & 7));
+    vm_jit_u64(p, value);
+}
+
+// Leaves native code, returning the code offset to continue from
+static void vm_jit_exit(unsigned char **p, qword offset, unsigned char *epilogue) {
+    vm_jit_movimm(p, VM_JIT_RAX, offset);
+    vm_jit_byte(p, 0xe9);
+    vm_jit_u32(p, (uint32_t)(epilogue - (*p + 4)));
+}
+
+// rel32 jump or jcc to a record, patched once all labels are known
+static void vm_jit_jump(unsigned char **p, int cc, int32_t target, int32_t *fixups, int *nfixups,
+                        unsigned char *mem) {
+    if (cc) {
+        vm_jit_byte(p, 0x0f);
+        vm_jit_byte(p, cc);
+    } else {
+        vm_jit_byte(p, 0xe9);
+    }
+    fixups[(*nfixups)++] = (int32_t)(*p - mem);
+    fixups[(*nfixups)++] = target;
+    vm_jit_u32(p, 0);
+}
+
+// Second operand into rcx, from a register or the immediate
+static void vm_jit_source(unsigned char **p, struct vm_insn *insn, int reg) {
+    if (reg)
+        vm_jit_load(p, VM_JIT_RCX, insn->r2);
+    else
+        vm_jit_movimm(p, VM_JIT_RCX, insn->imm);
+}
+
+// Host condition codes (jcc rel32 second byte) and flag tests for VM jumps
+static int vm_jit_cc(int handler) {
+    switch (handler) {
+    case VM_H_JE: return 0x84;
+    case VM_H_JNE: return 0x85;
+    case VM_H_JLE: return 0x8e;
+    case VM_H_JGE: return 0x8d;
+    }
+    return 0;
+}
+
+static void vm_jit_destroy(struct vm_jit *jit) {
+    if (jit) {
+        if (jit->mem)
+            munmap(jit->mem, jit->mem_size);
+        vm_destroydecoded(jit->dec);
+        VM_FREE(jit->entry);
+        VM_FREE(jit);
+    }
+}
+
+static struct vm_jit *vm_jit_compile(char *code, qword size) {
+    struct vm_jit *jit = ALLOCSTRUCT(vm_jit);
+    int32_t *fixups = 0, *labels = 0;
+    char *targeted = 0;
+    int nfixups = 0;
+    if (!jit)
+        return 0;
+    memset(jit, 0, sizeof(struct vm_jit));
+    jit->dec = vm_predecode(code, size);
+    if (!jit->dec)
+        goto fail;
+
+    struct vm_decoded *dec = jit->dec;
+    int32_t count = dec->count;
+    jit->mem_size = ((size_t) count * 112 + 256 + 4095) & ~(size_t) 4095;
+    jit->mem = (unsigned char*) mmap(0, jit->mem_size, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    jit->entry = (void**) VM_CALLOC(count + 1, sizeof(void*));
+    labels = (int32_t*) VM_MALLOC((count + 1) * sizeof(int32_t));
+    fixups = (int32_t*) VM_MALLOC((count + 1) * 4 * sizeof(int32_t));
+    targeted = (char*) VM_CALLOC(count + 1, 1);
+    if (jit->mem == MAP_FAILED) {
+        jit->mem = 0;
+        goto fail;
+    }
+    if (!jit->entry || !labels || !fixups || !targeted)
+        goto fail;
+    for (int32_t i = 0; i < count; i++)
+        if (dec->insns[i].target >= 0)
+            targeted[dec->insns[i].target] = 1;
+
+    unsigned char *p = jit->mem, *epilogue;
+    // enter(ctx = rdi, at = rsi): save callee-saved registers, load VM registers
+    vm_jit_byte(&p, 0x53);                      // push rbx
+    vm_jit_byte(&p, 0x55);                      // push rbp
+    for (int r = 12; r <= 15; r++) {            // push r12..r15
+        vm_jit_byte(&p, 0x41);
+        vm_jit_byte(&p, 0x50 + (r & 7));
+    }
+    for (int v = 0; v < 6; v++)
+        vm_jit_rm(&p, 0x8b, vm_jit_host[v], v * (int) sizeof(qword));
+    vm_jit_byte(&p, 0xff);                      // jmp rsi
+    vm_jit_byte(&p, 0xe6);
+    epilogue = p;
+    for (int v = 0; v < 6; v++)
+        vm_jit_rm(&p, 0x89, vm_jit_host[v], v * (int) sizeof(qword));
+    for (int r = 15; r >= 12; r--) {            // pop r15..r12
+        vm_jit_byte(&p, 0x41);
+        vm_jit_byte(&p, 0x58 + (r & 7));
+    }
+    vm_jit_byte(&p, 0x5d);                      // pop rbp
+    vm_jit_byte(&p, 0x5b);                      // pop rbx
+    vm_jit_byte(&p, 0xc3);                      // ret
+
+    for (int32_t i = 0; i < count; i++) {
+        struct vm_insn *insn = &dec->insns[i];
+        int h = insn->handler, reg = 0, supported = 1;
+        labels[i] = (int32_t)(p - jit->mem);
+        switch (h) {
+        case VM_H_NOP:
+            break;
+        case VM_H_ADD_REG: case VM_H_SUB_REG: case VM_H_MUL_REG: case VM_H_XOR_REG:
+            reg = 1; // fallthrough
+        case VM_H_ADD_VAL: case VM_H_SUB_VAL: case VM_H_MUL_VAL: case VM_H_XOR_VAL:
+            vm_jit_load(&p, VM_JIT_RAX, insn->r1);
+            vm_jit_source(&p, insn, reg);
+            if (h == VM_H_MUL_REG || h == VM_H_MUL_VAL)
+                vm_jit_rr(&p, 0x0faf, VM_JIT_RAX, VM_JIT_RCX);  // imul rax, rcx
+            else
+                vm_jit_rr(&p, h == VM_H_ADD_REG || h == VM_H_ADD_VAL ? 0x01
+                    : h == VM_H_SUB_REG || h == VM_H_SUB_VAL ? 0x29 : 0x31,
+                    VM_JIT_RCX, VM_JIT_RAX);
+            vm_jit_store(&p, insn->r1, VM_JIT_RAX);
+            break;
+        case VM_H_DIV_REG:
+            reg = 1; // fallthrough
+        case VM_H_DIV_VAL:
+            // rdx = reg % value, then reg /= value, reading operands again if
+            // the first store changed them
+            for (int pass = 0; pass < 2; pass++) {
+                vm_jit_load(&p, VM_JIT_RAX, insn->r1);
+                vm_jit_source(&p, insn, reg);
+                vm_jit_byte(&p, 0x48);                          // cqo
+                vm_jit_byte(&p, 0x99);
+                vm_jit_rr(&p, 0xf7, 7, VM_JIT_RCX);             // idiv rcx
+                if (pass == 0) {
+                    vm_jit_store(&p, 3, VM_JIT_RDX);
+                    if (insn->r1 == 3 || (reg && insn->r2 == 3))
+                        continue;
+                }
+                vm_jit_store(&p, insn->r1, VM_JIT_RAX);
+                break;
+            }
+            break;
+        case VM_H_SHL_REG: case VM_H_SHR_REG:
+            reg = 1; // fallthrough
+        case VM_H_SHL_VAL: case VM_H_SHR_VAL:
+            vm_jit_load(&p, VM_JIT_RAX, insn->r1);
+            vm_jit_source(&p, insn, reg);
+            vm_jit_rr(&p, 0xd3, h == VM_H_SHL_REG || h == VM_H_SHL_VAL ? 4 : 7, VM_JIT_RAX);
+            vm_jit_store(&p, insn->r1, VM_JIT_RAX);
+            break;
+        case VM_H_MOV_VAL:
+            vm_jit_movimm(&p, VM_JIT_RAX, insn->imm);
+            vm_jit_store(&p, insn->r1, VM_JIT_RAX);
+            break;
+        case VM_H_MOV_REG:
+            vm_jit_load(&p, VM_JIT_RAX, insn->r2);
+            vm_jit_store(&p, insn->r1, VM_JIT_RAX);
+            break;
+        case VM_H_MOV_MEM2REG: case VM_H_MOV_VMEM2REG:
+            vm_jit_movimm(&p, VM_JIT_RAX, insn->imm + (h == VM_H_MOV_VMEM2REG ? (qword) code : 0));
+            vm_jit_byte(&p, 0x48);                              // mov rax, [rax]
+            vm_jit_byte(&p, 0x8b);
+            vm_jit_byte(&p, 0x00);
+            vm_jit_store(&p, insn->r1, VM_JIT_RAX);
+            break;
+        case VM_H_MOV_REG2VMEM:
+            if (vm_decode_touched(dec, insn->imm)) {
+                supported = 0; // stores into the code
+                break;
+            }
+            vm_jit_load(&p, VM_JIT_RCX, insn->r1);
+            vm_jit_movimm(&p, VM_JIT_RAX, (qword) code + insn->imm);
+            vm_jit_byte(&p, 0x48);                              // mov [rax], rcx
+            vm_jit_byte(&p, 0x89);
+            vm_jit_byte(&p, 0x08);
+            break;
+        case VM_H_LEA_VAL:
+            vm_jit_movimm(&p, VM_JIT_RAX, (qword) code + insn->offset + (dword) insn->imm);
+            vm_jit_store(&p, insn->r1, VM_JIT_RAX);
+            break;
+        case VM_H_LEA_REG:
+            vm_jit_load(&p, VM_JIT_RAX, insn->r2);
+            vm_jit_rr(&p, 0x63, VM_JIT_RAX, VM_JIT_RAX);        // movsxd rax, eax
+            vm_jit_movimm(&p, VM_JIT_RCX, (qword) code + insn->offset);
+            vm_jit_rr(&p, 0x01, VM_JIT_RCX, VM_JIT_RAX);
+            vm_jit_store(&p, insn->r1, VM_JIT_RAX);
+            break;
+        case VM_H_CMP_REG:
+            reg = 1; // fallthrough
+        case VM_H_CMP_VAL:
+            vm_jit_load(&p, VM_JIT_RAX, insn->r1);
+            vm_jit_source(&p, insn, reg);
+            // flags = equals << 7 | greater << 6 | lesser << 5
+            vm_jit_byte(&p, 0x31); vm_jit_byte(&p, 0xd2);                       // xor edx, edx
+            vm_jit_byte(&p, 0x31); vm_jit_byte(&p, 0xf6);                       // xor esi, esi
+            vm_jit_byte(&p, 0x45); vm_jit_byte(&p, 0x31); vm_jit_byte(&p, 0xc0); // xor r8d, r8d
+            vm_jit_rr(&p, 0x39, VM_JIT_RCX, VM_JIT_RAX);                        // cmp rax, rcx
+            vm_jit_byte(&p, 0x0f); vm_jit_byte(&p, 0x94); vm_jit_byte(&p, 0xc2); // sete dl
+            vm_jit_byte(&p, 0x40); vm_jit_byte(&p, 0x0f); vm_jit_byte(&p, 0x9f);
+            vm_jit_byte(&p, 0xc6);                                              // setg sil
+            vm_jit_byte(&p, 0x41); vm_jit_byte(&p, 0x0f); vm_jit_byte(&p, 0x9c);
+            vm_jit_byte(&p, 0xc0);                                              // setl r8b
+            vm_jit_byte(&p, 0xc1); vm_jit_byte(&p, 0xe2); vm_jit_byte(&p, 7);   // shl edx, 7
+            vm_jit_byte(&p, 0xc1); vm_jit_byte(&p, 0xe6); vm_jit_byte(&p, 6);   // shl esi, 6
+            vm_jit_byte(&p, 0x41); vm_jit_byte(&p, 0xc1); vm_jit_byte(&p, 0xe0);
+            vm_jit_byte(&p, 5);                                                 // shl r8d, 5
+            vm_jit_byte(&p, 0x09); vm_jit_byte(&p, 0xf2);                       // or edx, esi
+            vm_jit_byte(&p, 0x44); vm_jit_byte(&p, 0x09); vm_jit_byte(&p, 0xc2); // or edx, r8d
+            vm_jit_rm(&p, 0x89, VM_JIT_RDX, 13 * (int) sizeof(qword));
+            if (vm_jit_cc(insn[1].handler)) {
+                // compare and branch directly, the jump record only needs code
+                // of its own if something else jumps to it
+                vm_jit_rr(&p, 0x39, VM_JIT_RCX, VM_JIT_RAX);
+                vm_jit_jump(&p, vm_jit_cc(insn[1].handler), insn[1].target, fixups, &nfixups, jit->mem);
+                if (!targeted[i + 1]) {
+                    jit->entry[i] = jit->mem + labels[i];
+                    labels[++i] = (int32_t)(p - jit->mem);
+                    continue;
+                }
+            }
+            break;
+        case VM_H_JMP_VAL: case VM_H_GOTO:
+            vm_jit_jump(&p, 0, insn->target, fixups, &nfixups, jit->mem);
+            break;
+        case VM_H_JZ: case VM_H_JNZ:
+        case VM_H_JE: case VM_H_JNE: case VM_H_JLE: case VM_H_JGE: {
+            int mask = h == VM_H_JE || h == VM_H_JNE ? VM_FLAG_EQUALS
+                : h == VM_H_JLE ? VM_FLAG_EQUALS | VM_FLAG_LESSER
+                : h == VM_H_JGE ? VM_FLAG_EQUALS | VM_FLAG_GREATER : 0;
+            vm_jit_rm(&p, 0x8b, VM_JIT_RCX, 13 * (int) sizeof(qword));
+            if (mask) {
+                vm_jit_byte(&p, 0xf7); vm_jit_byte(&p, 0xc1);                   // test ecx, mask
+                vm_jit_u32(&p, mask);
+            } else {
+                vm_jit_rr(&p, 0x85, VM_JIT_RCX, VM_JIT_RCX);                    // test rcx, rcx
+            }
+            vm_jit_jump(&p, h == VM_H_JZ || h == VM_H_JNE ? 0x84 : 0x85, insn->target,
+                        fixups, &nfixups, jit->mem);
+            break;
+        }
+        case VM_H_EXIT:
+            vm_jit_exit(&p, insn->imm, epilogue);
+            supported = 0;
+            break;
+        default:
+            supported = 0;
+        }
+        if (!supported && h != VM_H_EXIT)
+            vm_jit_exit(&p, insn->offset, epilogue);
+        jit->entry[i] = supported ? jit->mem + labels[i] : 0;
+    }
+    for (int f = 0; f < nfixups; f += 2) {
+        unsigned char *at = jit->mem + fixups[f];
+        uint32_t rel = (uint32_t)(jit->mem + labels[fixups[f + 1]] - (at + 4));
+        memcpy(at, &rel, 4);
+    }
+    if (mprotect(jit->mem, jit->mem_size, PROT_READ | PROT_EXEC))
+        goto fail;
+    jit->enter = (vm_jit_enter_t)(void*) jit->mem;
+    VM_FREE(labels);
+    VM_FREE(fixups);
+    VM_FREE(targeted);
+    return jit;
+
+fail:
+    VM_FREE(labels);
+    VM_FREE(fixups);
+    VM_FREE(targeted);
+    vm_jit_destroy(jit);
+    return 0;
+}
+
+static int vm_jit_run(struct vm_context *ctx, struct vm_jit *jit) {
+    struct vm_decoded *dec = jit->dec;
+    qword base = (qword) dec->code, size = dec->code_size, offset = 0;
+    ctx->code_base = base;
+    ctx->code_size = size;
+    ctx->data_base = base; // native code has VMEM addresses baked in
+    ctx->error = VM_OK;
+    ctx->call_depth = 0;
+    jit->refs++;
+    while (offset >= 0 && offset < size && !ctx->error) {
+        int32_t at = jit->stale ? -1 : dec->index[offset];
+        if (at >= 0 && jit->entry[at]) {
+            offset = jit->enter(ctx, jit->entry[at]);
+            continue;
+        }
+        // one instruction in the interpreter, then back to native code
+        char *instr = dec->code + offset;
+        ctx->rip = base + offset;
+        vm_eval(ctx, instr);
+        offset = ctx->rip - base;
+        if (instr[1] == VM_MOV && !jit->stale) {
+            int variant = GETSECOND(instr[0]);
+            qword imm = *(qword*)(instr + 3);
+            if ((variant == VM_REG2VMEM && vm_decode_touched(dec, imm))
+                || (variant == VM_REG2MEM && vm_decode_touched(dec, imm - base)))
+                jit->stale = 1; // native code no longer matches, interpret the rest
+        }
+    }
+    ctx->rip = base + offset;
+    if (--jit->refs == 0 && jit->orphan)
+        vm_jit_destroy(jit);
+    return (int) ctx->error;
+}
+
+static VM_THREAD_LOCAL struct vm_jit *vm_jit_cache[VM_JIT_CACHE];
+
+static struct vm_jit *vm_jit_get(char *code, qword size) {
+    struct vm_jit **slot = &vm_jit_cache[(((uintptr_t)code >> 4) ^ (uintptr_t)size) % VM_JIT_CACHE];
+    if (*slot && !(*slot)->stale && (*slot)->dec->code == code && (*slot)->dec->code_size == size
+        && vm_decode_current((*slot)->dec))
+        return *slot;
+    if (*slot && (*slot)->refs)
+        (*slot)->orphan = 1; // freed when its last run returns
+    else
+        vm_jit_destroy(*slot);
+    *slot = vm_jit_compile(code, size);
+    return *slot;
+}
+
+static void vm_jit_flush() {
+    for (int i = 0; i < VM_JIT_CACHE; i++) {
+        if (vm_jit_cache[i] && vm_jit_cache[i]->refs)
+            vm_jit_cache[i]->orphan = 1;
+        else
+            vm_jit_destroy(vm_jit_cache[i]);
+        vm_jit_cache[i] = 0;
+    }
+}
+#endif
+
+// Same contract as vm_exec, compiling through the per-thread JIT cache
+static int vm_jit_exec(struct vm_context *ctx, char *code, int size) {
+#if CVM_JIT && !VM_PROFILE // profiles come from vm_exec
+    struct vm_jit *jit = vm_jit_get(code, size);
+    if (jit)
+        return vm_jit_run(ctx, jit);
+#endif
+    return vm_exec(ctx, code, size);
+}
+
+#endif
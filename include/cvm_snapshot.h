@@ -0,0 +1,152 @@
+#include "cvm.h"
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+/*
+ Copy-on-write snapshots of warmed-up contexts (POSIX)
+
+ vm_snapshot copies a context with its registers, stack, subroutine frames,
+ data segment and heap into an anonymous file:
+
+   size | context | stack (page aligned), frames | data (page aligned) | heap (page aligned)
+
+ vm_fork maps that file privately, so every fork shares the snapshot's pages
+ until it writes to one and the kernel copies just that page. A fork only
+ rebases its stack, data and heap pointers, which touches the context's page,
+ and copies the frames of subroutines in progress to memory of its own. The
+ snapshot can be forked any number of times, from any thread, until
+ vm_destroysnapshot.
+
+ Code isn't part of the snapshot: forks carry on in the same code, which has
+ to outlive them. The data segment is whatever ctx->data_base points to, so
+ contexts run with vm_exec, whose VMEM addresses the code, share it instead;
+ pass data_size 0 for them.
+*/
+
+#ifndef CVM_SNAPSHOT_H
+#define CVM_SNAPSHOT_H
+
+#define VM_SNAPSHOT_HEADER 64 // keeps the context 64-byte aligned
+
+struct vm_snapshot {
+    int fd;
+    qword size; // of the file and every fork's mapping
+    qword stack_offset, calls_offset, data_offset, data_size;
+    qword heap_offset, heap_size;
+};
+
+// An unlinked file to map: memfd on Linux, a temporary file elsewhere
+static int vm_snapshotfile(void) {
+    char path[] = "/tmp/cvm-snapshot-XXXXXX";
+    int fd;
+#if defined(__linux__) && defined(SYS_memfd_create)
+    fd = (int) syscall(SYS_memfd_create, "cvm-snapshot", 1); // MFD_CLOEXEC
+    if (fd >= 0)
+        return fd;
+#endif
+    fd = mkstemp(path);
+    if (fd >= 0)
+        unlink(path);
+    return fd;
+}
+
+static qword vm_pageup(qword size, qword page) {
+    return (size + page - 1) / page * page;
+}
+
+static void vm_destroysnapshot(struct vm_snapshot * snap) {
+    if (snap) {
+        if (snap->fd >= 0)
+            close(snap->fd);
+        VM_FREE(snap);
+    }
+}
+
+// Captures the context, `data_size` bytes at ctx->data_base and the heap. The
+// context can keep running afterwards, forks start from the state it had here.
+static struct vm_snapshot * vm_snapshot(const struct vm_context * ctx, qword data_size) {
+    qword page = (qword) sysconf(_SC_PAGESIZE);
+    qword capacity = ctx->stack_capacity > VM_STACK_INITIAL ? ctx->stack_capacity : VM_STACK_INITIAL;
+    struct vm_snapshot * snap = ALLOCSTRUCT(vm_snapshot);
+    if (!snap)
+        return 0;
+    snap->stack_offset = vm_pageup(VM_SNAPSHOT_HEADER + sizeof(struct vm_context), page);
+    snap->calls_offset = snap->stack_offset + capacity * sizeof(qword);
+    snap->data_offset = vm_pageup(snap->calls_offset + ctx->call_depth * sizeof(qword), page);
+    snap->data_size = data_size;
+    snap->heap_offset = snap->data_offset + vm_pageup(data_size, page);
+    snap->heap_size = ctx->heap_size;
+    snap->size = snap->heap_offset + vm_pageup(ctx->heap_size, page);
+    snap->fd = vm_snapshotfile();
+    if (snap->fd < 0 || ftruncate(snap->fd, (off_t) snap->size)) {
+        vm_destroysnapshot(snap);
+        return 0;
+    }
+    char * base = (char*) mmap(0, snap->size, PROT_READ | PROT_WRITE, MAP_SHARED, snap->fd, 0);
+    if (base == (char*) MAP_FAILED) {
+        vm_destroysnapshot(snap);
+        return 0;
+    }
+    struct vm_context * copy = (struct vm_context*)(base + VM_SNAPSHOT_HEADER);
+    memcpy(base, &snap->size, sizeof(qword));
+    memcpy(copy, ctx, sizeof(struct vm_context));
+    copy->stack_capacity = capacity;
+    copy->stack_borrowed = 1; // the fork's mapping
+    copy->allocation = 0;
+    copy->calls = 0;
+    copy->call_capacity = 0;
+    copy->trace = 0; // a trace has one writer, forks attach their own
+    if (ctx->rsp)
+        memcpy(base + snap->stack_offset, ctx->stack, ctx->rsp * sizeof(qword));
+    if (ctx->call_depth)
+        memcpy(base + snap->calls_offset, ctx->calls, ctx->call_depth * sizeof(qword));
+    if (data_size)
+        memcpy(base + snap->data_offset, (char*) ctx->data_base, data_size);
+    if (ctx->heap_size)
+        memcpy(base + snap->heap_offset, ctx->heap, ctx->heap_size);
+    munmap(base, snap->size);
+    return snap;
+}
+
+// A new context in the snapshot's state, NULL if it couldn't be mapped.
+// Release it with vm_destroyfork, not vm_destroyctx or vm_recyclectx.
+static struct vm_context * vm_fork(const struct vm_snapshot * snap) {
+    char * base = (char*) mmap(0, snap->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, snap->fd, 0);
+    if (base == (char*) MAP_FAILED)
+        return 0;
+    struct vm_context * ctx = (struct vm_context*)(base + VM_SNAPSHOT_HEADER);
+    if (ctx->call_depth) { // vm_growcalls reallocates them
+        ctx->calls = (qword*) VM_MALLOC(ctx->call_depth * sizeof(qword));
+        if (!ctx->calls) {
+            munmap(base, snap->size);
+            return 0;
+        }
+        memcpy(ctx->calls, base + snap->calls_offset, ctx->call_depth * sizeof(qword));
+        ctx->call_capacity = ctx->call_depth;
+    }
+    ctx->stack = (qword*)(base + snap->stack_offset);
+    if (snap->data_size)
+        ctx->data_base = (qword)(base + snap->data_offset);
+    if (snap->heap_size)
+        ctx->heap = base + snap->heap_offset;
+    ctx->allocation = base;
+    return ctx;
+}
+
+static void vm_destroyfork(struct vm_context * ctx) {
+    if (ctx) {
+        char * base = (char*) ctx->allocation;
+        qword size;
+        memcpy(&size, base, sizeof(qword));
+        if (!ctx->stack_borrowed) // outgrew the mapping
+            VM_FREE(ctx->stack);
+        VM_FREE(ctx->calls);
+        munmap(base, size);
+    }
+}
+
+#endif
@@ -0,0 +1,172 @@
+#include "cvm.h"
+
+/*
+ Tiered execution
+
+ vm_exectiered starts every program in the vm_eval interpreter (tier 0) and
+ counts backward jumps per target. Once a target has been jumped back to
+ `threshold` times, the loop from it to the end of the backward jump is
+ decoded and fused on its own (tier 1), as a vm_decoded over just those
+ bytes. From then on, whenever tier 0 reaches the loop's head, execution
+ transfers into the fused loop and stays there until control leaves it: a
+ jump or fallthrough out of the range is an ordinary exit of the decoded
+ engine, and tier 0 carries on at that rip. Nested loops tier up on their
+ own, and an outer loop that gets hot is fused with its inner loops.
+
+ Loops that contain a RET or VM_RETSUB stay in tier 0, since either one with
+ nothing to return to ends the whole program. VM_CALLSUB and VM_RETSUB don't
+ count as backward jumps; a loop calling a subroutine outside itself tiers up
+ and leaves through the call. Code that writes into a fused loop has it
+ decoded again.
+
+ The vm_tiered object keeps the counters and loops between runs, so later
+ runs of the same code enter tier 1 straight away. It belongs to one thread
+ at a time.
+*/
+
+#ifndef CVM_TIER_H
+#define CVM_TIER_H
+
+#ifndef VM_TIER_THRESHOLD
+#define VM_TIER_THRESHOLD 1000 // backward jumps to a target before its loop tiers up
+#endif
+
+#define VM_TIER_NEVER INT32_MIN // heat of a target whose loop can't tier up
+
+struct vm_loop {
+    qword head, end; // code offsets, the loop is [head, end)
+    struct vm_decoded * dec; // fused records of the loop alone
+    qword entries; // transfers from tier 0
+    qword ns; // time spent in the loop
+};
+
+struct vm_tiered {
+    char * code;
+    qword code_size;
+    qword threshold;
+    int32_t * heat; // per code offset: backward jumps to it, or -1 - loop index once tiered
+    struct vm_loop * loops;
+    int32_t loop_count, loop_capacity;
+    qword interpreted_ns; // time spent in tier 0
+};
+
+static void vm_destroytiered(struct vm_tiered * t) {
+    if (t) {
+        for (int32_t i = 0; i < t->loop_count; i++)
+            vm_destroydecoded(t->loops[i].dec);
+        VM_FREE(t->loops);
+        VM_FREE(t->heat);
+        VM_FREE(t);
+    }
+}
+
+// Wraps code without copying it. threshold 0 means VM_TIER_THRESHOLD.
+static struct vm_tiered * vm_maketiered(char * code, qword size, qword threshold) {
+    struct vm_tiered * t = ALLOCSTRUCT(vm_tiered);
+    if (!t)
+        return 0;
+    memset(t, 0, sizeof(struct vm_tiered));
+    t->code = code;
+    t->code_size = size;
+    t->threshold = threshold ? threshold : VM_TIER_THRESHOLD;
+    t->heat = (int32_t*) VM_CALLOC(size + 1, sizeof(int32_t));
+    if (!t->heat) {
+        vm_destroytiered(t);
+        return 0;
+    }
+    return t;
+}
+
+// Fuses the loop [head, end) if its instructions, with their immediates,
+// run exactly up to `end` and none of them is a RET or RETSUB. Returns the
+// loop's index or -1.
+static int32_t vm_tierup(struct vm_tiered * t, qword head, qword end) {
+    qword at = head;
+    while (at < end) {
+        int len = GETFIRST(t->code[at]), op = at + 1 < end ? (unsigned char) t->code[at + 1] : (int) VM_OPCOUNT;
+        int handler = op < VM_OPCOUNT ? vm_handlerof(op, GETSECOND(t->code[at])) : (int) VM_H_NOP;
+        qword reach = at + len;
+        if (vm_handler_imm[handler] && at + vm_handler_imm[handler] + 8 > reach)
+            reach = at + vm_handler_imm[handler] + 8;
+        if (handler >= VM_H_LOAD8 && handler <= VM_H_BLOCK && at + (handler == VM_H_BLOCK ? 4 : 8) > reach)
+            reach = at + (handler == VM_H_BLOCK ? 4 : 8);
+        if (handler == VM_H_VECTOR && at + VM_VECTOR_SIZE(op) > reach)
+            reach = at + VM_VECTOR_SIZE(op);
+        if (!len || op == VM_RET || op == VM_RETSUB || reach > end)
+            return -1;
+        at += len;
+    }
+    if (at != end)
+        return -1;
+    if (t->loop_count == t->loop_capacity) {
+        int32_t capacity = t->loop_capacity ? t->loop_capacity * 2 : 8;
+        struct vm_loop * loops = (struct vm_loop*) VM_REALLOC(t->loops, capacity * sizeof(struct vm_loop));
+        if (!loops)
+            return -1;
+        t->loops = loops;
+        t->loop_capacity = capacity;
+    }
+    struct vm_decoded * dec = vm_predecode(t->code + head, end - head);
+    if (!dec)
+        return -1;
+    vm_optimize(dec);
+    struct vm_loop * loop = &t->loops[t->loop_count];
+    memset(loop, 0, sizeof(struct vm_loop));
+    loop->head = head;
+    loop->end = end;
+    loop->dec = dec;
+    return t->loop_count++;
+}
+
+// Runs the fused loop from its head until control leaves it
+static void vm_runloop(struct vm_context * ctx, struct vm_loop * loop) {
+    qword code_base = ctx->code_base, code_size = ctx->code_size, now = vm_now();
+    if (!vm_decode_current(loop->dec))
+        vm_decode_reset(loop->dec); // tier 0 wrote into the loop
+    vm_rundecoded(ctx, loop->dec);
+    ctx->code_base = code_base;
+    ctx->code_size = code_size;
+    loop->entries++;
+    loop->ns += vm_now() - now;
+}
+
+// Runs tiered code from its start, VMEM operands address `data`.
+// Returns enum vm_error, also left in ctx->error.
+static int vm_exectiered(struct vm_context * ctx, struct vm_tiered * t, char * data) {
+    qword base = (qword) t->code, size = t->code_size, start = vm_now(), looping = 0;
+    vm_load(ctx, t->code, size, data);
+    while ((uint64_t)(ctx->rip - base) < (uint64_t) size && !ctx->error) {
+        qword at = ctx->rip - base;
+        int32_t heat = t->heat[at];
+        if (heat < 0 && heat != VM_TIER_NEVER) {
+            struct vm_loop * loop = &t->loops[-1 - heat];
+            qword ns = loop->ns;
+            vm_runloop(ctx, loop);
+            looping += loop->ns - ns;
+            continue;
+        }
+        int op = at + 1 < size ? (unsigned char) t->code[at + 1] : (int) VM_OPCOUNT;
+        vm_eval(ctx, (char*) ctx->rip);
+        qword target = ctx->rip - base;
+        if (target <= at && target >= 0 && !ctx->error && t->heat[target] >= 0
+            && op != VM_CALLSUB && op != VM_RETSUB
+            && (qword) ++t->heat[target] >= t->threshold) {
+            int32_t loop = vm_tierup(t, target, at + GETFIRST(t->code[at]));
+            t->heat[target] = loop < 0 ? VM_TIER_NEVER : -1 - loop;
+        }
+    }
+    vm_yielded = 0;
+    t->interpreted_ns += vm_now() - start - looping;
+    return (int) ctx->error;
+}
+
+static void vm_tierreport(const struct vm_tiered * t, FILE * out) {
+    fprintf(out, "tier 0: %.3f ms\n", t->interpreted_ns / 1e6);
+    for (int32_t i = 0; i < t->loop_count; i++) {
+        const struct vm_loop * loop = &t->loops[i];
+        fprintf(out, "loop %lld..%lld: %lld entries, %.3f ms\n", (long long) loop->head,
+                (long long) loop->end, (long long) loop->entries, loop->ns / 1e6);
+    }
+}
+
+#endif
@@ -7,69 +7,59 @@ static int pow_normal(int n, int b) {
     return r;
 }
 
-static int pow_virt(int n, int b) {
-    struct vm_context * ctx = vm_makectx();
-    char code[] = {
-        // Load params into registers
-        // mov rax, n
-        JOINBITS(11, VM_VAL2REG),
-        VM_MOV,
-        JOINBITS(0, 0),
-        ENCODE_QWORD((qword)n), 
-        // mov rbx, b
-        JOINBITS(11, VM_VAL2REG),
-        VM_MOV,
-        JOINBITS(1, 0),
-        ENCODE_QWORD((qword)b), 
-        // int i = 0;
-        // mov rdx, 1 
-        JOINBITS(11, VM_VAL2REG),
-        VM_MOV, JOINBITS(3, 0),
-        ENCODE_QWORD(1), 
-        
-        // result
-        // mov rcx, rax
-        JOINBITS(3, VM_REG2REG), 
-        VM_MOV,
-        JOINBITS(2, 0),
-        
-        // loop start
-        // cmp rdx, rbx
-        JOINBITS(3, VM_REG2REG),
-        VM_CMP,
-        JOINBITS(3, 1),
-        
-        //  jge end_loop if (b >= i) jmp end_loop
-        // out of scope 
-        JOINBITS(10, VM_REG2REG),
-        VM_JGE,
-        ENCODE_QWORD(34), // jump to end_loop
-        
-        // mul rcx, rax
-        JOINBITS(3, VM_REG2REG),
-        VM_MUL,
-        JOINBITS(2, 0),
-        
-         // add rdx, 1
-        JOINBITS(11, VM_VAL2REG),
-        VM_ADD, JOINBITS(3, 0),
-        ENCODE_QWORD(1), 
-        
-        // jmp loop_start
-        JOINBITS(10, VM_VAL2REG),
-        VM_JMP,
-        ENCODE_QWORD(-27),
+// rax = n, rbx = b come from vm_call, so the code never changes
+static const char pow_code[] = {
+    // int i = 0;
+    // mov rdx, 1 
+    JOINBITS(11, VM_VAL2REG),
+    VM_MOV, JOINBITS(3, 0),
+    ENCODE_QWORD(1), 
+    
+    // result
+    // mov rcx, rax
+    JOINBITS(3, VM_REG2REG), 
+    VM_MOV,
+    JOINBITS(2, 0),
+    
+    // loop start
+    // cmp rdx, rbx
+    JOINBITS(3, VM_REG2REG),
+    VM_CMP,
+    JOINBITS(3, 1),
+    
+    //  jge end_loop if (b >= i) jmp end_loop
+    // out of scope 
+    JOINBITS(10, VM_REG2REG),
+    VM_JGE,
+    ENCODE_QWORD(34), // jump to end_loop
+    
+    // mul rcx, rax
+    JOINBITS(3, VM_REG2REG),
+    VM_MUL,
+    JOINBITS(2, 0),
+    
+     // add rdx, 1
+    JOINBITS(11, VM_VAL2REG),
+    VM_ADD, JOINBITS(3, 0),
+    ENCODE_QWORD(1), 
+    
+    // jmp loop_start
+    JOINBITS(10, VM_VAL2REG),
+    VM_JMP,
+    ENCODE_QWORD(-27),
 
-        // end_loop
-        // mov rax, rcx to return in rax
-        JOINBITS(3, VM_REG2REG),
-        VM_MOV,
-        JOINBITS(0, 2)
-    };
-    vm_exec(ctx, code, sizeof(code));
-    qword retval = ctx->rax;
-    vm_destroyctx(ctx);
-    return retval;
+    // end_loop
+    // mov rax, rcx to return in rax
+    JOINBITS(3, VM_REG2REG),
+    VM_MOV,
+    JOINBITS(0, 2)
+};
+
+static const struct vm_program pow_program = { pow_code, sizeof(pow_code) };
+
+static int pow_virt(int n, int b) {
+    qword args[] = { n, b };
+    return (int) vm_call(&pow_program, args, 2);
 }
 
 static void helloworld_vm() {
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "include/cvm.h"
+
+/*
+ Cooperative scheduling of many VM tasks on one thread with vm_run
+
+ Every task is a context that runs for a quantum of instructions, then goes
+ to the back of the ready queue. Tasks that read from the simulated device
+ call an import that yields; the task waits until its read completes and
+ picks up the result in rax. A task that uses up its total budget is killed,
+ which is how the endless loop below is stopped.
+
+ The same task mix runs once run-to-completion (first come, first served)
+ and once round-robin. Long tasks and the endless loop are queued first,
+ so run-to-completion makes every short task wait behind them.
+
+   cc -O2 scheduler.c -o scheduler && ./scheduler [quantum]
+*/
+
+#define SCHED_SHORT 64
+#define SCHED_IO 16
+#define SCHED_LONG 4
+#define SCHED_LIMIT 50000000 // instructions before a task is killed
+#define SCHED_IO_NS 200000   // latency of one simulated read
+
+struct sched_code {
+    char buf[256];
+    int n;
+};
+
+static void sched_ri(struct sched_code * c, int op, int reg, qword imm) {
+    char * p = c->buf + c->n;
+    p[0] = JOINBITS(11, VM_VAL2REG);
+    p[1] = op;
+    p[2] = JOINBITS(reg, 0);
+    memcpy(p + 3, &imm, 8);
+    c->n += 11;
+}
+
+static void sched_rr(struct sched_code * c, int op, int reg1, int reg2) {
+    char * p = c->buf + c->n;
+    p[0] = JOINBITS(3, VM_REG2REG);
+    p[1] = op;
+    p[2] = JOINBITS(reg1, reg2);
+    c->n += 3;
+}
+
+// Jumps are relative to their own start
+static void sched_jump(struct sched_code * c, int op, int target) {
+    char * p = c->buf + c->n;
+    qword offset = target - c->n;
+    p[0] = JOINBITS(10, VM_VAL2REG);
+    p[1] = op;
+    memcpy(p + 2, &offset, 8);
+    c->n += 10;
+}
+
+enum { RAX, RBX, RCX, RDX, R8, R9 };
+
+// rax += 0 + 1 + .. + iterations - 1, clobbers rbx and rdx
+static void sched_sum(struct sched_code * c, qword iterations) {
+    int head, exit;
+    sched_ri(c, VM_MOV, RBX, iterations);
+    sched_ri(c, VM_MOV, RDX, 0);
+    head = c->n;
+    sched_rr(c, VM_CMP, RDX, RBX);
+    exit = c->n;
+    sched_jump(c, VM_JGE, 0);
+    sched_rr(c, VM_ADD, RAX, RDX);
+    sched_ri(c, VM_ADD, RDX, 1);
+    sched_jump(c, VM_JMP, head);
+    qword offset = c->n - exit;
+    memcpy(c->buf + exit + 2, &offset, 8);
+}
+
+static void build_compute(struct sched_code * c, qword iterations) {
+    sched_ri(c, VM_MOV, RAX, 0);
+    sched_sum(c, iterations);
+}
+
+// Three reads from the device, each followed by some work on the result
+static void build_io(struct sched_code * c) {
+    int head;
+    sched_ri(c, VM_MOV, R8, 3);
+    sched_ri(c, VM_MOV, R9, 0);
+    head = c->n;
+    sched_ri(c, VM_MOV, RAX, 7);
+    sched_rr(c, VM_PUSH, RAX, 0);
+    sched_ri(c, VM_CALL, 1, 0); // import 0, the read
+    c->buf[c->n - 11] = JOINBITS(11, VM_IMPORT);
+    sched_sum(c, 2000);
+    sched_rr(c, VM_ADD, R9, RAX);
+    sched_ri(c, VM_SUB, R8, 1);
+    sched_ri(c, VM_CMP, R8, 0);
+    sched_jump(c, VM_JNE, head);
+    sched_rr(c, VM_MOV, RAX, R9);
+}
+
+static void build_endless(struct sched_code * c) {
+    sched_jump(c, VM_JMP, 0);
+}
+
+enum sched_kind { SCHED_KIND_SHORT, SCHED_KIND_IO, SCHED_KIND_LONG, SCHED_KIND_ENDLESS };
+static const char * const sched_kinds[] = { "short", "io", "long", "endless" };
+
+struct sched_task {
+    struct vm_context * ctx;
+    int kind, state;
+    qword used; // instructions so far
+    double ready_at; // when the pending read completes
+    double latency; // submission to completion
+};
+
+enum { SCHED_READY, SCHED_WAITING, SCHED_DONE, SCHED_KILLED };
+
+static struct sched_task * sched_current;
+
+// Starts an asynchronous read and suspends the task until it completes
+static void sched_read(qword fd) {
+    (void) fd;
+    sched_current->ready_at = vm_now() + SCHED_IO_NS;
+    vm_yield();
+}
+
+static struct sched_code sched_programs[4];
+static struct vm_native sched_imports[1];
+
+static int sched_cmp(const void * a, const void * b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Runs every task to the end with the given quantum, 0 runs each task until
+// it finishes or waits
+static void sched_run(struct sched_task * tasks, int count, qword quantum) {
+    int * queue = (int *) malloc((count + 1) * sizeof(int));
+    int head = 0, tail = 0, left = count;
+    double start = vm_now();
+    for (int i = 0; i < count; i++)
+        queue[tail++] = i;
+    while (left) {
+        double now = vm_now();
+        for (int i = 0; i < count; i++) {
+            if (tasks[i].state == SCHED_WAITING && tasks[i].ready_at <= now) {
+                tasks[i].ctx->rax = 42; // the read's result
+                tasks[i].state = SCHED_READY;
+                queue[tail++ % (count + 1)] = i;
+            }
+        }
+        if (head == tail)
+            continue; // everyone waits on the device
+        struct sched_task * task = &tasks[queue[head++ % (count + 1)]];
+        qword budget = SCHED_LIMIT - task->used;
+        if (quantum && quantum < budget)
+            budget = quantum;
+        sched_current = task;
+        int status = vm_run(task->ctx, budget);
+        task->used += task->ctx->executed;
+        if (status == VM_WAITING) {
+            task->state = SCHED_WAITING;
+            continue;
+        }
+        if (status == VM_OUT_OF_FUEL && task->used < SCHED_LIMIT) {
+            queue[tail++ % (count + 1)] = (int)(task - tasks);
+            continue;
+        }
+        task->state = status == VM_OUT_OF_FUEL ? SCHED_KILLED : SCHED_DONE;
+        task->latency = vm_now() - start;
+        left--;
+    }
+    free(queue);
+}
+
+static void sched_report(const char * policy, struct sched_task * tasks, int count) {
+    double latencies[SCHED_SHORT + SCHED_IO + SCHED_LONG + 1];
+    for (int kind = SCHED_KIND_SHORT; kind <= SCHED_KIND_ENDLESS; kind++) {
+        int n = 0, killed = 0;
+        for (int i = 0; i < count; i++) {
+            if (tasks[i].kind == kind) {
+                latencies[n++] = tasks[i].latency;
+                killed += tasks[i].state == SCHED_KILLED;
+            }
+        }
+        qsort(latencies, n, sizeof(double), sched_cmp);
+        printf("%-20s %-8s %5d %12.3f %12.3f %12.3f %7d\n", policy, sched_kinds[kind], n,
+               latencies[n / 2] / 1e6, latencies[(n * 99) / 100] / 1e6, latencies[n - 1] / 1e6, killed);
+    }
+}
+
+static void sched_bench(const char * policy, qword quantum) {
+    struct sched_task tasks[SCHED_SHORT + SCHED_IO + SCHED_LONG + 1];
+    int count = 0;
+    tasks[count++].kind = SCHED_KIND_ENDLESS;
+    for (int i = 0; i < SCHED_LONG; i++)
+        tasks[count++].kind = SCHED_KIND_LONG;
+    for (int i = 0; i < SCHED_SHORT + SCHED_IO; i++)
+        tasks[count++].kind = i % 5 == 4 ? SCHED_KIND_IO : SCHED_KIND_SHORT;
+    for (int i = 0; i < count; i++) {
+        struct sched_code * c = &sched_programs[tasks[i].kind];
+        struct vm_program program = { c->buf, (qword) c->n, 0, 0, 0, sched_imports, 1 };
+        tasks[i].ctx = vm_makectx();
+        tasks[i].state = SCHED_READY;
+        tasks[i].used = 0;
+        vm_loadprogram(tasks[i].ctx, &program);
+    }
+    sched_run(tasks, count, quantum);
+    sched_report(policy, tasks, count);
+    for (int i = 0; i < count; i++)
+        vm_destroyctx(tasks[i].ctx);
+}
+
+int main(int argc, char ** argv) {
+    qword quantum = argc > 1 ? atoll(argv[1]) : 10000;
+    char policy[64];
+    build_compute(&sched_programs[SCHED_KIND_SHORT], 5000);
+    build_io(&sched_programs[SCHED_KIND_IO]);
+    build_compute(&sched_programs[SCHED_KIND_LONG], 5000000);
+    build_endless(&sched_programs[SCHED_KIND_ENDLESS]);
+    vm_makenative(&sched_imports[0], (void *) sched_read, "v(q)");
+
+    printf("%d short, %d io, %d long and 1 endless task, killed after %d instructions\n\n",
+           SCHED_SHORT, SCHED_IO, SCHED_LONG, SCHED_LIMIT);
+    printf("%-20s %-8s %5s %12s %12s %12s %7s\n", "policy", "task", "count", "p50 ms", "p99 ms", "max ms", "killed");
+    sched_bench("run to completion", 0);
+    snprintf(policy, sizeof(policy), "round-robin %lld", (long long) quantum);
+    sched_bench(policy, quantum);
+    return 0;
+}
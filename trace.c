@@ -0,0 +1,492 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "include/cvm.h"
+
+/*
+ Offline analysis of vm_tracesave files
+
+ Reads a trace with the code it was recorded from and prints the opcode mix,
+ the hottest instructions, basic blocks and jumps, and the loops they close.
+ Blocks and jumps need every instruction, so sampled traces only get the
+ first two.
+
+ --replay runs the trace again on a shadow context. Instructions that only
+ depend on registers and flags are executed by vm_eval and checked against
+ the recorded register, flags and next offset; the rest (memory, stack, heap,
+ calls, LEA, and anything using rip or flags as an operand) take their
+ results from the records. Replay starts over at each slice's register
+ records, and after a gap waits for the next slice.
+
+   cc -O2 trace.c -o trace
+   ./trace --record demo.trace [period]   traces a small built-in program
+   ./trace demo.trace [--replay] [--top n]
+*/
+
+#define TRACE_TOP 10
+
+struct trace_file {
+    struct vm_tracefile header;
+    char * code; // code_size bytes and zeroes for a truncated last instruction
+    struct vm_tracerecord * records;
+};
+
+struct trace_edge {
+    int32_t from, to; // from -1: free slot
+    qword count;
+};
+
+struct trace_stats {
+    qword ops[256][16];
+    qword * hits; // per code offset
+    qword * blocks; // per code offset: basic blocks entered there
+    qword * block_insns; // instructions run by those blocks
+    struct trace_edge * edges; // taken jumps, open addressing on (from, to)
+    qword edge_mask, edge_count;
+    qword instructions, slices, gaps, foreign;
+};
+
+// A line of a top-n table
+struct trace_row {
+    qword count;
+    int32_t a, b;
+};
+
+static int trace_load(struct trace_file * t, const char * path) {
+    FILE * in = fopen(path, "rb");
+    int ok = 0;
+    memset(t, 0, sizeof(struct trace_file));
+    if (!in) {
+        perror(path);
+        return 0;
+    }
+    if (fread(&t->header, sizeof(t->header), 1, in) != 1 || memcmp(t->header.magic, "CVMTRACE", 8))
+        fprintf(stderr, "%s: not a trace\n", path);
+    else if (t->header.version != VM_TRACE_VERSION || t->header.record_size != sizeof(struct vm_tracerecord))
+        fprintf(stderr, "%s: trace version %u, expected %d\n", path, t->header.version, VM_TRACE_VERSION);
+    else {
+        t->code = (char*) calloc((size_t) t->header.code_size + 16, 1);
+        t->records = (struct vm_tracerecord*) malloc((size_t) t->header.records * sizeof(struct vm_tracerecord) + 1);
+        if (!t->code || !t->records)
+            fprintf(stderr, "%s: out of memory\n", path);
+        else if (fread(t->code, 1, (size_t) t->header.code_size, in) != (size_t) t->header.code_size
+                 || fread(t->records, sizeof(struct vm_tracerecord), (size_t) t->header.records, in)
+                    != (size_t) t->header.records)
+            fprintf(stderr, "%s: truncated\n", path);
+        else
+            ok = 1;
+    }
+    fclose(in);
+    return ok;
+}
+
+static const char * trace_opname(int op) {
+    return vm_opnames[op < VM_OPCOUNT ? op : VM_OPCOUNT];
+}
+
+// VM_LOAD and VM_STORE variants are widths, vector variants are shapes
+static const char * trace_variantname(int op, int variant) {
+    static const char * const widths[4] = { "byte", "word", "dword", "qword" };
+    static const char * const shapes[8] = { "b128", "w128", "d128", "q128", "b256", "w256", "d256", "q256" };
+    if (op >= VM_VADD && op <= VM_VEXTRACT && variant <= (VM_V256 | VM_QWORD))
+        return shapes[variant];
+    return (op == VM_LOAD || op == VM_STORE) && variant <= VM_QWORD ? widths[variant] : vm_variantnames[variant];
+}
+
+static qword trace_edgeslot(const struct trace_edge * edges, qword mask, int32_t from, int32_t to) {
+    qword i = (((uint64_t) from << 32 | (uint32_t) to) * 0x9e3779b97f4a7c15ull >> 20) & mask;
+    while (edges[i].from >= 0 && (edges[i].from != from || edges[i].to != to))
+        i = (i + 1) & mask;
+    return i;
+}
+
+static void trace_addedge(struct trace_stats * s, int32_t from, int32_t to) {
+    if ((s->edge_count + 1) * 2 > s->edge_mask + 1) { // keep it at most half full
+        qword size = (s->edge_mask + 1) * 2;
+        struct trace_edge * edges = (struct trace_edge*) malloc(size * sizeof(struct trace_edge));
+        memset(edges, 0xff, size * sizeof(struct trace_edge));
+        for (qword i = 0; i <= s->edge_mask; i++)
+            if (s->edges[i].from >= 0)
+                edges[trace_edgeslot(edges, size - 1, s->edges[i].from, s->edges[i].to)] = s->edges[i];
+        free(s->edges);
+        s->edges = edges;
+        s->edge_mask = size - 1;
+    }
+    qword i = trace_edgeslot(s->edges, s->edge_mask, from, to);
+    if (s->edges[i].from < 0) {
+        s->edges[i].from = from;
+        s->edges[i].to = to;
+        s->edges[i].count = 0;
+        s->edge_count++;
+    }
+    s->edges[i].count++;
+}
+
+static void trace_analyze(const struct trace_file * t, struct trace_stats * s) {
+    qword size = t->header.code_size;
+    int32_t prev = -1, block = -1;
+    int ours = 1; // the slice runs the saved code
+    memset(s, 0, sizeof(struct trace_stats));
+    s->hits = (qword*) calloc((size_t) size + 1, sizeof(qword));
+    s->blocks = (qword*) calloc((size_t) size + 1, sizeof(qword));
+    s->block_insns = (qword*) calloc((size_t) size + 1, sizeof(qword));
+    s->edge_mask = 63;
+    s->edges = (struct trace_edge*) malloc(64 * sizeof(struct trace_edge));
+    memset(s->edges, 0xff, 64 * sizeof(struct trace_edge));
+    for (qword i = 0; i < t->header.records; i++) {
+        const struct vm_tracerecord * r = &t->records[i];
+        if (r->variant & VM_TRACE_GAP) {
+            s->gaps++;
+            prev = block = -1;
+        }
+        if (r->op == VM_TRACE_ENTRY) {
+            if (r->reg == 0)
+                s->slices++;
+            if (r->reg == 12)
+                ours = r->value == t->header.code_base;
+            prev = block = -1;
+            continue;
+        }
+        if (!ours || r->offset < 0 || (qword) r->offset >= size) {
+            s->foreign++;
+            continue;
+        }
+        s->instructions++;
+        s->ops[r->op][r->variant & 15]++;
+        s->hits[r->offset]++;
+        if (t->header.period != 1)
+            continue;
+        // A record that doesn't follow its predecessor was reached by a jump
+        if (prev >= 0 && r->offset != prev + GETFIRST(t->code[prev])) {
+            trace_addedge(s, prev, r->offset);
+            block = -1;
+        }
+        if (block < 0) {
+            block = r->offset;
+            s->blocks[block]++;
+        }
+        s->block_insns[block]++;
+        prev = r->offset;
+    }
+}
+
+static int trace_byrow(const void * a, const void * b) {
+    const struct trace_row * x = (const struct trace_row*) a, * y = (const struct trace_row*) b;
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->a != y->a ? (x->a < y->a ? -1 : 1) : (x->b > y->b) - (x->b < y->b);
+}
+
+// Sorts rows by count, highest first, and returns how many to print
+static qword trace_top(struct trace_row * rows, qword n, qword top) {
+    qsort(rows, (size_t) n, sizeof(struct trace_row), trace_byrow);
+    return n < top ? n : top;
+}
+
+static void trace_report(const struct trace_file * t, const struct trace_stats * s, qword top) {
+    qword size = t->header.code_size, n = 0, shown;
+    struct trace_row * rows = (struct trace_row*) malloc((size_t)(size + s->edge_count + 256 * 16 + 1) * sizeof(struct trace_row));
+    double total = s->instructions ? (double) s->instructions : 1;
+
+    printf("%lld records, %lld instructions in %lld slices, period %u, %lld bytes of code\n",
+           (long long) t->header.records, (long long) s->instructions, (long long) s->slices,
+           t->header.period, (long long) size);
+    if (t->header.dropped || s->gaps)
+        printf("%lld records dropped, %lld gaps\n", (long long) t->header.dropped, (long long) s->gaps);
+    if (s->foreign)
+        printf("%lld records from other code skipped\n", (long long) s->foreign);
+
+    for (int op = 0; op < 256; op++)
+        for (int v = 0; v < 16; v++)
+            if (s->ops[op][v])
+                rows[n].count = s->ops[op][v], rows[n].a = op, rows[n++].b = v;
+    shown = trace_top(rows, n, top);
+    printf("\n%-8s %-9s %14s %7s\n", "opcode", "variant", "count", "share");
+    for (qword i = 0; i < shown; i++)
+        printf("%-8s %-9s %14lld %6.1f%%\n", trace_opname(rows[i].a), trace_variantname(rows[i].a, rows[i].b),
+               (long long) rows[i].count, 100 * rows[i].count / total);
+
+    n = 0;
+    for (qword at = 0; at < size; at++)
+        if (s->hits[at])
+            rows[n].count = s->hits[at], rows[n].a = (int32_t) at, rows[n++].b = 0;
+    shown = trace_top(rows, n, top);
+    printf("\n%-8s %14s %7s  %s\n", "offset", "hits", "share", "instruction");
+    for (qword i = 0; i < shown; i++) {
+        const char * instr = t->code + rows[i].a;
+        printf("0x%06x %14lld %6.1f%%  %s %s\n", (unsigned) rows[i].a, (long long) rows[i].count,
+               100 * rows[i].count / total, trace_opname((unsigned char) instr[1]),
+               trace_variantname((unsigned char) instr[1], GETSECOND(instr[0])));
+    }
+
+    if (t->header.period != 1) {
+        free(rows);
+        return;
+    }
+    n = 0;
+    for (qword at = 0; at < size; at++)
+        if (s->blocks[at])
+            rows[n].count = s->block_insns[at], rows[n].a = (int32_t) at, rows[n++].b = 0;
+    shown = trace_top(rows, n, top);
+    printf("\n%-8s %14s %14s %9s %7s\n", "block", "entered", "instructions", "avg len", "share");
+    for (qword i = 0; i < shown; i++) {
+        qword entered = s->blocks[rows[i].a];
+        printf("0x%06x %14lld %14lld %9.1f %6.1f%%\n", (unsigned) rows[i].a, (long long) entered,
+               (long long) rows[i].count, (double) rows[i].count / entered, 100 * rows[i].count / total);
+    }
+
+    n = 0;
+    for (qword i = 0; i <= s->edge_mask; i++)
+        if (s->edges[i].from >= 0)
+            rows[n].count = s->edges[i].count, rows[n].a = s->edges[i].from, rows[n++].b = s->edges[i].to;
+    shown = trace_top(rows, n, top);
+    printf("\n%-8s    %-8s %14s\n", "jump", "to", "taken");
+    for (qword i = 0; i < shown; i++)
+        printf("0x%06x -> 0x%06x %14lld%s\n", (unsigned) rows[i].a, (unsigned) rows[i].b,
+               (long long) rows[i].count, rows[i].b <= rows[i].a ? "  back" : "");
+
+    // A backward jump closes a loop from its target to the jump
+    printf("\n%-19s %14s %14s\n", "loop", "iterations", "instructions");
+    for (qword i = 0, printed = 0; i < n && printed < top; i++) {
+        qword insns = 0;
+        if (rows[i].b > rows[i].a)
+            continue;
+        for (int32_t at = rows[i].b; at <= rows[i].a; at++)
+            insns += s->hits[at];
+        printf("0x%06x..0x%06x %14lld %14lld\n", (unsigned) rows[i].b, (unsigned) rows[i].a,
+               (long long) rows[i].count, (long long) insns);
+        printed++;
+    }
+    free(rows);
+}
+
+// Whether replay has to take an instruction's results from the trace: it
+// reads memory, the stack, subroutine frames, a native function, the code's
+// address or vector registers (traces hold none), or uses rip or flags as an
+// operand
+static int trace_external(const char * instr) {
+    int op = (unsigned char) instr[1], variant = GETSECOND(instr[0]), r1 = GETFIRST(instr[2]), r2 = GETSECOND(instr[2]);
+    switch (op) {
+    case VM_ADD: case VM_SUB: case VM_DIV: case VM_MUL:
+    case VM_XOR: case VM_SHR: case VM_SHL: case VM_CMP: case VM_MOV:
+        if (variant == VM_VAL2REG)
+            return r1 == 12 || r1 == 13;
+        if (variant == VM_REG2REG)
+            return r1 == 12 || r1 == 13 || r2 == 12 || r2 == 13;
+        return op == VM_MOV;
+    case VM_JMP:
+        return variant == VM_REG2REG && (r1 == 12 || r1 == 13);
+    case VM_LEA: case VM_CALL: case VM_RET: case VM_PUSH: case VM_POP:
+    case VM_CALLSUB: case VM_RETSUB:
+    case VM_LOAD: case VM_STORE:
+    case VM_MEMCPY: case VM_MEMSET: case VM_MEMCMP: case VM_FINDBYTE:
+        return 1;
+    }
+    return op >= VM_VADD && op <= VM_VEXTRACT;
+}
+
+// Returns the index of the first record that disagrees, or the record count
+static qword trace_replay(const struct trace_file * t) {
+    struct vm_context * shadow = vm_makectx();
+    qword checked = 0, taken = 0, skipped = 0, i, size = t->header.code_size;
+    qword base = (qword) t->code;
+    int synced = 0, known = 0; // a slice's registers are in, the next offset is known
+    const char * why = 0;
+    shadow->code_base = base;
+    shadow->code_size = size;
+    for (i = 0; i < t->header.records; i++) {
+        const struct vm_tracerecord * r = &t->records[i];
+        if (r->variant & VM_TRACE_GAP)
+            synced = 0;
+        if (r->op == VM_TRACE_ENTRY) {
+            if (r->reg == 0)
+                synced = !(r->variant & VM_TRACE_GAP);
+            if (r->reg == 12)
+                synced &= r->value == t->header.code_base;
+            else
+                shadow->regs[r->reg & 15] = r->value;
+            shadow->flags = (shadow->flags & ~(qword) 0xff) | r->flags;
+            known = 0;
+            continue;
+        }
+        if (!synced) {
+            skipped++;
+            continue;
+        }
+        char * instr = t->code + r->offset;
+        if (known && r->offset != shadow->rip - base)
+            why = "went elsewhere";
+        else if (r->offset < 0 || (qword) r->offset >= size)
+            why = "left the code";
+        else if ((unsigned char) instr[1] != r->op || GETSECOND(instr[0]) != (r->variant & 15))
+            why = "ran different code";
+        if (why)
+            break;
+        shadow->rip = base + r->offset;
+        if (trace_external(instr)) {
+            int reg = vm_tracereg(instr);
+            if (reg == 13)
+                shadow->flags = r->value;
+            else {
+                if (reg != VM_TRACE_NOREG && reg != 12)
+                    shadow->regs[reg] = r->value;
+                shadow->flags = (shadow->flags & ~(qword) 0xff) | r->flags;
+            }
+            shadow->rip += GETFIRST(instr[0]);
+            known = r->op != VM_RET && r->op != VM_CALLSUB && r->op != VM_RETSUB && reg != 12;
+            taken++;
+            continue;
+        }
+        int reg = vm_tracereg(instr);
+        if (instr[1] == VM_DIV && (GETSECOND(instr[0]) == VM_VAL2REG ? !*(qword*)(instr + 3)
+            : GETSECOND(instr[0]) == VM_REG2REG && !shadow->regs[GETSECOND(instr[2])])) {
+            why = "divides by zero";
+            break;
+        }
+        vm_eval(shadow, instr);
+        if (reg != VM_TRACE_NOREG && shadow->regs[reg] != r->value)
+            why = "wrote a different value";
+        else if ((uint8_t) shadow->flags != r->flags)
+            why = "set different flags";
+        if (why)
+            break;
+        known = 1;
+        checked++;
+    }
+    if (why) {
+        const struct vm_tracerecord * r = &t->records[i];
+        printf("replay: record %lld at 0x%06x (%s %s) %s, after %lld checked\n", (long long) i,
+               (unsigned) r->offset, trace_opname(r->op), trace_variantname(r->op, r->variant & 15), why, (long long) checked);
+    } else
+        printf("replay: %lld instructions checked, %lld taken from the trace, %lld skipped\n",
+               (long long) checked, (long long) taken, (long long) skipped);
+    vm_destroyctx(shadow);
+    return i;
+}
+
+// The program --record traces: sums mix(i * i, i) for i < rbx, keeps the
+// running sum in the heap and mixes it back in
+static qword trace_mix(qword a, qword b) {
+    return (a ^ b) + 1;
+}
+
+static void trace_ri(char * c, int * n, int op, int reg, qword imm) {
+    c[*n] = JOINBITS(11, VM_VAL2REG);
+    c[*n + 1] = op;
+    c[*n + 2] = JOINBITS(reg, 0);
+    memcpy(c + *n + 3, &imm, 8);
+    *n += 11;
+}
+
+static void trace_rr(char * c, int * n, int op, int reg1, int reg2) {
+    c[*n] = JOINBITS(3, VM_REG2REG);
+    c[*n + 1] = op;
+    c[*n + 2] = JOINBITS(reg1, reg2);
+    *n += 3;
+}
+
+static void trace_jump(char * c, int * n, int op, int target) {
+    qword offset = target - *n;
+    c[*n] = JOINBITS(10, VM_VAL2REG);
+    c[*n + 1] = op;
+    memcpy(c + *n + 2, &offset, 8);
+    *n += 10;
+}
+
+// Heap access of a qword at [base], r10 is 0 so the index adds nothing
+static void trace_heap(char * c, int * n, int op, int reg, int base) {
+    dword disp = 0;
+    c[*n] = JOINBITS(8, VM_QWORD);
+    c[*n + 1] = op;
+    c[*n + 2] = JOINBITS(reg, base);
+    c[*n + 3] = JOINBITS(10, 0);
+    memcpy(c + *n + 4, &disp, 4);
+    *n += 8;
+}
+
+static int trace_record(const char * path, uint32_t period) {
+    enum { RAX, RBX, RCX, RDX, R8, R9, R10, R11 };
+    static char code[512];
+    static qword heap[8];
+    static struct vm_native imports[1];
+    int n = 0, head, exit;
+    trace_ri(code, &n, VM_MOV, R9, 0);
+    trace_ri(code, &n, VM_MOV, RCX, 0);
+    head = n;
+    trace_rr(code, &n, VM_CMP, RCX, RBX);
+    exit = n;
+    trace_jump(code, &n, VM_JGE, 0);
+    trace_rr(code, &n, VM_MOV, RDX, RCX);
+    trace_rr(code, &n, VM_MUL, RDX, RCX);
+    trace_rr(code, &n, VM_PUSH, RDX, 0);
+    trace_rr(code, &n, VM_PUSH, RCX, 0);
+    trace_ri(code, &n, VM_CALL, 2, 0); // import 0, trace_mix
+    code[n - 11] = JOINBITS(11, VM_IMPORT);
+    trace_rr(code, &n, VM_ADD, R9, RAX);
+    trace_heap(code, &n, VM_STORE, R9, R10);
+    trace_heap(code, &n, VM_LOAD, R11, R10);
+    trace_ri(code, &n, VM_SHR, R11, 3);
+    trace_rr(code, &n, VM_XOR, R9, R11);
+    trace_rr(code, &n, VM_XOR, R9, RCX);
+    trace_ri(code, &n, VM_ADD, RCX, 1);
+    trace_jump(code, &n, VM_JMP, head);
+    qword offset = n - exit;
+    memcpy(code + exit + 2, &offset, 8);
+    trace_rr(code, &n, VM_MOV, RAX, R9);
+
+    vm_makenative(&imports[0], (void *) trace_mix, "q(qq)");
+    struct vm_program program = { code, (qword) n, 0, 0, 0, imports, 1 };
+    struct vm_context * ctx = vm_makectx();
+    struct vm_trace * trace = vm_maketrace(1 << 16, period);
+    FILE * out = fopen(path, "wb");
+    if (!ctx || !trace || !out) {
+        perror(path);
+        return 1;
+    }
+    vm_setheap(ctx, heap, sizeof(heap));
+    vm_settrace(ctx, trace);
+    vm_loadprogram(ctx, &program);
+    ctx->rbx = 1000;
+    while (vm_run(ctx, 5000) == VM_OUT_OF_FUEL) // slices, each opens with its registers
+        ;
+    printf("result %lld, error %s\n", (long long) ctx->rax, vm_errorstr(ctx->error));
+    int failed = vm_tracesave(trace, out);
+    fclose(out);
+    vm_destroytrace(trace);
+    vm_destroyctx(ctx);
+    return failed;
+}
+
+int main(int argc, char ** argv) {
+    struct trace_file t;
+    struct trace_stats s;
+    qword top = TRACE_TOP;
+    int replay = 0;
+    const char * path = 0;
+    if (argc > 2 && !strcmp(argv[1], "--record"))
+        return trace_record(argv[2], argc > 3 ? (uint32_t) atoi(argv[3]) : 1);
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--replay"))
+            replay = 1;
+        else if (!strcmp(argv[i], "--top") && i + 1 < argc)
+            top = atoll(argv[++i]);
+        else
+            path = argv[i];
+    }
+    if (!path) {
+        fprintf(stderr, "usage: %s trace [--replay] [--top n] | --record trace [period]\n", argv[0]);
+        return 2;
+    }
+    if (!trace_load(&t, path))
+        return 1;
+    trace_analyze(&t, &s);
+    trace_report(&t, &s, top);
+    if (replay) {
+        printf("\n");
+        if (t.header.period != 1)
+            printf("replay: needs a trace of every instruction, this one has period %u\n", t.header.period);
+        else if (trace_replay(&t) != t.header.records)
+            return 1;
+    }
+    return 0;
+}